@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "VectorOps.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Postfix (RPN) expressions
+// A program like "a b * c exp + sqrt" is compiled once into a small bytecode
+// that can be evaluated with a set of scalar bindings, or with vectors of
+// bindings where it is evaluated in blocks using the vectorized kernels.
+//
+// The scalar evaluation uses std::sqrt and std::exp, the vector one the
+// approximate kernels of VectorOps.hpp, so the results of sqrt and exp may
+// differ between them within the error bounds of the kernels.
+///////////////////////////////////////////////////////////////////////////////
+
+class Program {
+public:
+    enum class OpCode : uint8_t {
+        LOAD_VARIABLE,
+        LOAD_CONSTANT,
+        SUM,
+        SUB,
+        MUL,
+        DIV,
+        SQRT,
+        EXP
+    };
+
+    struct Instruction {
+        OpCode code;
+        uint16_t operand;  // Variable or constant index of the load opcodes
+    };
+
+public:
+    Program() : max_stack_(0) {}
+
+    // Returns false if the program is not a valid postfix expression
+    bool Compile(const std::string& source) {
+        source_ = source;
+        code_.clear();
+        constants_.clear();
+        variables_.clear();
+        max_stack_ = 0;
+
+        std::stringstream stream(source);
+        std::string token;
+        size_t stack = 0;
+
+        while (stream >> token) {
+            Instruction instruction{OpCode::LOAD_CONSTANT, 0};
+            size_t operands = 0;
+
+            if (token == "+") {
+                instruction.code = OpCode::SUM;
+                operands = 2;
+            } else if (token == "-") {
+                instruction.code = OpCode::SUB;
+                operands = 2;
+            } else if (token == "*") {
+                instruction.code = OpCode::MUL;
+                operands = 2;
+            } else if (token == "/") {
+                instruction.code = OpCode::DIV;
+                operands = 2;
+            } else if (token == "sqrt") {
+                instruction.code = OpCode::SQRT;
+                operands = 1;
+            } else if (token == "exp") {
+                instruction.code = OpCode::EXP;
+                operands = 1;
+            } else if (std::isalpha(static_cast<unsigned char>(token[0])) ||
+                       token[0] == '_') {
+                instruction.code = OpCode::LOAD_VARIABLE;
+                instruction.operand = AddVariable(token);
+            } else {
+                char* end = nullptr;
+                float value = std::strtof(token.c_str(), &end);
+                if (*end != '\0') return false;  // Invalid token
+                instruction.code = OpCode::LOAD_CONSTANT;
+                instruction.operand = static_cast<uint16_t>(constants_.size());
+                constants_.push_back(value);
+            }
+
+            // Check the stack never underflows
+            if (stack < operands) return false;
+            stack = (operands == 0) ? stack + 1 : stack - operands + 1;
+            max_stack_ = std::max(max_stack_, stack);
+
+            code_.push_back(instruction);
+        }
+
+        // The program must leave exactly one value in the stack
+        return stack == 1 && variables_.size() < UINT16_MAX &&
+               constants_.size() < UINT16_MAX;
+    }
+
+    const std::string& GetSource() const {
+        return source_;
+    }
+
+    // Variables referenced by the program, the bindings must be passed in
+    // this same order
+    const std::vector<std::string>& GetVariables() const {
+        return variables_;
+    }
+
+    float Evaluate(const std::vector<float>& bindings) const {
+        std::vector<float> stack;
+        stack.reserve(max_stack_);
+
+        for (const Instruction& instruction : code_) {
+            float operand = 0.f;
+            if (instruction.code != OpCode::LOAD_VARIABLE &&
+                instruction.code != OpCode::LOAD_CONSTANT) {
+                operand = stack.back();
+            }
+
+            switch (instruction.code) {
+                case OpCode::LOAD_VARIABLE:
+                    stack.push_back(bindings[instruction.operand]);
+                    break;
+                case OpCode::LOAD_CONSTANT:
+                    stack.push_back(constants_[instruction.operand]);
+                    break;
+                case OpCode::SUM:
+                    stack.pop_back();
+                    stack.back() += operand;
+                    break;
+                case OpCode::SUB:
+                    stack.pop_back();
+                    stack.back() -= operand;
+                    break;
+                case OpCode::MUL:
+                    stack.pop_back();
+                    stack.back() *= operand;
+                    break;
+                case OpCode::DIV:
+                    stack.pop_back();
+                    stack.back() =
+                        (operand != 0) ? stack.back() / operand : 0.f;
+                    break;
+                case OpCode::SQRT:
+                    stack.back() = std::sqrt(operand);
+                    break;
+                case OpCode::EXP:
+                    stack.back() = std::exp(operand);
+                    break;
+            }
+        }
+
+        return stack.back();
+    }
+
+    // Evaluate the program for each element of the bindings, all of them must
+    // have the same size or a single element that is used for all of them.
+    // Returns an empty vector if the sizes don't match.
+    std::vector<float> Evaluate(
+        const std::vector<std::vector<float>>& bindings) const {
+        size_t size = 1;
+        for (auto& binding : bindings) {
+            if (binding.size() == 1) continue;
+            if (size != 1 && binding.size() != size) {
+                return std::vector<float>();
+            }
+            size = binding.size();
+        }
+
+        std::vector<float> result(size);
+        std::vector<float> stack(max_stack_ * kBlockSize);
+
+        for (size_t begin = 0; begin < size; begin += kBlockSize) {
+            size_t count =
+                (size - begin < kBlockSize) ? size - begin : kBlockSize;
+            size_t depth = 0;
+
+            for (const Instruction& instruction : code_) {
+                // The stack is stored as consecutive blocks of values
+                float* block = stack.data() + depth * kBlockSize;
+
+                switch (instruction.code) {
+                    case OpCode::LOAD_VARIABLE: {
+                        auto& binding = bindings[instruction.operand];
+                        if (binding.size() == 1) {
+                            std::fill(block, block + count, binding[0]);
+                        } else {
+                            std::copy(binding.begin() + begin,
+                                      binding.begin() + begin + count, block);
+                        }
+                        depth++;
+                        break;
+                    }
+                    case OpCode::LOAD_CONSTANT:
+                        std::fill(block, block + count,
+                                  constants_[instruction.operand]);
+                        depth++;
+                        break;
+                    case OpCode::SUM:
+                        depth--;
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorSum(block, block + kBlockSize, block, count);
+                        break;
+                    case OpCode::SUB:
+                        depth--;
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorSub(block, block + kBlockSize, block, count);
+                        break;
+                    case OpCode::MUL:
+                        depth--;
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorMul(block, block + kBlockSize, block, count);
+                        break;
+                    case OpCode::DIV:
+                        depth--;
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorDiv(block, block + kBlockSize, block, count);
+                        break;
+                    case OpCode::SQRT:
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorSqrt(block, block, count);
+                        break;
+                    case OpCode::EXP:
+                        block = stack.data() + (depth - 1) * kBlockSize;
+                        VectorExp(block, block, count);
+                        break;
+                }
+            }
+
+            std::copy(stack.data(), stack.data() + count,
+                      result.begin() + begin);
+        }
+
+        return result;
+    }
+
+private:
+    uint16_t AddVariable(const std::string& name) {
+        for (size_t i = 0; i < variables_.size(); i++) {
+            if (variables_[i] == name) return static_cast<uint16_t>(i);
+        }
+        variables_.push_back(name);
+        return static_cast<uint16_t>(variables_.size() - 1);
+    }
+
+private:
+    static const size_t kBlockSize = 256;
+
+    std::string source_;
+    std::vector<Instruction> code_;
+    std::vector<float> constants_;
+    std::vector<std::string> variables_;
+    size_t max_stack_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Compiled programs cache
+// Programs are stored by the hash of its source, the cache is not thread
+// safe so each worker thread must have its own.
+///////////////////////////////////////////////////////////////////////////////
+
+class ProgramCache {
+public:
+    ProgramCache(size_t capacity = 1024) : capacity_(capacity) {}
+
+    // Returns nullptr if the program can't be compiled
+    const Program* Get(const std::string& source) {
+        size_t hash = std::hash<std::string>()(source);
+
+        auto it = programs_.find(hash);
+        if (it != programs_.end() && it->second.GetSource() == source) {
+            return &it->second;
+        }
+
+        Program program;
+        if (!program.Compile(source)) return nullptr;
+
+        // Drop all the programs when full, the working set is usually small
+        if (programs_.size() >= capacity_) programs_.clear();
+
+        Program& cached = programs_[hash];
+        cached = std::move(program);
+        return &cached;
+    }
+
+private:
+    size_t capacity_;
+    std::unordered_map<size_t, Program> programs_;
+};
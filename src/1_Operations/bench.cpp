@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.hpp>
+
+#include <Util/Histogram.hpp>
+#include <Util/Serializer.hpp>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    std::string endpoint = "tcp://localhost:4242";
+    size_t connections = 16;
+    size_t threads = 0;
+    double duration = 10.0;  // seconds
+    double rate = 0.0;       // total requests per second, 0 is closed loop
+    double drain = 5.0;      // seconds waiting for the last responses
+    size_t vector_size = 1024;
+    std::string mix = "sum:1";
+};
+
+struct Operation {
+    std::string name;
+    size_t weight;
+    std::string payload;  // Pre-serialized request
+};
+
+struct Connection {
+    Connection(zmq::context_t& context) : socket(context, ZMQ_DEALER) {
+        // The unanswered requests must not block the exit
+        const int linger = 0;
+        socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    }
+
+    zmq::socket_t socket;
+    bool waiting = false;
+    Clock::time_point intended;  // When the request should have been sent
+    Clock::time_point sent;      // When the request was actually sent
+};
+
+struct ThreadResult {
+    Histogram service_time;   // From the actual send time
+    Histogram response_time;  // From the intended send time
+    uint64_t completed = 0;
+    uint64_t unanswered = 0;  // Without response after the drain
+};
+
+static const char* HELP = R"(Usage: Operations_Bench [options]
+    --endpoint ENDPOINT     Server endpoint (default tcp://localhost:4242)
+    --connections N         Number of concurrent connections (default 16)
+    --threads N             Number of client threads (default all the cores)
+    --duration SECONDS      Duration of the test (default 10)
+    --rate N                Requests per second for all the connections, open
+                            loop at a fixed rate, 0 is closed loop (default 0)
+    --mix OPERATIONS        Weighted list of operations (default sum:1)
+                            e.g. sum:4,div:1,vexp:2,eval:1
+    --vector-size N         Number of elements of the vector operations
+                            (default 1024)
+    --drain SECONDS         Time waiting for the responses after the test,
+                            the requests still unanswered are errors
+                            (default 5)
+)";
+
+bool ParseOptions(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        if (i + 1 >= argc) return false;
+        std::string value(argv[++i]);
+        try {
+            if (option == "--endpoint") {
+                options.endpoint = value;
+            } else if (option == "--connections") {
+                options.connections = std::stoul(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoul(value);
+            } else if (option == "--duration") {
+                options.duration = std::stod(value);
+            } else if (option == "--rate") {
+                options.rate = std::stod(value);
+            } else if (option == "--mix") {
+                options.mix = value;
+            } else if (option == "--vector-size") {
+                options.vector_size = std::stoul(value);
+            } else if (option == "--drain") {
+                options.drain = std::stod(value);
+            } else {
+                return false;
+            }
+        } catch (std::exception& e) {
+            return false;
+        }
+    }
+    return options.connections > 0 && options.duration > 0 &&
+           options.rate >= 0 && options.vector_size > 0 && options.drain >= 0;
+}
+
+bool BuildPayload(const std::string& name, size_t vector_size,
+                  std::string& payload) {
+    Serializer request;
+    std::vector<float> list(vector_size, 1.5f);
+
+    request << name;
+    if (name == "sum" || name == "sub" || name == "mul" || name == "div") {
+        request << 1.5f << 2.5f;
+    } else if (name == "sqrt" || name == "exp") {
+        request << 1.5f;
+    } else if (name == "vsum" || name == "vsub" || name == "vmul" ||
+               name == "vdiv") {
+        request << list << list;
+    } else if (name == "vsqrt" || name == "vexp") {
+        request << list;
+    } else if (name == "eval") {
+        request << "a b * c exp + sqrt"
+                << std::vector<std::string>{"a", "b", "c"}
+                << std::vector<float>{1.f, 2.f, 3.f};
+    } else if (name == "veval") {
+        request << "a b * c exp + sqrt"
+                << std::vector<std::string>{"a", "b", "c"}
+                << std::vector<std::vector<float>>{list, list, list};
+    } else {
+        return false;
+    }
+
+    payload.assign(request.data(), request.size());
+    return true;
+}
+
+bool ParseMix(const BenchOptions& options, std::vector<Operation>& mix) {
+    std::stringstream stream(options.mix);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        Operation operation;
+        size_t separator = item.find(':');
+        operation.name = item.substr(0, separator);
+        operation.weight = 1;
+        if (separator != std::string::npos) {
+            try {
+                operation.weight = std::stoul(item.substr(separator + 1));
+            } catch (std::exception& e) {
+                return false;
+            }
+        }
+        if (!BuildPayload(operation.name, options.vector_size,
+                          operation.payload)) {
+            return false;
+        }
+        mix.push_back(operation);
+    }
+    return !mix.empty();
+}
+
+void RunConnections(zmq::context_t& context, const BenchOptions& options,
+                    const std::vector<Operation>& mix, size_t num_connections,
+                    Clock::time_point start, ThreadResult& result) {
+    std::vector<Connection> connections;
+    connections.reserve(num_connections);
+    for (size_t i = 0; i < num_connections; i++) {
+        connections.emplace_back(context);
+        connections.back().socket.connect(options.endpoint);
+    }
+
+    // Pick the operations using its weights
+    std::vector<size_t> weights;
+    for (auto& operation : mix) weights.push_back(operation.weight);
+    std::mt19937 rng(std::random_device{}());
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+    // In open loop each connection sends a request every interval, spread
+    // evenly so the connections don't send at the same time
+    bool open_loop = options.rate > 0;
+    Clock::duration interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(
+            open_loop ? options.connections / options.rate : 0.0));
+    for (size_t i = 0; i < num_connections; i++) {
+        connections[i].intended = start + interval * i / num_connections;
+    }
+
+    Clock::time_point end =
+        start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(options.duration));
+    // The responses that didn't arrive by then are lost, the server may
+    // have dropped them or died
+    Clock::time_point deadline =
+        end + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(options.drain));
+
+    std::vector<zmq::pollitem_t> items(num_connections);
+    for (size_t i = 0; i < num_connections; i++) {
+        items[i] = {static_cast<void*>(connections[i].socket), 0, ZMQ_POLLIN,
+                    0};
+    }
+
+    while (true) {
+        Clock::time_point now = Clock::now();
+        Clock::time_point next_send = Clock::time_point::max();
+        bool pending = false;
+
+        // Send the requests that are due
+        for (auto& connection : connections) {
+            if (connection.waiting) {
+                pending = true;
+                continue;
+            }
+            if (connection.intended >= end) continue;
+            if (connection.intended <= now) {
+                const Operation& operation = mix[pick(rng)];
+                connection.sent = Clock::now();
+                connection.socket.send("", 0, ZMQ_SNDMORE);
+                connection.socket.send(operation.payload.data(),
+                                       operation.payload.size());
+                connection.waiting = true;
+                pending = true;
+            } else {
+                next_send = std::min(next_send, connection.intended);
+            }
+        }
+
+        if (!pending && next_send == Clock::time_point::max()) break;
+        if (next_send == Clock::time_point::max() && now >= deadline) {
+            for (auto& connection : connections) {
+                if (connection.waiting) result.unanswered++;
+            }
+            break;
+        }
+
+        // Only the drain is waited once there is nothing more to send
+        Clock::time_point wake = std::min(next_send, deadline);
+        long timeout = static_cast<long>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                wake - Clock::now())
+                .count());
+        timeout = std::max(0L, timeout);
+        zmq::poll(items.data(), static_cast<int>(items.size()), timeout);
+
+        for (size_t i = 0; i < num_connections; i++) {
+            if (!(items[i].revents & ZMQ_POLLIN)) continue;
+            Connection& connection = connections[i];
+
+            // Receive the empty delimiter and the response
+            zmq::message_t msg;
+            connection.socket.recv(&msg);
+            connection.socket.recv(&msg);
+            Clock::time_point received = Clock::now();
+
+            result.service_time.Record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    received - connection.sent)
+                    .count());
+            result.response_time.Record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    received - connection.intended)
+                    .count());
+            result.completed++;
+
+            connection.waiting = false;
+            if (open_loop) {
+                connection.intended += interval;
+            } else {
+                connection.intended = received;
+            }
+        }
+    }
+}
+
+void PrintHistogram(const std::string& name, const Histogram& histogram) {
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    std::cout << std::fixed << std::setprecision(1) << name << " (us):"
+              << " p50 " << us(histogram.Percentile(50))
+              << " p99 " << us(histogram.Percentile(99))
+              << " p99.9 " << us(histogram.Percentile(99.9))
+              << " max " << us(histogram.Max())
+              << " mean " << us(histogram.Mean()) << "\n";
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    std::vector<Operation> mix;
+
+    if (!ParseOptions(argc, argv, options) || !ParseMix(options, mix)) {
+        std::cout << HELP;
+        return 1;
+    }
+
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    options.threads = std::min(options.threads, options.connections);
+
+    zmq::context_t context(static_cast<int>((options.threads + 3) / 4));
+
+    std::cout << "Running " << options.duration << "s against "
+              << options.endpoint << " with " << options.connections
+              << " connections on " << options.threads << " threads, ";
+    if (options.rate > 0) {
+        std::cout << "open loop at " << options.rate << " requests/s\n";
+    } else {
+        std::cout << "closed loop\n";
+    }
+
+    // Start all the threads at the same time
+    Clock::time_point start = Clock::now() + std::chrono::milliseconds(100);
+
+    std::vector<ThreadResult> results(options.threads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.threads; i++) {
+        size_t num_connections = options.connections / options.threads +
+                                 (i < options.connections % options.threads);
+        threads.emplace_back(RunConnections, std::ref(context),
+                             std::cref(options), std::cref(mix),
+                             num_connections, start, std::ref(results[i]));
+    }
+
+    ThreadResult total;
+    for (size_t i = 0; i < options.threads; i++) {
+        threads[i].join();
+        total.service_time.Merge(results[i].service_time);
+        total.response_time.Merge(results[i].response_time);
+        total.completed += results[i].completed;
+        total.unanswered += results[i].unanswered;
+    }
+
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << "Requests: " << total.completed << "\n";
+    if (total.unanswered > 0) {
+        std::cout << "Errors: " << total.unanswered
+                  << " requests without response\n";
+    }
+    std::cout << "Throughput: " << std::fixed << std::setprecision(1)
+              << total.completed / elapsed << " requests/s\n";
+    PrintHistogram("Service time", total.service_time);
+    if (options.rate > 0) {
+        // Measured from the time the request should have been sent, this
+        // includes the time waiting for the previous request of the
+        // connection, so it is free of coordinated omission
+        PrintHistogram("Response time (corrected)", total.response_time);
+    }
+
+    return total.unanswered > 0 ? 1 : 0;
+}
@@ -1,33 +1,178 @@
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 #include <zmq.hpp>
 
+#include <Util/Options.hpp>
 #include <Util/Serializer.hpp>
 
+// Parse a comma separated list of numbers, e.g. "1,2.5,-3"
+bool ParseList(const std::string& str, std::vector<float>& list) {
+    std::stringstream stream(str);
+    std::string number;
+    while (std::getline(stream, number, ',')) {
+        try {
+            list.push_back(std::stof(number));
+        } catch (std::exception& e) {
+            return false;
+        }
+    }
+    return !list.empty();
+}
+
+void PrintResult(Deserializer& response, bool is_vector) {
+    if (is_vector) {
+        std::vector<float> result;
+        response >> result;
+
+        std::cout << "Result: [";
+        for (size_t i = 0; i < result.size(); i++) {
+            if (i != 0) std::cout << ",";
+            std::cout << result[i];
+        }
+        std::cout << "]\n";
+    } else {
+        float result;
+        response >> result;
+
+        std::cout << "Result: " << result << "\n";
+    }
+}
+
+// Evaluate a postfix program in the server, e.g. "a b * c exp + sqrt" with the
+// bindings a=1 b=2 c=3, or with lists of values a=1,2,3 for veval
+int Evaluate(const std::string& endpoint, const std::string& operation,
+             const std::string& program, int num_bindings, char** bindings) {
+    bool is_vector = operation == "veval";
+
+    std::vector<std::string> names;
+    std::vector<float> values;
+    std::vector<std::vector<float>> lists;
+
+    for (int i = 0; i < num_bindings; ++i) {
+        std::string binding(bindings[i]);
+        size_t separator = binding.find('=');
+        std::vector<float> list;
+        if (separator == std::string::npos ||
+            !ParseList(binding.substr(separator + 1), list) ||
+            (!is_vector && list.size() != 1)) {
+            std::cerr << "Invalid binding '" << binding
+                      << "', expected name=value.\n";
+            return 3;
+        }
+        names.push_back(binding.substr(0, separator));
+        values.push_back(list[0]);
+        lists.push_back(list);
+    }
+
+    // initialize the 0MQ context
+    zmq::context_t context(1);
+
+    // generate a request socket
+    zmq::socket_t socket(context, ZMQ_REQ);
+    socket.connect(endpoint);
+
+    // compose a message from the program and its bindings
+    Serializer request;
+    request << operation << program << names;
+    if (is_vector) {
+        request << lists;
+    } else {
+        request << values;
+    }
+    std::cout << "Sending program.\n";
+    socket.send(request.data(), request.size());
+
+    zmq::message_t msg;
+    socket.recv(&msg);
+    Deserializer response(std::move(msg));
+
+    PrintResult(response, is_vector);
+
+    return 0;
+}
+
+// Print the allocations of each operation in the server, they are only
+// tracked when it is built with ALLOCATION_TRACKING
+int AllocationStats(const std::string& endpoint) {
+    zmq::context_t context(1);
+    zmq::socket_t socket(context, ZMQ_REQ);
+    socket.connect(endpoint);
+
+    Serializer request;
+    request << "alloc_stats";
+    socket.send(request.data(), request.size());
+
+    zmq::message_t msg;
+    socket.recv(&msg);
+    Deserializer response(std::move(msg));
+
+    std::string report;
+    response >> report;
+    std::cout << report << "\n";
+
+    return 0;
+}
+
 int main(int argc, char** argv) {
-    const std::string endpoint = "tcp://localhost:5555";
+    std::string endpoint = "tcp://localhost:4242";
+    TakeOption(argc, argv, "--endpoint", endpoint);
 
-    if (argc < 2) {
+    if (argc < 2 || !IsValidEndpoint(endpoint)) {
         std::cout << "usage: " << argv[0]
-                  << " [sum|sub|mul|div|sqrt|exp] operands...\n";
+                  << " [sum|sub|mul|div|sqrt|exp] operands...\n"
+                  << "       " << argv[0]
+                  << " [vsum|vsub|vmul|vdiv|vsqrt|vexp] lists...\n"
+                  << "       " << argv[0]
+                  << " [eval|veval] program name=value...\n"
+                  << "       " << argv[0] << " alloc_stats\n"
+                  << "options: --endpoint ENDPOINT (default "
+                     "tcp://localhost:4242)\n";
         return 1;
     }
 
     std::string operation(argv[1]);
 
+    if (operation == "alloc_stats") return AllocationStats(endpoint);
+
     if (argc != 4 && (operation == "sum" || operation == "sub" ||
-                      operation == "mul" || operation == "div")) {
+                      operation == "mul" || operation == "div" ||
+                      operation == "vsum" || operation == "vsub" ||
+                      operation == "vmul" || operation == "vdiv")) {
         std::cerr << "Invalid number of operands, expected 2.\n";
         return 2;
-    } else if (argc != 3 && (operation == "sqrt" || operation == "exp")) {
+    } else if (argc != 3 && (operation == "sqrt" || operation == "exp" ||
+                             operation == "vsqrt" || operation == "vexp")) {
         std::cerr << "Invalid number of operands, expected 1.\n";
         return 2;
     }
 
+    bool is_vector = operation.size() > 1 && operation[0] == 'v';
+
+    if (operation == "eval" || operation == "veval") {
+        if (argc < 3) {
+            std::cerr << "Invalid number of operands, expected a program.\n";
+            return 2;
+        }
+        return Evaluate(endpoint, operation, argv[2], argc - 3,
+                        argv + 3);
+    }
+
     int num_operands = argc - 2;
     std::vector<float> operands(num_operands);
+    std::vector<std::vector<float>> lists(num_operands);
 
     for (int i = 0; i < num_operands; ++i) {
+        if (is_vector) {
+            if (!ParseList(argv[2 + i], lists[i])) {
+                std::cerr << "Invalid operand, expected a list of numbers "
+                             "separated by commas.\n";
+                return 3;
+            }
+            continue;
+        }
         try {
             operands[i] = std::stof(std::string(argv[2 + i]));
         } catch (std::exception& e) {
@@ -48,21 +193,23 @@ int main(int argc, char** argv) {
 
     // compose a message from a operation and a operands
     request << operation;
-    for (auto& operand : operands) {
-        request << operand;
+    if (is_vector) {
+        for (auto& list : lists) {
+            request << list;
+        }
+    } else {
+        for (auto& operand : operands) {
+            request << operand;
+        }
     }
     std::cout << "Sending operands.\n";
     socket.send(request.data(), request.size());
 
-    float result;
-
     zmq::message_t msg;
     socket.recv(&msg);
-    Deserializer response(static_cast<char*>(msg.data()), msg.size());
-
-    response >> result;
+    Deserializer response(std::move(msg));
 
-    std::cout << "Result: " << result << "\n";
+    PrintResult(response, is_vector);
 
     return 0;
 }
@@ -1,39 +1,143 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <functional>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <zmq.hpp>
 
+#include <Util/AllocationHooks.hpp>
+#include <Util/Log.hpp>
+#include <Util/Options.hpp>
 #include <Util/Serializer.hpp>
 
-int main(int /*argc*/, char** /*argv*/) {
-    const std::string endpoint = "tcp://*:4242";
+#include "Expression.hpp"
+#include "VectorOps.hpp"
 
-    // initialize the 0MQ context
-    zmq::context_t context(1);
+// Apply a binary vector operation, if one of the operands has a single
+// element it is used with all the elements of the other operand
+template <typename Operation>
+std::vector<float> BinaryVectorOperation(std::vector<float>& operands1,
+                                         std::vector<float>& operands2,
+                                         Operation operation) {
+    if (operands1.size() == 1 && operands2.size() > 1) {
+        operands1.resize(operands2.size(), operands1[0]);
+    } else if (operands2.size() == 1 && operands1.size() > 1) {
+        operands2.resize(operands1.size(), operands2[0]);
+    }
 
-    // generate a reply socket
-    zmq::socket_t socket(context, ZMQ_REP);
+    if (operands1.size() != operands2.size()) {
+        LOG_WARNING("Invalid operands, size mismatch.");
+        return std::vector<float>();
+    }
 
-    // bind to the socket
-    std::cout << "Binding to " << endpoint << "...\n";
-    socket.bind(endpoint);
+    std::vector<float> result(operands1.size());
+    operation(operands1.data(), operands2.data(), result.data(),
+              result.size());
+    return result;
+}
 
-    while (true) {
-        // Get the serialized data
-        zmq::message_t msg;
-        socket.recv(&msg);
-        Deserializer request(static_cast<char*>(msg.data()), msg.size());
+template <typename Operation>
+std::vector<float> UnaryVectorOperation(const std::vector<float>& operands,
+                                        Operation operation) {
+    std::vector<float> result(operands.size());
+    operation(operands.data(), result.data(), result.size());
+    return result;
+}
+
+// Sort the bindings in the order of the program variables, returns false if
+// a variable doesn't have a binding
+template <typename T>
+bool ResolveBindings(const Program& program,
+                     const std::vector<std::string>& names,
+                     const std::vector<T>& values, std::vector<T>& bindings) {
+    if (names.size() != values.size()) return false;
+
+    bindings.clear();
+    for (auto& variable : program.GetVariables()) {
+        auto it = std::find(names.begin(), names.end(), variable);
+        if (it == names.end()) return false;
+        bindings.push_back(values[it - names.begin()]);
+    }
+    return true;
+}
+
+// Name of the operation in the allocation statistics, "invalid" if it is
+// not one, so the clients can't fill the statistics with their own names
+const char* OperationName(const std::string& operation) {
+    static const char* const kOperations[] = {
+        "alloc_stats", "sum",  "sub",  "mul",  "div",   "sqrt", "exp",  "eval",
+        "vsum",        "vsub", "vmul", "vdiv", "vsqrt", "vexp", "veval"};
+    for (const char* name : kOperations) {
+        if (operation == name) return name;
+    }
+    return "invalid";
+}
+
+void ProcessRequest(Deserializer& request, Serializer& response,
+                    ProgramCache& programs, AllocationScope& allocations) {
+    std::string operation;
+    request >> operation;
+    LOG_DEBUG("Operation: " << operation);
+    allocations.SetName(OperationName(operation));
 
-        std::cout << "Receiving message...\n";
+    if (operation == "alloc_stats") {
+        // Allocations of each operation, when the tracking is enabled
+        std::ostringstream report;
+        AllocationTracker::Instance().WriteJSON(report);
+        response << report.str();
+        return;
+    }
+
+    if (operation.size() > 1 && operation[0] == 'v') {
+        // Array operations, each operand is a list of numbers
+        std::vector<float> operands1, operands2;
+        std::vector<float> result;
+
+        if (operation == "vsum") {
+            request >> operands1 >> operands2;
+            result = BinaryVectorOperation(operands1, operands2, VectorSum);
+        } else if (operation == "vsub") {
+            request >> operands1 >> operands2;
+            result = BinaryVectorOperation(operands1, operands2, VectorSub);
+        } else if (operation == "vmul") {
+            request >> operands1 >> operands2;
+            result = BinaryVectorOperation(operands1, operands2, VectorMul);
+        } else if (operation == "vdiv") {
+            request >> operands1 >> operands2;
+            result = BinaryVectorOperation(operands1, operands2, VectorDiv);
+        } else if (operation == "vsqrt") {
+            request >> operands1;
+            result = UnaryVectorOperation(operands1, VectorSqrt);
+        } else if (operation == "vexp") {
+            request >> operands1;
+            result = UnaryVectorOperation(operands1, VectorExp);
+        } else if (operation == "veval") {
+            std::string source;
+            std::vector<std::string> names;
+            std::vector<std::vector<float>> values, bindings;
+            request >> source >> names >> values;
 
-        std::string operation;
+            const Program* program = programs.Get(source);
+            if (program && ResolveBindings(*program, names, values, bindings)) {
+                result = program->Evaluate(bindings);
+            } else {
+                LOG_WARNING("Invalid program or bindings.");
+            }
+        } else {
+            LOG_WARNING("Invalid operation: " << operation);
+        }
+
+        response << result;
+        LOG_DEBUG("Sent: " << result.size() << " results");
+    } else {
         float operand1 = 0;
         float operand2 = 1;
         float result;
 
-        request >> operation;
-        std::cout << "Operation: " << operation << "\n";
-
         if (operation == "sum") {
             request >> operand1 >> operand2;
             result = operand1 + operand2;
@@ -56,17 +160,123 @@ int main(int /*argc*/, char** /*argv*/) {
         } else if (operation == "exp") {
             request >> operand1;
             result = std::exp(operand1);
+        } else if (operation == "eval") {
+            std::string source;
+            std::vector<std::string> names;
+            std::vector<float> values, bindings;
+            request >> source >> names >> values;
+
+            const Program* program = programs.Get(source);
+            if (program && ResolveBindings(*program, names, values, bindings)) {
+                result = program->Evaluate(bindings);
+            } else {
+                LOG_WARNING("Invalid program or bindings.");
+                result = 0.f;
+            }
         } else {
-            std::cerr << "Invalid operation.\n";
+            LOG_WARNING("Invalid operation: " << operation);
             result = 0.f;
         }
 
-        // Fill the data to send
-        Serializer response;
         response << result;
+        LOG_DEBUG("Sent: " << result);
+    }
+}
 
-        socket.send(response.data(), response.size());
+void ServeRequests(zmq::socket_t& socket) {
+    // Compiled programs of the eval operations
+    ProgramCache programs;
 
-        std::cout << "Sent: " << result << "\n";
+    // Expected size of the responses, so their buffers don't have to grow
+    CapacityHint response_hint;
+
+    while (true) {
+        // Get the serialized data
+        zmq::message_t msg;
+        socket.recv(&msg);
+
+        // The allocations until the response is sent are added to the
+        // operation of the request
+        AllocationScope allocations;
+        Deserializer request(std::move(msg));
+
+        // Fill the data to send
+        Serializer response(response_hint);
+        ProcessRequest(request, response, programs, allocations);
+
+        // The response buffer is handed to ZMQ without copying it
+        zmq::message_t reply = response.Release();
+        socket.send(reply);
     }
 }
+
+void Worker(zmq::context_t& context, const std::string& endpoint) {
+    // generate a reply socket connected to the broker
+    zmq::socket_t socket(context, ZMQ_REP);
+    socket.connect(endpoint);
+
+    ServeRequests(socket);
+}
+
+int main(int argc, char** argv) {
+    std::string endpoint = "tcp://*:4242";
+    const std::string workers_endpoint = "inproc://workers";
+
+    std::string workers_option = "1";
+    TakeOption(argc, argv, "--endpoint", endpoint);
+    TakeOption(argc, argv, "--workers", workers_option);
+
+    size_t num_workers = 0;
+    try {
+        num_workers = std::stoul(workers_option);
+    } catch (std::exception& e) {
+        num_workers = 0;
+    }
+
+    if (argc != 1 || num_workers == 0 || !IsValidEndpoint(endpoint)) {
+        std::cout << "usage: " << argv[0]
+                  << " [--workers N] [--endpoint ENDPOINT]\n";
+        return 1;
+    }
+
+    // initialize the 0MQ context, with an I/O thread every 4 workers
+    zmq::context_t context(static_cast<int>((num_workers + 3) / 4));
+
+    if (num_workers == 1) {
+        // Single threaded mode, serve the requests from a reply socket
+        zmq::socket_t socket(context, ZMQ_REP);
+
+        LOG_INFO("Binding to " << endpoint << "...");
+        socket.bind(endpoint);
+
+        ServeRequests(socket);
+        return 0;
+    }
+
+    // Broker mode, the requests are received by a router socket and load
+    // balanced to the workers through a dealer socket. Each REQ client has
+    // at most one request in flight, so the replies are always received in
+    // the same order the requests were sent.
+    zmq::socket_t frontend(context, ZMQ_ROUTER);
+    zmq::socket_t backend(context, ZMQ_DEALER);
+
+    LOG_INFO("Binding to " << endpoint << "...");
+    frontend.bind(endpoint);
+    backend.bind(workers_endpoint);
+
+    // The inproc endpoint must be bound before the workers connect to it
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        workers.emplace_back(Worker, std::ref(context), workers_endpoint);
+    }
+    LOG_INFO("Started " << num_workers << " workers");
+
+    zmq::proxy(static_cast<void*>(frontend), static_cast<void*>(backend),
+               nullptr);
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cctype>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Util/AllocationTracker.hpp>
+#include <Util/LinearAlgebra.hpp>
+#include <Util/Log.hpp>
+#include <Util/Matrix.hpp>
+#include <Util/Serializer.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// MatrixOps request handlers
+// Shared by the MatrixOps server and the embedded server (see Embedded/), the
+// socket and the compression of the frames are left to the caller.
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const Matrix<T>& m) {
+    os << "[";
+    for (size_t j = 0; j < m.NumRows(); j++) {
+        // if (j != 0) os << " ";
+        os << "[";
+        for (size_t i = 0; i < m.NumCols(); i++) {
+            os << m(i, j);
+            if (i != m.NumCols() - 1) os << ",";
+            // if (i != m.NumCols() - 1) os << ", ";
+        }
+        os << "]";
+        // if (j != m.NumRows() - 1) os << "\n";
+    }
+    os << "]";
+    return os;
+}
+
+template <typename T>
+int ParseMatrix(const std::string& str, Matrix<T>& m) {
+    int ncols = -1;
+    int nrows = 0;
+    int num_brackets = 0;
+
+    int num_numbers = 0;
+
+    std::vector<T> v;
+
+    std::string number_str;
+
+    auto add_number = [&number_str, &v]() -> bool {
+        T number = static_cast<T>(std::stod(number_str));
+        v.push_back(number);
+        number_str.clear();
+        return true;
+    };
+
+    for (auto& token : str) {
+        if (std::isdigit(token) || token == '.' || token == '-') {
+            number_str.push_back(token);
+        } else if (token == ',') {
+            add_number();
+            num_numbers += 1;
+        } else if (token == '[') {
+            num_brackets++;
+        } else if (token == ']') {
+            num_brackets--;
+            if (!number_str.empty()) {
+                num_numbers += 1;
+                nrows += 1;
+
+                add_number();
+
+                if (ncols == -1) {
+                    ncols = num_numbers;
+                } else if (num_numbers != ncols) {
+                    // inconsistent row size
+                    return 1;
+                }
+
+                num_numbers = 0;
+            }
+        }
+    }
+
+    if (num_brackets != 0) {
+        // missmatched brackets
+        return 2;
+    }
+
+    m.SetSize(nrows, ncols);
+    m.SetData(v);
+
+    return 0;
+}
+
+// Name of the operation in the allocation statistics, "invalid" if it is
+// not one, so the clients can't fill the statistics with their own names
+inline const char* OperationName(const std::string& operation) {
+    static const char* const kOperations[] = {"alloc_stats", "mul",
+                                              "det",         "inverse",
+                                              "inverse_mp",  "solve"};
+    for (const char* name : kOperations) {
+        if (operation == name) return name;
+    }
+    return "invalid";
+}
+
+// Reads the operation and its matrices from the request and writes the
+// result, the allocations are added to the name of the operation
+inline void ProcessRequest(Deserializer& request, Serializer& response,
+                           AllocationScope& allocations) {
+    std::string operation;
+    request >> operation;
+    LOG_DEBUG("Operation: " << operation);
+    allocations.SetName(OperationName(operation));
+
+    std::stringstream stream;
+    double condition = -1.0;
+
+    if (operation == "alloc_stats") {
+        // Allocations of each operation, when the tracking is enabled
+        AllocationTracker::Instance().WriteJSON(stream);
+    } else if (operation == "mul") {
+        std::string matrix1_data, matrix2_data;
+        request >> matrix1_data >> matrix2_data;
+
+        Matrix<float> matrix1, matrix2;
+
+        ParseMatrix(matrix1_data, matrix1);
+        ParseMatrix(matrix2_data, matrix2);
+        LOG_DEBUG("First Matrix: " << matrix1);
+        LOG_DEBUG("Second Matrix: " << matrix2);
+
+        Matrix<float> result = matrix1 * matrix2;
+
+        stream << result;
+        LOG_DEBUG("Sent: " << result);
+    } else if (operation == "det") {
+        std::string matrix_data;
+        request >> matrix_data;
+
+        Matrix<float> matrix;
+
+        ParseMatrix(matrix_data, matrix);
+
+        float value = Determinant(matrix);
+        LOG_DEBUG("Matrix: " << matrix);
+
+        stream << value;
+        LOG_DEBUG("Sent: " << value);
+    } else if (operation == "inverse") {
+        std::string matrix_data;
+        request >> matrix_data;
+
+        Matrix<float> matrix;
+
+        ParseMatrix(matrix_data, matrix);
+
+        Matrix<float> result = Inverse(matrix);
+        LOG_DEBUG("Matrix: " << matrix);
+
+        stream << result;
+        LOG_DEBUG("Sent: " << result);
+    } else if (operation == "inverse_mp") {
+        std::string matrix_data;
+        request >> matrix_data;
+
+        Matrix<double> matrix;
+
+        ParseMatrix(matrix_data, matrix);
+
+        RefinedSolution<Matrix<double>> result = MixedPrecisionInverse(matrix);
+        LOG_DEBUG("Matrix: " << matrix);
+
+        stream.precision(17);
+        stream << result.value;
+        condition = result.condition;
+        LOG_DEBUG("Sent: " << result.value << " Condition: " << condition);
+    } else if (operation == "solve") {
+        std::string matrix_data, vector_data;
+        request >> matrix_data >> vector_data;
+
+        Matrix<double> matrix, vector;
+
+        ParseMatrix(matrix_data, matrix);
+        ParseMatrix(vector_data, vector);
+
+        RefinedSolution<std::vector<double>> result =
+            MixedPrecisionSolve(matrix, vector.GetData());
+        LOG_DEBUG("Matrix: " << matrix);
+        LOG_DEBUG("Vector: " << vector);
+
+        Matrix<double> solution(result.value.size(), 1);
+        solution.SetData(result.value);
+
+        stream.precision(17);
+        stream << solution;
+        condition = result.condition;
+        LOG_DEBUG("Sent: " << solution << " Condition: " << condition);
+    }
+
+    response << stream.str();
+
+    // The mixed precision operations also send the condition estimate
+    if (condition >= 0.0) {
+        response << condition;
+    }
+}
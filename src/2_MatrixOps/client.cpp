@@ -1,23 +1,31 @@
 #include <iostream>
 #include <string>
+#include <utility>
 #include <zmq.hpp>
 
+#include <Util/Options.hpp>
 #include <Util/Serializer.hpp>
 
 int main(int argc, char** argv) {
-    const std::string endpoint = "tcp://localhost:4242";
-
-    if (argc < 2) {
-        std::cout << "usage: " << argv[0] << " [mul|det|inverse] matrices...\n";
+    std::string endpoint = "tcp://localhost:4242";
+    TakeOption(argc, argv, "--endpoint", endpoint);
+
+    if (argc < 2 || !IsValidEndpoint(endpoint)) {
+        std::cout << "usage: " << argv[0]
+                  << " [mul|det|inverse|inverse_mp|solve] matrices...\n"
+                  << "       " << argv[0] << " alloc_stats\n"
+                  << "options: --endpoint ENDPOINT (default "
+                     "tcp://localhost:4242)\n";
         return 1;
     }
 
     std::string operation(argv[1]);
 
-    if (argc != 4 && operation == "mul") {
-        std::cerr << "Invalid number of matrices, expected 1.\n";
+    if (argc != 4 && (operation == "mul" || operation == "solve")) {
+        std::cerr << "Invalid number of matrices, expected 2.\n";
         return 2;
-    } else if (argc != 3 && (operation == "det" || operation == "inverse")) {
+    } else if (argc != 3 && (operation == "det" || operation == "inverse" ||
+                             operation == "inverse_mp")) {
         std::cerr << "Invalid number of matrices, expected 1.\n";
         return 2;
     }
@@ -45,17 +53,26 @@ int main(int argc, char** argv) {
         request << matrix;
     }
     std::cout << "Sending matrices.\n";
-    socket.send(request.data(), request.size());
+
+    // Big matrices are compressed, the server then compresses the response
+    lz::Context compression;
+    request.Compress(compression);
+    zmq::message_t request_msg = request.Release();
+    socket.send(request_msg);
 
     std::string result;
+    double condition = -1.0;
 
     zmq::message_t msg;
     socket.recv(&msg);
-    Deserializer response(static_cast<char*>(msg.data()), msg.size());
+    Deserializer response(std::move(msg));
 
-    response >> result;
+    response >> result >> condition;
 
     std::cout << "Result: " << result << "\n";
+    if (condition >= 0.0) {
+        std::cout << "Condition: " << condition << "\n";
+    }
 
     return 0;
 }
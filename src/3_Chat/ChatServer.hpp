@@ -0,0 +1,1278 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <Util/AllocationTracker.hpp>
+#include <Util/IdSet.hpp>
+#include <Util/Log.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/Trace.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+#include "DataBase.hpp"
+#include "DurableStore.hpp"
+#include "HistoryStore.hpp"
+#include "OfflineInbox.hpp"
+#include "OutboundQueues.hpp"
+#include "Protocol.hpp"
+#include "ServerCodes.hpp"
+#include "ServerStats.hpp"
+#include "SessionToken.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Chat server
+// The state of the server and the dispatch of the requests, used by
+// Chat_Server, its shards (see ShardedServer.hpp) and by the embedded server
+// (see Embedded/). Everything runs in the thread that calls Dispatch.
+//
+// With a DurableStore the changes of the database are logged and the
+// response of a request that changed it is held until the change is
+// durable. The other requests are not delayed, only the later responses to
+// the same identity wait behind a held one so each client gets them in
+// order.
+//
+// With an OfflineInbox the whispers, voice messages and group messages for
+// users that are not connected are kept until they log in.
+///////////////////////////////////////////////////////////////////////////////
+
+// TODO: Check if incomming parameters are valid
+
+using NetIdentity = std::string;
+
+// The user is connected while it has identities
+struct UserConnection {
+    SessionToken token;
+    std::vector<NetIdentity> identities;
+};
+
+// The call is active since its first participant joins until the last one
+// leaves the group
+struct GroupCall {
+    bool active = false;
+    IdSet participants;
+};
+
+// Identity of a connected member of a group
+struct OnlineMember {
+    UserId user;
+    NetIdentity identity;
+    bool compressed;  // The identity negotiated compression
+};
+
+// Update sent to several identities. The first send moves the frame to a
+// zmq::message_t, and each recipient gets a copy made with zmq_msg_copy that
+// only adds a reference to the payload, so a big update is never copied per
+// recipient. The frame is compressed at most once, for the identities that
+// negotiated compression. The updates of a traced request carry its trace
+// id. The class sets its priority in the outbound queues.
+struct OutgoingUpdate {
+    OutgoingUpdate(CapacityHint& hint, uint64_t trace_id, OutboundClass type)
+          : raw(hint),
+            type(type),
+            released(false),
+            compression_tried(false),
+            compressed_valid(false) {
+        if (trace_id) Pack(raw, TraceEnvelope(trace_id, trace::Now()));
+    }
+
+    // Message of a recipient, compressed if a context is given and it is
+    // worth it. The update can't be packed after the first call.
+    zmq::message_t Frame(lz::Context* compression) {
+        if (!released) {
+            frame = raw.Release();
+            released = true;
+        }
+        if (compression) {
+            if (!compression_tried) {
+                compression_tried = true;
+                Serializer output;
+                compressed_valid = Serializer::Compress(
+                    *compression, static_cast<const char*>(frame.data()),
+                    frame.size(), output);
+                if (compressed_valid) compressed_frame = output.Release();
+            }
+            if (compressed_valid) return Share(compressed_frame);
+        }
+        return Share(frame);
+    }
+
+    static zmq::message_t Share(zmq::message_t& message) {
+        zmq::message_t copy;
+        copy.copy(&message);
+        return copy;
+    }
+
+    Serializer raw;
+    OutboundClass type;
+    zmq::message_t frame;
+    zmq::message_t compressed_frame;
+    bool released;
+    bool compression_tried;
+    bool compressed_valid;
+};
+
+class ServerState {
+public:
+    // Expected size of each message type, to start their Serializers with
+    // a buffer big enough
+    struct MessageHints {
+        CapacityHint response;
+        CapacityHint whisper;
+        CapacityHint msg_group;
+        CapacityHint voice_msg;
+        CapacityHint call_data;
+    };
+
+public:
+    ServerState(zmqw::socket& socket, DataBase& db)
+          : socket_(socket),
+            database_(db),
+            store_(nullptr),
+            uncommitted_(0),
+            inbox_(nullptr),
+            drain_user_(kInvalidId),
+            drain_compressed_(false),
+            history_(nullptr),
+            outbound_(nullptr),
+            send_classes_(false),
+            num_group_calls_(0),
+            shard_(0),
+            num_shards_(1),
+            trace_(0) {}
+
+    zmqw::socket& GetSocket() {
+        return socket_;
+    }
+
+    DataBase& GetDataBase() {
+        return database_;
+    }
+
+    // The session tokens of the shard are generated so they are routed back
+    // to it, see ShardedServer.hpp
+    void SetShard(size_t shard, size_t num_shards) {
+        shard_ = shard;
+        num_shards_ = num_shards;
+    }
+
+    // The database is only kept in memory without a store. The store must be
+    // opened over the database first.
+    void SetStore(DurableStore* store) {
+        store_ = store;
+    }
+
+    DurableStore* GetStore() {
+        return store_;
+    }
+
+    // Without an inbox the messages for users that are not connected fail,
+    // or are not sent to the group members that are not connected
+    void SetInbox(OfflineInbox* inbox) {
+        inbox_ = inbox;
+    }
+
+    OfflineInbox* GetInbox() {
+        return inbox_;
+    }
+
+    // Without a history the conversations are not kept and the history
+    // requests are answered with empty pages
+    void SetHistory(HistoryWriter* history) {
+        history_ = history;
+    }
+
+    // Without outbound queues the messages are sent to the socket as they
+    // are, the queues must be over the same socket
+    void SetOutbound(OutboundQueues* outbound) {
+        outbound_ = outbound;
+    }
+
+    OutboundQueues* GetOutbound() {
+        return outbound_;
+    }
+
+    // The messages are sent with a frame with their OutboundClass after the
+    // identity, for the front-end of the shards that queues them
+    void SetSendClasses(bool send_classes) {
+        send_classes_ = send_classes;
+    }
+
+    MessageHints& GetHints() {
+        return hints_;
+    }
+
+    ServerStats& GetStats() {
+        return stats_;
+    }
+
+    // Trace of the request being handled, 0 if it is not traced
+    void SetTrace(uint64_t trace_id) {
+        trace_ = trace_id;
+    }
+
+    ServerCodes Register(const std::string& username,
+                         const std::string& password) {
+        if (database_.FindUser(username) != kInvalidId)
+            return ServerCodes::USER_ALREADY_EXIST;
+        database_.AddUser(username, password);
+        Journal(RegisterRecord(username, password));
+        return ServerCodes::SUCCESS;
+    }
+
+    // The session token of the user is written in token. The updates sent
+    // to the identity are compressed when they are big enough if it
+    // negotiated compression.
+    ServerCodes Login(const NetIdentity& identity, const std::string& username,
+                      const std::string& password, bool compression,
+                      SessionToken& token) {
+        // Check if an user is already connected with this identity
+        if (IdentityConnected(identity))
+            return ServerCodes::IDENTITY_ALREADY_CONNECTED;
+
+        // Check if the user exist in the database
+        UserId user = database_.FindUser(username);
+        if (user == kInvalidId) return ServerCodes::USER_DOES_NOT_EXIST;
+
+        // Check if the user password match
+        if (!database_.GetUser(user).IsPassword(password))
+            return ServerCodes::USER_WRONG_PASSWORD;
+
+        // Add the identity to the ServerState set
+        identities_[identity] = user;
+        if (compression) compressed_identities_.insert(identity);
+
+        // The first identity of the user starts its session, the others
+        // share it
+        UserConnection& connection = GetConnection(user);
+        if (connection.identities.empty()) {
+            do {
+                connection.token = SessionToken::Generate();
+            } while (SessionTokenHash()(connection.token) % num_shards_ !=
+                     shard_);
+            sessions_[connection.token] = user;
+        }
+        connection.identities.push_back(identity);
+        token = connection.token;
+
+        // The messages received while the user was offline are sent after
+        // the response
+        if (inbox_) {
+            drain_user_ = user;
+            drain_compressed_ = compression;
+        }
+
+        // The groups of other shards are updated by the sharded server
+        for (GroupId group : database_.GetUser(user).GetGroups()) {
+            if (!database_.GetGroup(group).IsRegistered()) continue;
+            GetOnlineMembers(group).push_back({user, identity, compression});
+        }
+
+        return ServerCodes::SUCCESS;
+    }
+
+    // User of the session, kInvalidId if there is no session with the
+    // token. The requests after the login start with it.
+    UserId FindSession(const SessionToken& token) const {
+        auto it = sessions_.find(token);
+        return it != sessions_.end() ? it->second : kInvalidId;
+    }
+
+    ServerCodes Logout(const NetIdentity& identity, UserId user) {
+        // Check if the identity is not connected
+        if (!IdentityConnected(identity))
+            return ServerCodes::IDENTITY_ALREADY_CONNECTED;
+
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        // Check if the user own the identity
+        UserConnection& connection = connections_[user];
+        std::vector<NetIdentity>& identities = connection.identities;
+        auto it = std::find(identities.begin(), identities.end(), identity);
+        if (it == identities.end()) return ServerCodes::USER_INCORRECT_IDENTITY;
+
+        identities.erase(it);         // Remove from the user identities
+        identities_.erase(identity);  // Remove from the server identities
+        compressed_identities_.erase(identity);
+
+        for (GroupId group : database_.GetUser(user).GetGroups()) {
+            if (!database_.GetGroup(group).IsRegistered()) continue;
+            RemoveOnlineMember(group, user, &identity);
+        }
+
+        // If no identities left end the session
+        if (identities.empty()) {
+            sessions_.erase(connection.token);
+            connection.token = SessionToken();
+        }
+
+        return ServerCodes::SUCCESS;
+    }
+
+    // Logs out the identity without a request, returns its user or
+    // kInvalidId if it was not logged in
+    UserId Disconnect(const NetIdentity& identity) {
+        auto it = identities_.find(identity);
+        if (it == identities_.end()) return kInvalidId;
+        UserId user = it->second;
+        Logout(identity, user);
+        return user;
+    }
+
+    // Ends the sessions of the slow consumers dropped by the outbound
+    // queues, it has to be called after they send or flush
+    void DisconnectSlowConsumers() {
+        if (!outbound_) return;
+        for (const NetIdentity& identity : outbound_->TakeDisconnected()) {
+            UserId user = Disconnect(identity);
+            if (user == kInvalidId) continue;
+            LOG_WARNING("[User] '" << GetUsername(user)
+                                   << "' disconnected, too slow to receive");
+        }
+    }
+
+    ServerCodes AddContact(UserId user, const std::string& contact) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        // Check if the contact exist in the database
+        UserId contact_user = database_.FindUser(contact);
+        if (contact_user == kInvalidId)
+            return ServerCodes::USER_DOES_NOT_EXIST;
+
+        AddKnownContact(user, contact_user);
+
+        return ServerCodes::SUCCESS;
+    }
+
+    // Adds a contact that is known to exist, used for the contacts of other
+    // shard
+    void AddKnownContact(UserId user, UserId contact) {
+        if (database_.GetUser(user).AddContact(contact)) {
+            Journal(AddContactRecord(database_.GetUsername(user),
+                                     database_.GetUsername(contact)));
+        }
+    }
+
+    // Adds or removes a group of other shard from the groups of the user,
+    // returns the group
+    GroupId SetMembership(UserId user, const std::string& group_name,
+                          bool joined) {
+        GroupId group = database_.InternGroup(group_name);
+        bool changed = joined ? database_.GetUser(user).AddGroup(group)
+                              : database_.GetUser(user).RemoveGroup(group);
+        if (changed) {
+            Journal(MembershipRecord(database_.GetUsername(user), group_name,
+                                     joined));
+        }
+        return group;
+    }
+
+    ServerCodes Whisper(UserId user, const std::string& recipient,
+                        const std::string& content) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        UserId recipient_user = FindConnectedUser(recipient);
+        if (recipient_user == kInvalidId && !inbox_)
+            return ServerCodes::USER_NOT_CONNECTED;
+
+        WhisperUpdate message;
+        message.sender = database_.GetUsername(user);
+        message.content = content;
+
+        if (recipient_user == kInvalidId) {
+            ServerCodes code =
+                StoreOffline(recipient, message, hints_.whisper);
+            if (code == ServerCodes::SUCCESS) {
+                AppendHistory(WhisperConversation(message.sender, recipient),
+                              message.sender, content);
+            }
+            return code;
+        }
+
+        OutgoingUpdate update(hints_.whisper, trace_, OutboundClass::TEXT);
+        Pack(update.raw, message);
+        for (auto& identity : GetIdentities(recipient_user)) {
+            SendUpdate(identity, update);
+        }
+        AppendHistory(WhisperConversation(message.sender, recipient),
+                      message.sender, content);
+
+        return ServerCodes::SUCCESS;
+    }
+
+    ServerCodes CreateGroup(UserId user, const std::string& group_name) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        if (database_.FindGroup(group_name) != kInvalidId)
+            return ServerCodes::GROUP_ALREADY_EXIST;
+
+        GroupId group = database_.AddGroup(group_name, user);
+        AddMember(group, user);
+        Journal(CreateGroupRecord(group_name, database_.GetUsername(user)));
+
+        return ServerCodes::SUCCESS;
+    }
+
+    ServerCodes JoinGroup(UserId user, const std::string& group_name) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        GroupId group = database_.FindGroup(group_name);
+        if (group == kInvalidId) return ServerCodes::GROUP_DOES_NOT_EXIST;
+
+        if (!AddMember(group, user))
+            return ServerCodes::GROUP_MEMBER_ALREADY_EXIST;
+        Journal(JoinGroupRecord(group_name, database_.GetUsername(user)));
+
+        return ServerCodes::SUCCESS;
+    }
+
+    ServerCodes LeaveGroup(UserId user, const std::string& group_name) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        GroupId group = database_.FindGroup(group_name);
+        if (group == kInvalidId) return ServerCodes::GROUP_DOES_NOT_EXIST;
+
+        if (!database_.RemoveMember(group, user))
+            return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
+        Journal(LeaveGroupRecord(group_name, database_.GetUsername(user)));
+
+        RemoveOnlineMember(group, user, nullptr);
+
+        // The members that leave also leave the call of the group
+        if (GroupCallExist(group)) {
+            GroupCall& group_call = GetGroupCall(group);
+            group_call.participants.Erase(user);
+            if (group_call.participants.Empty()) {
+                group_call.active = false;
+                num_group_calls_--;
+            }
+        }
+
+        return ServerCodes::SUCCESS;
+    }
+
+    ServerCodes MessageGroup(UserId user, const std::string& group_name,
+                             const std::string& content) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        GroupId group_id = database_.FindGroup(group_name);
+        if (group_id == kInvalidId) return ServerCodes::GROUP_DOES_NOT_EXIST;
+
+        Group& group = database_.GetGroup(group_id);
+        if (!group.IsMember(user))
+            return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
+
+        MessageGroupUpdate message;
+        message.group_name = group_name;
+        message.sender = database_.GetUsername(user);
+        message.content = content;
+
+        OutgoingUpdate update(hints_.msg_group, trace_, OutboundClass::TEXT);
+        Pack(update.raw, message);
+        for (auto& member : GetOnlineMembers(group_id)) {
+            SendUpdate(member, update);
+        }
+
+        if (inbox_) StoreForOfflineMembers(group_id, user, message);
+        AppendHistory(GroupConversation(group_name), message.sender, content);
+
+        return ServerCodes::SUCCESS;
+    }
+
+    // The page is sent to the identity by the HistoryStore when queried is
+    // set, otherwise the request is answered with the returned code
+    ServerCodes QueryHistory(const NetIdentity& identity, UserId user,
+                             const HistoryRequest& request, bool& queried) {
+        std::string conversation;
+        ServerCodes code = FindConversation(user, request.group, request.name,
+                                            conversation);
+        queried = code == ServerCodes::SUCCESS && history_;
+        if (queried) history_->Query(identity, trace_, conversation, request);
+        return code;
+    }
+
+    // As QueryHistory, with the messages that match the search
+    ServerCodes SearchHistory(const NetIdentity& identity, UserId user,
+                              const SearchRequest& request, bool& queried) {
+        std::string conversation;
+        ServerCodes code = FindConversation(user, request.group, request.name,
+                                            conversation);
+        queried = code == ServerCodes::SUCCESS && history_;
+        if (queried) history_->Search(identity, trace_, conversation, request);
+        return code;
+    }
+
+    ServerCodes SendVoiceMessage(UserId user, const std::string& recipient,
+                                 size_t channels, size_t sample_rate,
+                                 const RawObject& samples) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        UserId recipient_user = FindConnectedUser(recipient);
+        if (recipient_user == kInvalidId && !inbox_)
+            return ServerCodes::USER_NOT_CONNECTED;
+
+        RawVoiceMessageUpdate message;
+        message.sender = database_.GetUsername(user);
+        message.channels = channels;
+        message.sample_rate = sample_rate;
+        message.samples = samples;
+
+        if (recipient_user == kInvalidId) {
+            return StoreOffline(recipient, message, hints_.voice_msg);
+        }
+
+        OutgoingUpdate update(hints_.voice_msg, trace_, OutboundClass::VOICE);
+        Pack(update.raw, message);
+        for (auto& identity : GetIdentities(recipient_user)) {
+            SendUpdate(identity, update);
+        }
+
+        return ServerCodes::SUCCESS;
+    }
+
+    ServerCodes JoinCall(UserId user, const std::string& group_name) {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        GroupId group = database_.FindGroup(group_name);
+        if (group == kInvalidId) return ServerCodes::GROUP_DOES_NOT_EXIST;
+
+        if (!database_.GetGroup(group).IsMember(user))
+            return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
+
+        GroupCall& group_call = GetGroupCall(group);
+        if (!group_call.active) {
+            group_call.active = true;
+            num_group_calls_++;
+        }
+        group_call.participants.Insert(user);
+
+        return ServerCodes::SUCCESS;
+    }
+
+    void ProcessGroupCallData(UserId user, const std::string& group_name,
+                              const RawObject& samples) {
+        if (user == kInvalidId) return;  // ServerCodes::USER_INCORRECT_TOKEN
+
+        GroupId group_id = database_.FindGroup(group_name);
+        if (!GroupCallExist(group_id))
+            return;  // ServerCodes::GROUP_DOES_NOT_EXIST
+
+        GroupCall& group_call = GetGroupCall(group_id);
+        IdSet& participants = group_call.participants;
+
+        if (!participants.Contains(user))
+            return;  // ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST
+
+        RawCallDataUpdate message;
+        message.sender = database_.GetUsername(user);
+        message.samples = samples;
+
+        OutgoingUpdate update(hints_.call_data, trace_, OutboundClass::CALL);
+        Pack(update.raw, message);
+
+        for (auto& member : GetOnlineMembers(group_id)) {
+            // Check if member is not the user who send the data and is
+            // participant of the group call
+            if (member.user != user && participants.Contains(member.user)) {
+                SendUpdate(member, update);
+            }
+        }
+
+        return;  // ServerCodes::SUCCESS
+    }
+
+    // Id of the user if it exists and is connected, otherwise kInvalidId
+    UserId FindConnectedUser(const std::string& username) const {
+        UserId user = database_.FindUser(username);
+        return user != kInvalidId && UserConnected(user) ? user : kInvalidId;
+    }
+
+    bool UserConnected(UserId user) const {
+        return user < connections_.size() &&
+               !connections_[user].identities.empty();
+    }
+
+    bool GroupCallExist(GroupId group) const {
+        return group < group_calls_.size() && group_calls_[group].active;
+    }
+
+    bool IdentityConnected(const NetIdentity& identity) {
+        auto it = identities_.find(identity);
+        return (it != identities_.end());
+    }
+
+    const std::string& GetUsername(UserId user) const {
+        return database_.GetUsername(user);
+    }
+
+    // Whether the identity negotiated compression at login
+    bool IsCompressed(const NetIdentity& identity) const {
+        return compressed_identities_.count(identity) > 0;
+    }
+
+    // Replaces the online identities of a member of the group, used for the
+    // members connected to other shard
+    void SetOnlineMember(GroupId group, UserId user,
+                         const std::vector<NetIdentity>& identities,
+                         const std::vector<bool>& compressed) {
+        // The messages kept here for the user go to the identity that just
+        // connected
+        if (inbox_ && !identities.empty()) {
+            DrainInbox(user, identities.back(),
+                       !compressed.empty() && compressed.back());
+        }
+
+        if (!database_.GetGroup(group).IsMember(user)) return;
+        RemoveOnlineMember(group, user, nullptr);
+        std::vector<OnlineMember>& online = GetOnlineMembers(group);
+        for (size_t i = 0; i < identities.size(); i++) {
+            bool compression = i < compressed.size() && compressed[i];
+            online.push_back({user, identities[i], compression});
+        }
+    }
+
+    void SendUpdate(const NetIdentity& identity, OutgoingUpdate& update) {
+        SendUpdate(identity, IsCompressed(identity), update);
+    }
+
+    void SendUpdate(const OnlineMember& member, OutgoingUpdate& update) {
+        SendUpdate(member.identity, member.compressed, update);
+    }
+
+    void SendUpdate(const NetIdentity& identity, bool compressed,
+                    OutgoingUpdate& update) {
+        trace::Span span(trace_, "server.fanout");
+        zmq::message_t frame =
+            update.Frame(compressed ? &socket_.GetCompression() : nullptr);
+        Send(identity, &frame, 1, update.type);
+        stats_.CountUpdate();
+    }
+
+    // Sends the response of a request, or holds it if the request changed
+    // the database and the change is not durable yet
+    void SendResponse(const NetIdentity& identity, Serializer&& output) {
+        uint64_t sequence = uncommitted_;
+        uncommitted_ = 0;
+        UserId drain = drain_user_;
+        drain_user_ = kInvalidId;
+
+        // The responses to an identity are sent in order
+        auto it = held_identities_.find(identity);
+        if (it != held_identities_.end()) {
+            sequence = std::max(sequence, it->second.last_sequence);
+        }
+
+        if (it == held_identities_.end() &&
+            (sequence == 0 || sequence <= store_->DurableSequence())) {
+            zmq::message_t frame = output.Release();
+            Send(identity, &frame, 1, OutboundClass::RESPONSE);
+            if (drain != kInvalidId) {
+                DrainInbox(drain, identity, drain_compressed_);
+            }
+            return;
+        }
+
+        HeldIdentity& held = held_identities_[identity];
+        held.last_sequence = sequence;
+        held.count++;
+        held_.push_back({sequence, identity, output.Release(), drain,
+                         drain_compressed_});
+    }
+
+    // Sends the held responses whose changes are durable, it has to be
+    // called when the commits socket of the store is readable
+    void ReleaseCommitted() {
+        if (!store_) return;
+        store_->DrainCommits();
+        uint64_t durable = store_->DurableSequence();
+        while (!held_.empty() && held_.front().sequence <= durable) {
+            HeldResponse& response = held_.front();
+            auto it = held_identities_.find(response.identity);
+            if (--it->second.count == 0) held_identities_.erase(it);
+            Send(response.identity, &response.frame, 1,
+                 OutboundClass::RESPONSE);
+            // Unless the identity logged out meanwhile
+            auto identity = identities_.find(response.identity);
+            if (response.drain != kInvalidId && identity != identities_.end() &&
+                identity->second == response.drain) {
+                DrainInbox(response.drain, response.identity,
+                           response.drain_compressed);
+            }
+            held_.pop_front();
+        }
+    }
+
+    size_t NumHeldResponses() const {
+        return held_.size();
+    }
+
+    const std::vector<NetIdentity>& GetIdentities(UserId user) const {
+        return connections_[user].identities;
+    }
+
+    size_t NumConnectedUsers() const {
+        return sessions_.size();
+    }
+
+    size_t NumIdentities() const {
+        return identities_.size();
+    }
+
+    size_t NumGroupCalls() const {
+        return num_group_calls_;
+    }
+
+private:
+    // Sends the parts as a message to the identity, queued if there are
+    // outbound queues
+    void Send(const NetIdentity& identity, zmq::message_t* parts,
+              size_t count, OutboundClass type) {
+        if (outbound_) {
+            outbound_->Send(identity, parts, count, type);
+            return;
+        }
+        socket_.send(identity, ZMQ_SNDMORE);
+        if (send_classes_) {
+            socket_.send(std::string(1, static_cast<char>(type)),
+                         ZMQ_SNDMORE);
+        }
+        for (size_t i = 0; i < count; i++) {
+            socket_.send(parts[i], i + 1 < count ? ZMQ_SNDMORE : 0);
+        }
+    }
+
+    // Sends the pending messages of the user, after the response to the
+    // login. They are text, so they also go behind the queued responses.
+    void DrainInbox(UserId user, const NetIdentity& identity,
+                    bool compressed) {
+        lz::Context* compression =
+            compressed ? &socket_.GetCompression() : nullptr;
+        inbox_->Drain(user, compression,
+                      [&](std::vector<zmq::message_t>& batch) {
+                          Send(identity, batch.data(), batch.size(),
+                               OutboundClass::TEXT);
+                      });
+    }
+
+    // Adds the user to the group and its connected identities to the online
+    // members, returns false if it was already a member
+    bool AddMember(GroupId group, UserId user) {
+        if (!database_.AddMember(group, user)) return false;
+        if (UserConnected(user)) {
+            std::vector<OnlineMember>& online = GetOnlineMembers(group);
+            for (auto& identity : GetIdentities(user)) {
+                online.push_back({user, identity, IsCompressed(identity)});
+            }
+        }
+        return true;
+    }
+
+    // Removes the identity of the user from the online members of the
+    // group, or all its identities if it is nullptr
+    void RemoveOnlineMember(GroupId group, UserId user,
+                            const NetIdentity* identity) {
+        std::vector<OnlineMember>& online = GetOnlineMembers(group);
+        for (size_t i = 0; i < online.size();) {
+            if (online[i].user == user &&
+                (!identity || online[i].identity == *identity)) {
+                online[i] = std::move(online.back());
+                online.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    // Keeps the update for the recipient until it connects, it fails if the
+    // recipient doesn't exist
+    template <typename Update>
+    ServerCodes StoreOffline(const std::string& recipient,
+                             const Update& message, CapacityHint& hint) {
+        UserId recipient_user = database_.FindUser(recipient);
+        if (recipient_user == kInvalidId)
+            return ServerCodes::USER_DOES_NOT_EXIST;
+
+        Serializer output(hint);
+        Pack(output, message);
+        inbox_->Store({recipient_user}, output);
+        return ServerCodes::SUCCESS;
+    }
+
+    // Keeps the group message for the members without online identities,
+    // except the sender
+    void StoreForOfflineMembers(GroupId group, UserId sender,
+                                const MessageGroupUpdate& message) {
+        std::vector<OnlineMember>& online = GetOnlineMembers(group);
+        for (auto& member : online) online_scratch_.Insert(member.user);
+
+        std::vector<UserId> offline;
+        database_.GetGroup(group).GetMembers().ForEach([&](uint32_t member) {
+            if (member != sender && !online_scratch_.Contains(member)) {
+                offline.push_back(member);
+            }
+        });
+        for (auto& member : online) online_scratch_.Erase(member.user);
+
+        if (offline.empty()) return;
+        Serializer output(hints_.msg_group);
+        Pack(output, message);
+        inbox_->Store(offline, output);
+    }
+
+    // Name of the conversation of the user with a user or a group in the
+    // history. The groups of other shards are checked with the groups of the
+    // user.
+    ServerCodes FindConversation(UserId user, bool group,
+                                 const std::string& name,
+                                 std::string& conversation) const {
+        if (user == kInvalidId) return ServerCodes::USER_INCORRECT_TOKEN;
+
+        if (group) {
+            if (!database_.IsInGroup(user, name))
+                return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
+            conversation = GroupConversation(name);
+        } else {
+            conversation =
+                WhisperConversation(database_.GetUsername(user), name);
+        }
+        return ServerCodes::SUCCESS;
+    }
+
+    void AppendHistory(const std::string& conversation,
+                       const std::string& sender, const std::string& content) {
+        if (history_) history_->Append(conversation, sender, content);
+    }
+
+    // Logs the change of the database, the response of the request is held
+    // until it is durable
+    template <typename Record>
+    void Journal(const Record& record) {
+        if (!store_) return;
+        uncommitted_ = store_->Log(record);
+        if (store_->SnapshotDue()) store_->Snapshot(database_);
+    }
+
+    // The vectors indexed by id grow with the database
+    UserConnection& GetConnection(UserId user) {
+        if (user >= connections_.size()) {
+            connections_.resize(database_.NumUsers());
+        }
+        return connections_[user];
+    }
+
+    std::vector<OnlineMember>& GetOnlineMembers(GroupId group) {
+        if (group >= online_members_.size()) {
+            online_members_.resize(database_.NumGroups());
+        }
+        return online_members_[group];
+    }
+
+    GroupCall& GetGroupCall(GroupId group) {
+        if (group >= group_calls_.size()) {
+            group_calls_.resize(database_.NumGroups());
+        }
+        return group_calls_[group];
+    }
+
+private:
+    struct HeldResponse {
+        uint64_t sequence;  // Sent once the store commits it
+        NetIdentity identity;
+        zmq::message_t frame;
+        UserId drain;  // User whose inbox is sent after it, or kInvalidId
+        bool drain_compressed;
+    };
+
+    struct HeldIdentity {
+        uint64_t last_sequence = 0;
+        size_t count = 0;
+    };
+
+private:
+    // Server socket
+    zmqw::socket& socket_;
+
+    // In-Memory storage
+    DataBase& database_;
+
+    // Durable storage, nullptr if the database only lives in memory
+    DurableStore* store_;
+    uint64_t uncommitted_;  // Record of the request being handled, or 0
+    std::deque<HeldResponse> held_;
+    std::unordered_map<NetIdentity, HeldIdentity> held_identities_;
+
+    // Messages for the users that are not connected, nullptr if disabled
+    OfflineInbox* inbox_;
+    IdSet online_scratch_;  // Empty between uses
+    UserId drain_user_;     // Logged in by the request being handled
+    bool drain_compressed_;
+
+    // Conversations of the users and the groups, nullptr if disabled
+    HistoryWriter* history_;
+
+    // Queues of the messages to slow clients, nullptr if they are sent as
+    // they are
+    OutboundQueues* outbound_;
+    bool send_classes_;
+
+    // Server state
+    std::unordered_map<NetIdentity, UserId> identities_;  // To their user
+    std::unordered_set<NetIdentity> compressed_identities_;
+    std::unordered_map<SessionToken, UserId, SessionTokenHash> sessions_;
+    std::vector<UserConnection> connections_;  // By UserId
+    std::vector<GroupCall> group_calls_;       // By GroupId
+    // Identities of the connected members of each group, so the group sends
+    // only iterate the live recipients
+    std::vector<std::vector<OnlineMember>> online_members_;  // By GroupId
+    size_t num_group_calls_;
+    size_t shard_;
+    size_t num_shards_;
+
+    MessageHints hints_;
+    ServerStats stats_;
+    uint64_t trace_;
+};
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const RegisterRequest& request,
+                   RegisterRequest::Response& response) {
+    response.code = server.Register(request.username, request.password);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[User] '" << request.username << "' just registered");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& identity,
+                   const LoginRequest& request,
+                   LoginRequest::Response& response) {
+    // Compression is negotiated by the identity both ways, its compressed
+    // requests are only accepted and its updates only compressed if it asked
+    // for it
+    response.code = server.Login(identity, request.username, request.password,
+                                 request.compression, response.token);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[User] '" << request.username << "' joins the chat server");
+        response.username = request.username;
+        response.compression = request.compression;
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& identity,
+                   const LogoutRequest& request,
+                   LogoutRequest::Response& response) {
+    UserId user = server.FindSession(request.token);
+    response.code = server.Logout(identity, user);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[User] '" << server.GetUsername(user) << "' disconected.");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const AddContactRequest& request,
+                   AddContactRequest::Response& response) {
+    UserId user = server.FindSession(request.token);
+    response.code = server.AddContact(user, request.contact);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[User] '" << server.GetUsername(user) << "' added '"
+                            << request.contact << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const WhisperRequest& request,
+                   WhisperRequest::Response& response) {
+    response.code = server.Whisper(server.FindSession(request.token),
+                                   request.recipient, request.content);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const CreateGroupRequest& request,
+                   CreateGroupRequest::Response& response) {
+    UserId user = server.FindSession(request.token);
+    response.code = server.CreateGroup(user, request.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[Group] '" << request.group_name << "' created, owner '"
+                             << server.GetUsername(user) << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const JoinGroupRequest& request,
+                   JoinGroupRequest::Response& response) {
+    UserId user = server.FindSession(request.token);
+    response.code = server.JoinGroup(user, request.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[Group] '" << server.GetUsername(user) << "' just joined '"
+                             << request.group_name << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const LeaveGroupRequest& request,
+                   LeaveGroupRequest::Response& response) {
+    UserId user = server.FindSession(request.token);
+    response.code = server.LeaveGroup(user, request.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[Group] '" << server.GetUsername(user) << "' just left '"
+                             << request.group_name << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const MessageGroupRequest& request,
+                   MessageGroupRequest::Response& response) {
+    response.code = server.MessageGroup(server.FindSession(request.token),
+                                        request.group_name, request.content);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const RawVoiceMessageRequest& request,
+                   RawVoiceMessageRequest::Response& response) {
+    response.code = server.SendVoiceMessage(
+        server.FindSession(request.token), request.recipient,
+        request.channels, request.sample_rate, request.samples);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& identity,
+                   const HistoryRequest& request,
+                   HistoryRequest::Response& response, bool& queried) {
+    response.code = server.QueryHistory(
+        identity, server.FindSession(request.token), request, queried);
+    response.group = request.group;
+    response.name = request.name;
+}
+
+inline void Handle(ServerState& server, const NetIdentity& identity,
+                   const SearchRequest& request,
+                   SearchRequest::Response& response, bool& queried) {
+    response.code = server.SearchHistory(
+        identity, server.FindSession(request.token), request, queried);
+    response.group = request.group;
+    response.name = request.name;
+    response.query = request.query;
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const JoinCallRequest& request,
+                   JoinCallRequest::Response& response) {
+    response.code =
+        server.JoinCall(server.FindSession(request.token), request.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        response.group_name = request.group_name;
+    }
+}
+
+// Handles the messages received from an identity, the requests are replied
+// with the response filled by its Handle function
+struct RequestHandler {
+    ServerState& server;
+    const NetIdentity& identity;
+    ServerStats::Clock::time_point start;  // When the message was received
+    uint64_t trace_id;
+    AllocationScope& allocations;
+
+    template <typename Request>
+    void operator()(const Request& request) {
+        allocations.SetName(ActionName(Request::kAction));
+        typename Request::Response response;
+        {
+            trace::Span span(trace_id, "server.handler");
+            Handle(server, identity, request, response);
+        }
+
+        Respond(response);
+        server.GetStats().RecordRequest(Request::kAction, response.code,
+                                        start);
+    }
+
+    void operator()(const HistoryRequest& request) {
+        Query(request);
+    }
+
+    void operator()(const SearchRequest& request) {
+        Query(request);
+    }
+
+    void operator()(const RawSendCallDataUpdate& update) {
+        allocations.SetName(ActionName(RawSendCallDataUpdate::kAction));
+        trace::Span span(trace_id, "server.handler");
+        server.ProcessGroupCallData(server.FindSession(update.token),
+                                    update.group_name, update.samples);
+        server.GetStats().RecordRequest(RawSendCallDataUpdate::kAction,
+                                        ServerCodes::SUCCESS, start);
+    }
+
+    // The requests answered by the HistoryStore if it was queried
+    template <typename Request>
+    void Query(const Request& request) {
+        allocations.SetName(ActionName(Request::kAction));
+        typename Request::Response response;
+        bool queried;
+        {
+            trace::Span span(trace_id, "server.handler");
+            Handle(server, identity, request, response, queried);
+        }
+
+        if (!queried) Respond(response);
+        server.GetStats().RecordRequest(Request::kAction, response.code,
+                                        start);
+    }
+
+    template <typename Response>
+    void Respond(const Response& response) {
+        trace::Span span(trace_id, "server.response");
+        Serializer output(server.GetHints().response);
+        if (trace_id) Pack(output, TraceEnvelope(trace_id, trace::Now()));
+        Pack(output, response);
+        server.SendResponse(identity, std::move(output));
+    }
+};
+
+using RequestDispatcher =
+    Dispatcher<RequestHandler, RegisterRequest, LoginRequest, LogoutRequest,
+               AddContactRequest, WhisperRequest, CreateGroupRequest,
+               JoinGroupRequest, LeaveGroupRequest, MessageGroupRequest,
+               RawVoiceMessageRequest, JoinCallRequest, HistoryRequest,
+               SearchRequest, RawSendCallDataUpdate>;
+
+// Handles a message from the socket with the handler made from the context,
+// which handles it over the state. Returns false if there was no message to
+// receive.
+template <typename Handler, typename MessageDispatcher, typename Context>
+bool DispatchMessage(zmqw::socket& socket, Context& context,
+                     ServerState& server, int flags) {
+    // The allocations until the message is handled are added to its action
+    AllocationScope allocations;
+    std::string identity;
+    zmq::message_t frame;
+
+    try {
+        if (!socket.recv(identity, flags)) return false;
+        socket.recv(frame);
+    } catch (zmq::error_t& e) {
+        // Interrupted by a signal, the caller decides if it has to stop
+        if (e.num() != EINTR) LOG_ERROR("Error receiving data: " << e.what());
+        return false;
+    } catch (std::exception& e) {
+        LOG_ERROR("Error receiving data: " << e.what());
+        return false;
+    }
+
+    // Only the identities that negotiated compression may send compressed
+    // frames, the others can't make the server decompress anything
+    if (lz::IsCompressed(static_cast<const char*>(frame.data()),
+                         frame.size()) &&
+        !server.IsCompressed(identity)) {
+        allocations.SetName("invalid");
+        server.GetStats().RecordInvalid();
+        LOG_WARNING("Compressed frame from an identity without compression");
+        return true;
+    }
+
+    try {
+        ServerStats::Clock::time_point start = ServerStats::Clock::now();
+        Deserializer message(std::move(frame));
+
+        // The time since the client sent the message is spent in the network
+        // and waiting in the socket
+        TraceEnvelope envelope;
+        if (UnpackIf(message, envelope)) {
+            trace::Tracer::Instance().Record(envelope.trace_id,
+                                             "server.receive",
+                                             envelope.timestamp, trace::Now());
+        }
+        server.SetTrace(envelope.trace_id);
+        trace::Span span(envelope.trace_id, "server.dispatch");
+
+        Handler handler{context, identity, start, envelope.trace_id,
+                        allocations};
+        if (!MessageDispatcher::Dispatch(handler, message)) {
+            allocations.SetName("unknown");
+            server.GetStats().RecordUnknown();
+            LOG_WARNING("Unknown message received");
+        }
+    } catch (zmq::error_t&) {
+        throw;
+    } catch (std::exception& e) {
+        allocations.SetName("invalid");
+        server.GetStats().RecordInvalid();
+        LOG_ERROR("Error unpacking data, maybe not a valid message: "
+                  << e.what());
+    }
+    return true;
+}
+
+// Handles a message from the socket of the server, returns false if there
+// was no message to receive
+inline bool Dispatch(ServerState& server, int flags = 0) {
+    return DispatchMessage<RequestHandler, RequestDispatcher>(
+        server.GetSocket(), server, server, flags);
+}
+
+// Replies any request to the stats socket with a JSON snapshot of the
+// server state and its statistics
+inline void ServeStats(zmqw::socket& stats_socket, ServerState& server,
+                       const HistoryStore* history = nullptr) {
+    std::string request;
+    if (!stats_socket.recv(request, ZMQ_DONTWAIT)) return;
+
+    zmqw::socket& socket = server.GetSocket();
+    lz::Context& compression = socket.GetCompression();
+
+    std::ostringstream json;
+    json << "{\"server\":{\"connected_users\":" << server.NumConnectedUsers()
+         << ",\"identities\":" << server.NumIdentities()
+         << ",\"group_calls\":" << server.NumGroupCalls()
+         << ",\"messages_in\":" << socket.MessagesReceived()
+         << ",\"messages_out\":" << socket.MessagesSent()
+         << ",\"bytes_in\":" << socket.BytesReceived()
+         << ",\"bytes_out\":" << socket.BytesSent()
+         << ",\"compressed\":" << compression.Compressed()
+         << ",\"compressed_bytes_in\":" << compression.BytesIn()
+         << ",\"compressed_bytes_out\":" << compression.BytesOut()
+         << ",\"held_responses\":" << server.NumHeldResponses()
+         << "},\"dispatch\":";
+    server.GetStats().WriteJSON(json);
+    if (DurableStore* store = server.GetStore()) {
+        json << ",\"store\":";
+        store->WriteJSON(json);
+    }
+    if (OfflineInbox* inbox = server.GetInbox()) {
+        json << ",\"inbox\":";
+        inbox->WriteJSON(json);
+    }
+    if (OutboundQueues* outbound = server.GetOutbound()) {
+        json << ",\"outbound\":";
+        outbound->WriteJSON(json);
+    }
+    if (history) {
+        json << ",\"history\":";
+        history->WriteJSON(json);
+    }
+    json << ",\"allocations\":";
+    AllocationTracker::Instance().WriteJSON(json);
+    json << "}";
+
+    stats_socket.send(json.str());
+}
+
+// Messages handled each time the server socket is polled
+static const size_t kMaxBurst = 256;
+
+// Handles the messages that are already queued in the server socket, a
+// bounded number so the other polled sockets are not starved
+inline void DispatchPending(ServerState& server) {
+    size_t depth = 0;
+    while (depth < kMaxBurst && Dispatch(server, ZMQ_DONTWAIT)) {
+        depth++;
+    }
+    server.GetStats().RecordQueueDepth(depth);
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <Util/IdSet.hpp>
+#include <Util/Interner.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Chat database
+// The registered users and groups with their contacts and members. It only
+// lives in memory, Chat_Server makes it durable with a DurableStore.
+///////////////////////////////////////////////////////////////////////////////
+
+// Ids of the names of the users and the groups, see Util/Interner.hpp
+using UserId = InternedId;
+using GroupId = InternedId;
+
+// The users and groups without a password or an owner are only known by
+// name, they are registered in other shard (see ShardedServer.hpp)
+class User {
+public:
+    User() : registered_(false) {}
+
+    explicit User(const std::string& password)
+          : password_(password), registered_(true) {}
+
+    bool IsRegistered() const {
+        return registered_;
+    }
+
+    bool IsPassword(const std::string& password) const {
+        return password_ == password;
+    }
+
+    const std::string& GetPassword() const {
+        return password_;
+    }
+
+    const std::vector<UserId>& GetContacts() const {
+        return contacts_;
+    }
+
+    bool AddContact(UserId contact) {
+        auto it = std::lower_bound(contacts_.begin(), contacts_.end(), contact);
+        if (it != contacts_.end() && *it == contact) return false;
+        contacts_.insert(it, contact);
+        return true;
+    }
+
+    bool AddGroup(GroupId group) {
+        auto it = std::lower_bound(groups_.begin(), groups_.end(), group);
+        if (it != groups_.end() && *it == group) return false;
+        groups_.insert(it, group);
+        return true;
+    }
+
+    bool RemoveGroup(GroupId group) {
+        auto it = std::lower_bound(groups_.begin(), groups_.end(), group);
+        if (it == groups_.end() || *it != group) return false;
+        groups_.erase(it);
+        return true;
+    }
+
+    // Groups the user is member of
+    const std::vector<GroupId>& GetGroups() const {
+        return groups_;
+    }
+
+private:
+    std::string password_;
+    std::vector<UserId> contacts_;  // Sorted
+    std::vector<GroupId> groups_;   // Sorted
+    bool registered_;
+};
+
+class Group {
+public:
+    Group() : owner_(kInvalidId), registered_(false) {}
+
+    explicit Group(UserId owner) : owner_(owner), registered_(true) {}
+
+    bool IsRegistered() const {
+        return registered_;
+    }
+
+    bool AddMember(UserId user) {
+        return members_.Insert(user);
+    }
+
+    bool RemoveMember(UserId user) {
+        return members_.Erase(user);
+    }
+
+    bool IsMember(UserId user) const {
+        return members_.Contains(user);
+    }
+
+    UserId GetOwner() const {
+        return owner_;
+    }
+
+    const IdSet& GetMembers() const {
+        return members_;
+    }
+
+private:
+    UserId owner_;
+    IdSet members_;
+    bool registered_;
+};
+
+// The users and groups are stored in vectors indexed by the id of their
+// name, the names are only kept by the interners
+class DataBase {
+public:
+    // The user must not be registered
+    UserId AddUser(const std::string& username, const std::string& password) {
+        UserId user = InternUser(username);
+        users_[user] = User(password);
+        return user;
+    }
+
+    // The group must not be registered
+    GroupId AddGroup(const std::string& group_name, UserId owner) {
+        GroupId group = InternGroup(group_name);
+        groups_[group] = Group(owner);
+        return group;
+    }
+
+    // Id of the name of a user, it is added unregistered if it is unknown
+    UserId InternUser(const std::string& username) {
+        UserId user = user_names_.Intern(username);
+        if (user >= users_.size()) users_.resize(user + 1);
+        return user;
+    }
+
+    // Id of the name of a group, it is added unregistered if it is unknown
+    GroupId InternGroup(const std::string& group_name) {
+        GroupId group = group_names_.Intern(group_name);
+        if (group >= groups_.size()) groups_.resize(group + 1);
+        return group;
+    }
+
+    // Id of the user, kInvalidId if it isn't registered
+    UserId FindUser(const std::string& username) const {
+        UserId user = user_names_.Find(username);
+        return user != kInvalidId && users_[user].IsRegistered() ? user
+                                                                 : kInvalidId;
+    }
+
+    // Id of the group, kInvalidId if it isn't registered
+    GroupId FindGroup(const std::string& group_name) const {
+        GroupId group = group_names_.Find(group_name);
+        return group != kInvalidId && groups_[group].IsRegistered()
+                   ? group
+                   : kInvalidId;
+    }
+
+    // Whether the group is in the groups of the user, it may be a group of
+    // other shard
+    bool IsInGroup(UserId user, const std::string& group_name) const {
+        GroupId group = group_names_.Find(group_name);
+        if (group == kInvalidId) return false;
+        const std::vector<GroupId>& groups = users_[user].GetGroups();
+        return std::binary_search(groups.begin(), groups.end(), group);
+    }
+
+    // Adds the user to the members of the group and the group to the groups
+    // of the user, returns false if it was already a member
+    bool AddMember(GroupId group, UserId user) {
+        if (!groups_[group].AddMember(user)) return false;
+        users_[user].AddGroup(group);
+        return true;
+    }
+
+    // Returns false if the user was not a member
+    bool RemoveMember(GroupId group, UserId user) {
+        if (!groups_[group].RemoveMember(user)) return false;
+        users_[user].RemoveGroup(group);
+        return true;
+    }
+
+    User& GetUser(UserId user) {
+        return users_[user];
+    }
+
+    const User& GetUser(UserId user) const {
+        return users_[user];
+    }
+
+    Group& GetGroup(GroupId group) {
+        return groups_[group];
+    }
+
+    const Group& GetGroup(GroupId group) const {
+        return groups_[group];
+    }
+
+    const std::string& GetUsername(UserId user) const {
+        return user_names_.GetString(user);
+    }
+
+    const std::string& GetGroupName(GroupId group) const {
+        return group_names_.GetString(group);
+    }
+
+    size_t NumUsers() const {
+        return users_.size();
+    }
+
+    size_t NumGroups() const {
+        return groups_.size();
+    }
+
+private:
+    Interner user_names_;
+    Interner group_names_;
+    std::vector<User> users_;
+    std::vector<Group> groups_;
+};
+
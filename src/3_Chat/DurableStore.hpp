@@ -0,0 +1,422 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Util/FileSystem.hpp>
+#include <Util/Log.hpp>
+#include <Util/MappedFile.hpp>
+#include <Util/Schema.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/WriteAheadLog.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+#include "DataBase.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Durable storage of the chat database
+// Each change of the database is appended as a record to a write-ahead log
+// (see Util/WriteAheadLog.hpp), the dispatch thread never waits for the
+// disk. The responses of the requests that changed the database are held by
+// the ServerState until the log reports them durable.
+//
+// Every snapshot_interval records the dispatch thread packs the database in
+// a binary snapshot and a background thread writes it, then the log
+// segments it covers are removed. At startup the snapshot is memory mapped
+// and loaded, and the records after it are replayed.
+//
+// The directory has:
+//     snapshot              The last snapshot
+//     wal-<sequence>.log    Log segments, by the sequence of their first record
+///////////////////////////////////////////////////////////////////////////////
+
+enum class RecordType : uint8_t {
+    REGISTER = 1,
+    CREATE_GROUP,
+    JOIN_GROUP,
+    LEAVE_GROUP,
+    ADD_CONTACT,
+    MEMBERSHIP
+};
+
+template <RecordType T>
+struct Record : Schema<static_cast<uint8_t>(T)> {};
+
+// The records name the users and groups, the ids are only valid in a process
+struct RegisterRecord : Record<RecordType::REGISTER> {
+    RegisterRecord() = default;
+    RegisterRecord(const std::string& username, const std::string& password)
+          : username(username), password(password) {}
+
+    std::string username;
+    std::string password;
+    SCHEMA_FIELDS(username, password)
+};
+
+// The owner is its first member
+struct CreateGroupRecord : Record<RecordType::CREATE_GROUP> {
+    CreateGroupRecord() = default;
+    CreateGroupRecord(const std::string& group_name, const std::string& owner)
+          : group_name(group_name), owner(owner) {}
+
+    std::string group_name;
+    std::string owner;
+    SCHEMA_FIELDS(group_name, owner)
+};
+
+template <RecordType T>
+struct BasicMemberRecord : Record<T> {
+    BasicMemberRecord() = default;
+    BasicMemberRecord(const std::string& group_name,
+                      const std::string& username)
+          : group_name(group_name), username(username) {}
+
+    std::string group_name;
+    std::string username;
+    SCHEMA_FIELDS(group_name, username)
+};
+
+using JoinGroupRecord = BasicMemberRecord<RecordType::JOIN_GROUP>;
+using LeaveGroupRecord = BasicMemberRecord<RecordType::LEAVE_GROUP>;
+
+struct AddContactRecord : Record<RecordType::ADD_CONTACT> {
+    AddContactRecord() = default;
+    AddContactRecord(const std::string& username, const std::string& contact)
+          : username(username), contact(contact) {}
+
+    std::string username;
+    std::string contact;
+    SCHEMA_FIELDS(username, contact)
+};
+
+// A group of other shard in the groups of the user, see ShardedServer.hpp
+struct MembershipRecord : Record<RecordType::MEMBERSHIP> {
+    MembershipRecord() = default;
+    MembershipRecord(const std::string& username, const std::string& group_name,
+                     bool joined)
+          : username(username), group_name(group_name), joined(joined) {}
+
+    std::string username;
+    std::string group_name;
+    bool joined = false;
+    SCHEMA_FIELDS(username, group_name, joined)
+};
+
+// Applies the records to the database when they are replayed
+struct RecordApplier {
+    DataBase& database;
+
+    void operator()(const RegisterRecord& record) {
+        if (database.FindUser(record.username) == kInvalidId) {
+            database.AddUser(record.username, record.password);
+        }
+    }
+
+    void operator()(const CreateGroupRecord& record) {
+        if (database.FindGroup(record.group_name) != kInvalidId) return;
+        UserId owner = database.InternUser(record.owner);
+        database.AddMember(database.AddGroup(record.group_name, owner), owner);
+    }
+
+    void operator()(const JoinGroupRecord& record) {
+        GroupId group = database.FindGroup(record.group_name);
+        if (group == kInvalidId) return;
+        database.AddMember(group, database.InternUser(record.username));
+    }
+
+    void operator()(const LeaveGroupRecord& record) {
+        GroupId group = database.FindGroup(record.group_name);
+        if (group == kInvalidId) return;
+        database.RemoveMember(group, database.InternUser(record.username));
+    }
+
+    void operator()(const AddContactRecord& record) {
+        UserId user = database.FindUser(record.username);
+        if (user == kInvalidId) return;
+        database.GetUser(user).AddContact(database.InternUser(record.contact));
+    }
+
+    void operator()(const MembershipRecord& record) {
+        UserId user = database.FindUser(record.username);
+        if (user == kInvalidId) return;
+        GroupId group = database.InternGroup(record.group_name);
+        if (record.joined) {
+            database.GetUser(user).AddGroup(group);
+        } else {
+            database.GetUser(user).RemoveGroup(group);
+        }
+    }
+};
+
+using RecordDispatcher =
+    Dispatcher<RecordApplier, RegisterRecord, CreateGroupRecord,
+               JoinGroupRecord, LeaveGroupRecord, AddContactRecord,
+               MembershipRecord>;
+
+///////////////////////////////////////////////////////////////////////////////
+// Snapshot
+// A sequence of MessagePack objects. The users and groups are written in id
+// order, including the ones only known by name, so they get the same ids
+// when they are loaded and the contacts and members are stored as ids:
+//     "chat-snapshot" | version | sequence
+//     num_users  | (name | registered | password | contacts | groups)...
+//     num_groups | (name | registered | owner | members)...
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint32_t kSnapshotVersion = 1;
+
+inline void PackSnapshot(Serializer& output, const DataBase& database,
+                         uint64_t sequence) {
+    output << std::string("chat-snapshot") << kSnapshotVersion << sequence;
+
+    output << static_cast<uint64_t>(database.NumUsers());
+    for (UserId id = 0; id < database.NumUsers(); id++) {
+        const User& user = database.GetUser(id);
+        output << database.GetUsername(id) << user.IsRegistered()
+               << user.GetPassword() << user.GetContacts()
+               << user.GetGroups();
+    }
+
+    std::vector<UserId> members;
+    output << static_cast<uint64_t>(database.NumGroups());
+    for (GroupId id = 0; id < database.NumGroups(); id++) {
+        const Group& group = database.GetGroup(id);
+        members.clear();
+        group.GetMembers().ForEach(
+            [&](uint32_t member) { members.push_back(member); });
+        output << database.GetGroupName(id) << group.IsRegistered()
+               << group.GetOwner() << members;
+    }
+}
+
+// Loads the snapshot in the empty database, returns false if it is not valid
+inline bool UnpackSnapshot(Deserializer& input, DataBase& database,
+                           uint64_t& sequence) {
+    std::string magic;
+    uint32_t version = 0;
+    input >> magic >> version >> sequence;
+    if (magic != "chat-snapshot" || version != kSnapshotVersion) return false;
+
+    uint64_t num_users = 0;
+    input >> num_users;
+    std::string name, password;
+    bool registered = false;
+    std::vector<UserId> ids;
+    for (uint64_t i = 0; i < num_users; i++) {
+        input >> name >> registered >> password;
+        UserId id = registered ? database.AddUser(name, password)
+                               : database.InternUser(name);
+        User& user = database.GetUser(id);
+        input >> ids;
+        for (UserId contact : ids) user.AddContact(contact);
+        input >> ids;
+        for (GroupId group : ids) user.AddGroup(group);
+    }
+
+    uint64_t num_groups = 0;
+    input >> num_groups;
+    UserId owner = kInvalidId;
+    for (uint64_t i = 0; i < num_groups; i++) {
+        input >> name >> registered >> owner >> ids;
+        GroupId id = registered ? database.AddGroup(name, owner)
+                                : database.InternGroup(name);
+        Group& group = database.GetGroup(id);
+        for (UserId member : ids) group.AddMember(member);
+    }
+    return database.NumUsers() == num_users &&
+           database.NumGroups() == num_groups;
+}
+
+class DurableStore {
+public:
+    DurableStore(zmq::context_t& context, const std::string& directory,
+                 uint64_t snapshot_interval)
+          : directory_(directory),
+            log_(directory),
+            commits_(context, ZMQ_PULL),
+            notify_(context, ZMQ_PUSH),
+            snapshot_interval_(snapshot_interval),
+            records_since_snapshot_(0),
+            snapshots_(0),
+            snapshot_running_(false) {
+        std::ostringstream endpoint;
+        endpoint << "inproc://chat-commits-" << static_cast<const void*>(this);
+        commits_.bind(endpoint.str());
+        notify_.connect(endpoint.str());
+    }
+
+    ~DurableStore() {
+        log_.Close();
+        if (snapshot_thread_.joinable()) snapshot_thread_.join();
+    }
+
+    DurableStore(const DurableStore&) = delete;
+    DurableStore& operator=(const DurableStore&) = delete;
+
+    const std::string& GetDirectory() const {
+        return directory_;
+    }
+
+    // Loads the snapshot and the log in the empty database, then opens the
+    // log for the new records
+    bool Open(DataBase& database) {
+        if (!fs::MakeDirectories(directory_)) {
+            LOG_ERROR("Can't create the data directory " << directory_);
+            return false;
+        }
+
+        uint64_t sequence = 0;
+        if (!LoadSnapshot(database, sequence)) return false;
+
+        uint64_t replayed = 0;
+        uint64_t last = log_.Replay(
+            sequence,
+            [&](uint64_t /*sequence*/, const char* data, size_t size,
+                const WriteAheadLog::Position& /*position*/) {
+                ApplyRecord(database, data, size);
+                replayed++;
+            });
+        records_since_snapshot_ = replayed;
+        LOG_INFO("Loaded " << database.NumUsers() << " users and "
+                           << database.NumGroups() << " groups from "
+                           << directory_ << ", " << replayed
+                           << " records replayed");
+
+        return log_.Open(last + 1, [this](uint64_t /*durable*/) {
+            // Only wakes up the dispatch thread, a full queue means it
+            // already has a notification to read
+            zmq::message_t message;
+            notify_.send(message, ZMQ_DONTWAIT);
+        });
+    }
+
+    // Returns the sequence of the record
+    template <typename Message>
+    uint64_t Log(const Message& record) {
+        Serializer output(hint_);
+        Pack(output, record);
+        records_since_snapshot_++;
+        return log_.Append(output.data(), output.size());
+    }
+
+    uint64_t DurableSequence() const {
+        return log_.DurableSequence();
+    }
+
+    // Receives a message after each commit, to poll it from the dispatch
+    // thread
+    zmqw::socket& GetCommits() {
+        return commits_;
+    }
+
+    // Reads the pending commit messages
+    void DrainCommits() {
+        zmq::message_t message;
+        while (commits_.recv(message, ZMQ_DONTWAIT)) {
+        }
+    }
+
+    bool SnapshotDue() const {
+        return records_since_snapshot_ >= snapshot_interval_ &&
+               !snapshot_running_;
+    }
+
+    // Packs the database here and writes it in a background thread, the log
+    // continues in a new segment
+    void Snapshot(const DataBase& database) {
+        if (snapshot_running_) return;
+        if (snapshot_thread_.joinable()) snapshot_thread_.join();
+
+        uint64_t sequence = log_.Rotate();
+        snapshot_data_ = Serializer();
+        PackSnapshot(snapshot_data_, database, sequence);
+        records_since_snapshot_ = 0;
+
+        snapshot_running_ = true;
+        snapshot_thread_ =
+            std::thread(&DurableStore::WriteSnapshot, this, sequence);
+    }
+
+    void WriteJSON(std::ostream& os) const {
+        os << "{\"last_sequence\":" << log_.LastSequence()
+           << ",\"durable_sequence\":" << log_.DurableSequence()
+           << ",\"commits\":" << log_.Commits()
+           << ",\"failures\":" << log_.Failures()
+           << ",\"snapshots\":" << snapshots_.load()
+           << ",\"records_since_snapshot\":" << records_since_snapshot_
+           << "}";
+    }
+
+private:
+    static const char* SnapshotName() {
+        return "snapshot";
+    }
+
+    bool LoadSnapshot(DataBase& database, uint64_t& sequence) {
+        std::string path = fs::JoinPath(directory_, SnapshotName());
+        if (!fs::FileExists(path)) return true;
+
+        MappedFile file;
+        if (!file.Open(path)) {
+            LOG_ERROR("Can't open the snapshot " << path);
+            return false;
+        }
+        if (file.Size() == 0) return true;
+
+        try {
+            // The Deserializer reads the mapped pages, nothing is copied
+            zmq::message_t view(const_cast<char*>(file.Data()), file.Size(),
+                                nullptr, nullptr);
+            Deserializer input(std::move(view));
+            if (UnpackSnapshot(input, database, sequence)) return true;
+        } catch (std::exception& e) {
+            LOG_ERROR("Error loading the snapshot: " << e.what());
+        }
+        LOG_ERROR("The snapshot " << path << " is not valid");
+        return false;
+    }
+
+    static void ApplyRecord(DataBase& database, const char* data,
+                            size_t size) {
+        try {
+            Deserializer input(data, size);
+            RecordApplier applier{database};
+            if (!RecordDispatcher::Dispatch(applier, input)) {
+                LOG_WARNING("Unknown record in the log");
+            }
+        } catch (std::exception& e) {
+            LOG_ERROR("Error replaying a record: " << e.what());
+        }
+    }
+
+    void WriteSnapshot(uint64_t sequence) {
+        if (fs::WriteFileAtomically(directory_, SnapshotName(),
+                                    snapshot_data_.data(),
+                                    snapshot_data_.size())) {
+            log_.RemoveSegmentsUntil(sequence);
+            snapshots_++;
+        } else {
+            LOG_ERROR("Can't write the snapshot in " << directory_);
+        }
+        snapshot_running_ = false;
+    }
+
+private:
+    std::string directory_;
+    WriteAheadLog log_;
+    zmqw::socket commits_;
+    zmqw::socket notify_;  // Only used by the writer thread of the log
+    CapacityHint hint_;
+
+    uint64_t snapshot_interval_;  // Records between snapshots
+    uint64_t records_since_snapshot_;
+    std::atomic<uint64_t> snapshots_;
+    std::atomic<bool> snapshot_running_;
+    Serializer snapshot_data_;  // Owned by the snapshot thread while it runs
+    std::thread snapshot_thread_;
+};
@@ -0,0 +1,820 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Util/FileSystem.hpp>
+#include <Util/Log.hpp>
+#include <Util/MappedFile.hpp>
+#include <Util/Schema.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/Trace.hpp>
+#include <Util/Views.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+#include "OutboundQueues.hpp"
+#include "Protocol.hpp"
+#include "SearchIndex.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Message history
+// Each conversation, the whispers between two users or the messages of a
+// group, is an append-only log with a sparse index:
+//     <name>.log    | size (u32) | timestamp | sender | content |...
+//     <name>.idx    | timestamp (u64) | offset (u64) |...
+//     <name>.terms  Search index, see SearchIndex.hpp
+// The name is the conversation in hexadecimal, a long one is split in
+// subdirectories so every conversation has its own files.
+// The index has the first message of every kIndexInterval, so the message
+// with a sequence is found with the index entry of its block and reading at
+// most kIndexInterval - 1 records, and a timestamp with a binary search over
+// the index. The timestamps of a conversation never decrease. The logs are
+// read through memory mappings.
+//
+// A HistoryStore thread owns the files. The dispatch threads send it the
+// messages to append and the history requests with a HistoryWriter, and it
+// sends the responses to a socket that the thread of the client socket
+// forwards, so reading a page never holds a dispatch thread. The files are
+// synced once per second.
+//
+// The thread also keeps a search index of each open conversation (see
+// SearchIndex.hpp), updated as the messages are appended. It is saved when
+// the conversation is closed and every kIndexSaveInterval messages, the
+// messages after the saved ones are indexed again when it is opened.
+///////////////////////////////////////////////////////////////////////////////
+
+// Name of the conversation of the whispers between two users
+inline std::string WhisperConversation(const std::string& user1,
+                                       const std::string& user2) {
+    const std::string& first = std::min(user1, user2);
+    const std::string& second = std::max(user1, user2);
+    return "u:" + first + '\0' + second;
+}
+
+inline std::string GroupConversation(const std::string& group_name) {
+    return "g:" + group_name;
+}
+
+// Messages between the HistoryWriters and the HistoryStore
+enum class HistoryCommand : uint8_t { APPEND = 1, QUERY, SEARCH, STOP };
+
+struct HistoryAppend : Schema<static_cast<uint8_t>(HistoryCommand::APPEND)> {
+    std::string conversation;
+    uint64_t timestamp = 0;  // Milliseconds since the epoch
+    std::string sender;
+    std::string content;
+    SCHEMA_FIELDS(conversation, timestamp, sender, content)
+};
+
+// The response is sent to the identity of the request
+struct HistoryQuery : Schema<static_cast<uint8_t>(HistoryCommand::QUERY)> {
+    std::string conversation;
+    uint64_t trace_id = 0;
+    bool group = false;
+    std::string name;
+    uint64_t cursor = 0;
+    bool by_time = false;
+    bool before = true;
+    uint32_t limit = 0;
+    SCHEMA_FIELDS(conversation, trace_id, group, name, cursor, by_time,
+                  before, limit)
+};
+
+struct HistorySearch : Schema<static_cast<uint8_t>(HistoryCommand::SEARCH)> {
+    std::string conversation;
+    uint64_t trace_id = 0;
+    bool group = false;
+    std::string name;
+    std::string query;
+    uint64_t cursor = 0;
+    uint32_t limit = 0;
+    SCHEMA_FIELDS(conversation, trace_id, group, name, query, cursor, limit)
+};
+
+struct HistoryStop : Schema<static_cast<uint8_t>(HistoryCommand::STOP)> {
+    SCHEMA_FIELDS()
+};
+
+// Log and index of a conversation, they are opened on demand
+class ConversationLog {
+public:
+    static const uint64_t kIndexInterval = 64;
+    static const size_t kRecordHeaderSize = 4;
+
+public:
+    ConversationLog()
+          : log_fd_(-1),
+            index_fd_(-1),
+            size_(0),
+            count_(0),
+            last_timestamp_(0),
+            dirty_(false) {}
+
+    ~ConversationLog() {
+        Close();
+    }
+
+    ConversationLog(const ConversationLog&) = delete;
+    ConversationLog& operator=(const ConversationLog&) = delete;
+
+    // Loads the index and reads the records after its last entry, the ones
+    // missing in the index are added and a torn record is truncated
+    bool Open(const std::string& path) {
+        log_path_ = path + ".log";
+        log_fd_ = ::open(log_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        index_fd_ = ::open((path + ".idx").c_str(),
+                           O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (log_fd_ < 0 || index_fd_ < 0) {
+            LOG_ERROR("Can't open the history " << path);
+            return false;
+        }
+
+        MappedFile index;
+        if (!index.Open(path + ".idx") || !map_.Open(log_path_)) return false;
+        size_t entries = index.Size() / sizeof(IndexEntry);
+        index_.resize(entries);
+        if (entries > 0) {
+            std::memcpy(&index_[0], index.Data(),
+                        entries * sizeof(IndexEntry));
+        }
+        while (!index_.empty() && index_.back().offset >= map_.Size()) {
+            index_.pop_back();
+        }
+        if (index.Size() != index_.size() * sizeof(IndexEntry)) {
+            index.Close();
+            TruncateIndex();
+        }
+
+        // The records after the last entry of the index
+        uint64_t offset = 0;
+        if (!index_.empty()) {
+            offset = index_.back().offset;
+            count_ = (index_.size() - 1) * kIndexInterval;
+        }
+        while (offset < map_.Size()) {
+            uint32_t size;
+            uint64_t timestamp;
+            if (!ReadRecord(offset, size, timestamp)) break;
+            if (count_ % kIndexInterval == 0 &&
+                count_ / kIndexInterval == index_.size()) {
+                AppendIndex(timestamp, offset);
+            }
+            last_timestamp_ = timestamp;
+            count_++;
+            offset += kRecordHeaderSize + size;
+        }
+        size_ = offset;
+        if (offset < map_.Size()) {
+            LOG_WARNING("Torn record at the end of " << log_path_
+                                                     << ", truncated");
+            map_.Close();
+            if (::ftruncate(log_fd_, static_cast<off_t>(offset)) != 0) {
+                LOG_ERROR("Can't truncate " << log_path_);
+            }
+
+            // The entry of the torn record points past the end now, its
+            // block has no records
+            size_t entries = index_.size();
+            while (!index_.empty() && index_.back().offset >= size_) {
+                index_.pop_back();
+            }
+            if (index_.size() != entries) TruncateIndex();
+        }
+        return true;
+    }
+
+    void Close() {
+        Sync();
+        map_.Close();
+        if (log_fd_ >= 0) ::close(log_fd_);
+        if (index_fd_ >= 0) ::close(index_fd_);
+        log_fd_ = -1;
+        index_fd_ = -1;
+    }
+
+    // Returns false if it can't be written
+    bool Append(uint64_t timestamp, const std::string& sender,
+                const std::string& content) {
+        timestamp = std::max(timestamp, last_timestamp_);
+
+        Serializer payload;
+        payload << timestamp << sender << content;
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        char header[kRecordHeaderSize];
+        std::memcpy(header, &size, kRecordHeaderSize);
+        record_.assign(header, kRecordHeaderSize);
+        record_.append(payload.data(), size);
+
+        if (!fs::WriteAll(log_fd_, record_.data(), record_.size())) {
+            LOG_ERROR("Can't write the history " << log_path_);
+            return false;
+        }
+        if (count_ % kIndexInterval == 0 &&
+            count_ / kIndexInterval == index_.size()) {
+            AppendIndex(timestamp, size_);
+        }
+        size_ += kRecordHeaderSize + size;
+        count_++;
+        last_timestamp_ = timestamp;
+        dirty_ = true;
+        return true;
+    }
+
+    // Messages in the conversation, the sequence of the last one
+    uint64_t Count() const {
+        return count_;
+    }
+
+    // Sequence of the first message at or after the timestamp, Count() + 1
+    // if there is none
+    uint64_t FindTime(uint64_t timestamp) {
+        if (count_ == 0 || !Map()) return count_ + 1;
+
+        // The first block that starts at or after the timestamp, the message
+        // may be in the block before it
+        auto it = std::lower_bound(index_.begin(), index_.end(), timestamp,
+                                   [](const IndexEntry& entry, uint64_t t) {
+                                       return entry.timestamp < t;
+                                   });
+        if (it == index_.begin()) return 1;
+        size_t block = (it - index_.begin()) - 1;
+
+        uint64_t sequence = block * kIndexInterval + 1;
+        uint64_t offset = index_[block].offset;
+        while (sequence <= count_) {
+            uint32_t size;
+            uint64_t record_timestamp;
+            if (!ReadRecord(offset, size, record_timestamp)) break;
+            if (record_timestamp >= timestamp) return sequence;
+            offset += kRecordHeaderSize + size;
+            sequence++;
+        }
+        return sequence;
+    }
+
+    // Appends the messages from first until before end
+    void Read(uint64_t first, uint64_t end,
+              std::vector<HistoryMessage>& messages) {
+        end = std::min(end, count_ + 1);
+        if (first == 0 || first >= end || !Map()) return;
+
+        size_t block = (first - 1) / kIndexInterval;
+        uint64_t sequence = block * kIndexInterval + 1;
+        uint64_t offset = index_[block].offset;
+        for (; sequence < end; sequence++) {
+            uint32_t size;
+            uint64_t timestamp;
+            if (!ReadRecord(offset, size, timestamp)) return;
+            if (sequence >= first) {
+                HistoryMessage message;
+                message.sequence = sequence;
+                if (!ReadMessage(offset, size, message)) return;
+                messages.push_back(std::move(message));
+            }
+            offset += kRecordHeaderSize + size;
+        }
+    }
+
+    bool IsDirty() const {
+        return dirty_;
+    }
+
+    bool Sync() {
+        if (!dirty_) return true;
+        dirty_ = false;
+        return fs::SyncFile(log_fd_) && fs::SyncFile(index_fd_);
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t timestamp;
+        uint64_t offset;
+    };
+
+    // Maps the log again if it grew since it was mapped
+    bool Map() {
+        if (map_.Size() >= size_) return true;
+        if (!map_.Open(log_path_) || map_.Size() < size_) {
+            LOG_ERROR("Can't map the history " << log_path_);
+            return false;
+        }
+        return true;
+    }
+
+    // Reads the size and the timestamp of the record at the offset, returns
+    // false if it is not complete
+    bool ReadRecord(uint64_t offset, uint32_t& size,
+                    uint64_t& timestamp) const {
+        if (map_.Size() - offset < kRecordHeaderSize) return false;
+        std::memcpy(&size, map_.Data() + offset, kRecordHeaderSize);
+        if (map_.Size() - offset - kRecordHeaderSize < size) return false;
+        try {
+            Deserializer input(View(offset, size));
+            input >> timestamp;
+            return true;
+        } catch (std::exception&) {
+            return false;
+        }
+    }
+
+    bool ReadMessage(uint64_t offset, uint32_t size,
+                     HistoryMessage& message) const {
+        try {
+            Deserializer input(View(offset, size));
+            input >> message.timestamp >> message.sender >> message.content;
+            return true;
+        } catch (std::exception& e) {
+            LOG_ERROR("Invalid record in " << log_path_ << ": " << e.what());
+            return false;
+        }
+    }
+
+    // The payload of the record, without copying it
+    zmq::message_t View(uint64_t offset, uint32_t size) const {
+        char* payload =
+            const_cast<char*>(map_.Data()) + offset + kRecordHeaderSize;
+        return zmq::message_t(payload, size, nullptr, nullptr);
+    }
+
+    void AppendIndex(uint64_t timestamp, uint64_t offset) {
+        IndexEntry entry{timestamp, offset};
+        index_.push_back(entry);
+        if (!fs::WriteAll(index_fd_, reinterpret_cast<const char*>(&entry),
+                          sizeof(entry))) {
+            LOG_ERROR("Can't write the history index of " << log_path_);
+        }
+    }
+
+    void TruncateIndex() {
+        off_t size = static_cast<off_t>(index_.size() * sizeof(IndexEntry));
+        if (::ftruncate(index_fd_, size) != 0) {
+            LOG_ERROR("Can't truncate the history index of " << log_path_);
+        }
+    }
+
+private:
+    std::string log_path_;
+    int log_fd_;
+    int index_fd_;
+    MappedFile map_;
+    std::vector<IndexEntry> index_;
+    std::string record_;  // Buffer of the record being appended
+    uint64_t size_;       // Bytes of the complete records
+    uint64_t count_;
+    uint64_t last_timestamp_;
+    bool dirty_;
+};
+
+class HistoryStore {
+public:
+    // Messages in a page, and conversations kept open
+    static const uint32_t kMaxPage = 200;
+    static const size_t kMaxOpen = 512;
+    // Messages handled or forwarded before polling again
+    static const size_t kMaxBurst = 256;
+    // Messages indexed before the index of a conversation is saved
+    static const uint64_t kIndexSaveInterval = 65536;
+
+public:
+    HistoryStore(zmq::context_t& context, const std::string& directory)
+          : directory_(directory),
+            input_(context, ZMQ_PULL),
+            output_(context, ZMQ_PUSH),
+            replies_(context, ZMQ_PULL),
+            control_(context, ZMQ_PUSH),
+            appended_(0),
+            queries_(0),
+            searches_(0),
+            indexed_(0),
+            loaded_(0),
+            failures_(0) {
+        std::ostringstream endpoint;
+        endpoint << "inproc://chat-history-" << static_cast<const void*>(this);
+        endpoint_ = endpoint.str();
+
+        const int unlimited = 0;
+        for (zmqw::socket* socket : {&input_, &output_, &replies_, &control_}) {
+            socket->setsockopt(ZMQ_SNDHWM, unlimited);
+            socket->setsockopt(ZMQ_RCVHWM, unlimited);
+            socket->setsockopt(ZMQ_LINGER, 0);
+        }
+        input_.bind(endpoint_);
+        replies_.bind(endpoint_ + "-replies");
+        output_.connect(endpoint_ + "-replies");
+        control_.connect(endpoint_);
+    }
+
+    ~HistoryStore() {
+        Stop();
+    }
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // Where the HistoryWriters connect
+    const std::string& GetEndpoint() const {
+        return endpoint_;
+    }
+
+    bool Open() {
+        if (!fs::MakeDirectories(directory_)) {
+            LOG_ERROR("Can't create the history directory " << directory_);
+            return false;
+        }
+        thread_ = std::thread(&HistoryStore::Run, this);
+        return true;
+    }
+
+    // The messages already sent to the store are handled before it stops
+    void Stop() {
+        if (!thread_.joinable()) return;
+        Serializer output;
+        Pack(output, HistoryStop());
+        control_.send(std::string(), ZMQ_SNDMORE);
+        control_.send(std::move(output));
+        thread_.join();
+    }
+
+    // Socket with the responses for the clients, to poll it
+    zmqw::socket& GetReplies() {
+        return replies_;
+    }
+
+    // Sends the responses that are ready to the clients
+    void ForwardReplies(OutboundQueues& outbound) {
+        for (size_t i = 0; i < kMaxBurst; i++) {
+            std::string identity;
+            zmq::message_t frame;
+            if (!replies_.recv(identity, ZMQ_DONTWAIT)) break;
+            replies_.recv(frame);
+            outbound.Send(identity, &frame, 1, OutboundClass::RESPONSE);
+        }
+    }
+
+    void WriteJSON(std::ostream& os) const {
+        os << "{\"appended\":" << appended_.load()
+           << ",\"queries\":" << queries_.load()
+           << ",\"searches\":" << searches_.load()
+           << ",\"indexed\":" << indexed_.load()
+           << ",\"conversations_loaded\":" << loaded_.load()
+           << ",\"failures\":" << failures_.load() << "}";
+    }
+
+private:
+    struct CommandHandler {
+        HistoryStore& store;
+        const std::string& identity;
+        bool& running;
+
+        void operator()(const HistoryAppend& message) {
+            store.Append(message);
+        }
+
+        void operator()(const HistoryQuery& query) {
+            store.Answer(identity, query);
+        }
+
+        void operator()(const HistorySearch& search) {
+            store.Answer(identity, search);
+        }
+
+        void operator()(const HistoryStop& /*stop*/) {
+            running = false;
+        }
+    };
+
+    using CommandDispatcher = Dispatcher<CommandHandler, HistoryAppend,
+                                         HistoryQuery, HistorySearch,
+                                         HistoryStop>;
+
+    struct OpenConversation {
+        std::string file_name;
+        ConversationLog log;
+        TermIndex index;
+        std::list<std::string>::iterator recent;
+    };
+
+    // File name of the conversation, its name in hexadecimal. A long name
+    // is split in directories of kMaxBytes of the name, the last part is
+    // the file. The conversation can be read back from the name, so two
+    // conversations never share their files.
+    static std::string FileName(const std::string& conversation) {
+        static const char kDigits[] = "0123456789abcdef";
+        static const size_t kMaxBytes = 96;
+        std::string name;
+        for (size_t i = 0; i < conversation.size(); i++) {
+            if (i > 0 && i % kMaxBytes == 0) name += '/';
+            uint8_t byte = static_cast<uint8_t>(conversation[i]);
+            name += kDigits[byte >> 4];
+            name += kDigits[byte & 15];
+        }
+        return name;
+    }
+
+    // The conversation, opened if it is not, nullptr if it can't be opened
+    OpenConversation* GetConversation(const std::string& conversation) {
+        auto it = conversations_.find(conversation);
+        if (it != conversations_.end()) {
+            recent_.splice(recent_.begin(), recent_, it->second->recent);
+            return it->second.get();
+        }
+
+        std::unique_ptr<OpenConversation> open(new OpenConversation);
+        open->file_name = FileName(conversation);
+        size_t parent = open->file_name.rfind('/');
+        if (parent != std::string::npos &&
+            !fs::MakeDirectories(fs::JoinPath(
+                directory_, open->file_name.substr(0, parent)))) {
+            failures_++;
+            return nullptr;
+        }
+        if (!open->log.Open(fs::JoinPath(directory_, open->file_name))) {
+            failures_++;
+            return nullptr;
+        }
+        if (!open->index.Load(fs::JoinPath(directory_, IndexName(*open)))) {
+            failures_++;
+        }
+        CatchUp(*open);
+        loaded_++;
+
+        // The least recently used conversation is closed
+        if (conversations_.size() >= kMaxOpen) {
+            auto last = conversations_.find(recent_.back());
+            Close(*last->second);
+            conversations_.erase(last);
+            recent_.pop_back();
+        }
+        recent_.push_front(conversation);
+        open->recent = recent_.begin();
+        OpenConversation* result = open.get();
+        conversations_[conversation] = std::move(open);
+        return result;
+    }
+
+    static std::string IndexName(const OpenConversation& open) {
+        return open.file_name + ".terms";
+    }
+
+    // Indexes the messages after the ones in the saved index, all of them
+    // if the index has messages lost by the log
+    void CatchUp(OpenConversation& open) {
+        const uint64_t kBatch = 1024;
+        if (open.index.Count() > open.log.Count()) open.index.Clear();
+
+        std::vector<HistoryMessage> messages;
+        uint64_t first = open.index.Count() + 1;
+        for (; first <= open.log.Count(); first += kBatch) {
+            messages.clear();
+            open.log.Read(first, first + kBatch, messages);
+            for (const HistoryMessage& message : messages) {
+                open.index.Add(message.sequence, message.content);
+            }
+            indexed_ += messages.size();
+        }
+    }
+
+    void SaveIndex(OpenConversation& open) {
+        if (open.index.Unsaved() == 0) return;
+        // The log is synced first, so the index never has lost messages
+        if (!open.log.Sync() ||
+            !open.index.Save(directory_, IndexName(open))) {
+            failures_++;
+        }
+    }
+
+    void Close(OpenConversation& open) {
+        SaveIndex(open);
+        if (!open.log.Sync()) failures_++;
+    }
+
+    void Append(const HistoryAppend& message) {
+        OpenConversation* open = GetConversation(message.conversation);
+        if (!open || !open->log.Append(message.timestamp, message.sender,
+                                       message.content)) {
+            failures_++;
+            return;
+        }
+        appended_++;
+
+        open->index.Add(open->log.Count(), message.content);
+        indexed_++;
+        if (open->index.Unsaved() >= kIndexSaveInterval) SaveIndex(*open);
+    }
+
+    void Answer(const std::string& identity, const HistoryQuery& query) {
+        queries_++;
+        HistoryResponse response;
+        response.group = query.group;
+        response.name = query.name;
+
+        OpenConversation* open = GetConversation(query.conversation);
+        if (open) {
+            ConversationLog* log = &open->log;
+            uint64_t count = log->Count();
+            uint64_t limit = std::max<uint32_t>(
+                1, std::min<uint32_t>(query.limit, kMaxPage));
+            uint64_t first, end;
+            if (query.before) {
+                end = count + 1;
+                if (query.cursor != 0) {
+                    end = std::min(end, query.by_time
+                                            ? log->FindTime(query.cursor)
+                                            : query.cursor);
+                }
+                first = end > limit ? end - limit : 1;
+                response.more = first > 1;
+            } else {
+                first = query.by_time ? log->FindTime(query.cursor)
+                                      : std::min(query.cursor, count) + 1;
+                end = std::min(count + 1, first + limit);
+                response.more = end <= count;
+            }
+            log->Read(first, end, response.messages);
+        }
+        Reply(identity, query.trace_id, response);
+    }
+
+    void Answer(const std::string& identity, const HistorySearch& search) {
+        searches_++;
+        SearchResponse response;
+        response.group = search.group;
+        response.name = search.name;
+        response.query = search.query;
+
+        OpenConversation* open = GetConversation(search.conversation);
+        if (open) {
+            size_t limit = std::max<uint32_t>(
+                1, std::min<uint32_t>(search.limit, kMaxPage));
+            open->index.Search(search.query, search.cursor, limit,
+                               sequences_, response.more);
+            for (uint64_t sequence : sequences_) {
+                open->log.Read(sequence, sequence + 1, response.messages);
+            }
+        }
+        Reply(identity, search.trace_id, response);
+    }
+
+    template <typename Response>
+    void Reply(const std::string& identity, uint64_t trace_id,
+               const Response& response) {
+        Serializer output(hint_);
+        if (trace_id) Pack(output, TraceEnvelope(trace_id, trace::Now()));
+        Pack(output, response);
+        output_.send(identity, ZMQ_SNDMORE);
+        output_.send(std::move(output));
+    }
+
+    void SyncAll() {
+        for (auto& pair : conversations_) {
+            if (!pair.second->log.Sync()) failures_++;
+        }
+    }
+
+    void Run() {
+        using Clock = std::chrono::steady_clock;
+        const std::chrono::milliseconds kSyncInterval(1000);
+        Clock::time_point last_sync = Clock::now();
+
+        bool running = true;
+        while (running) {
+            zmq::pollitem_t items[] = {
+                {static_cast<void*>(input_), 0, ZMQ_POLLIN, 0}};
+            try {
+                zmq::poll(items, 1, kSyncInterval.count());
+            } catch (zmq::error_t&) {
+                continue;  // Interrupted by a signal
+            }
+
+            for (size_t i = 0; running && i < kMaxBurst; i++) {
+                std::string identity;
+                Deserializer message;
+                try {
+                    if (!input_.recv(identity, ZMQ_DONTWAIT)) break;
+                    input_.recv(message);
+                    CommandHandler handler{*this, identity, running};
+                    CommandDispatcher::Dispatch(handler, message);
+                } catch (zmq::error_t& e) {
+                    if (e.num() != EINTR) {
+                        LOG_ERROR("Error receiving history: " << e.what());
+                    }
+                } catch (std::exception& e) {
+                    failures_++;
+                    LOG_ERROR("Invalid history message: " << e.what());
+                }
+            }
+
+            if (Clock::now() - last_sync >= kSyncInterval) {
+                SyncAll();
+                last_sync = Clock::now();
+            }
+        }
+        for (auto& pair : conversations_) Close(*pair.second);
+    }
+
+private:
+    std::string directory_;
+    std::string endpoint_;
+    zmqw::socket input_;    // Only used by the thread
+    zmqw::socket output_;   // Only used by the thread
+    zmqw::socket replies_;  // Only used by the owner
+    zmqw::socket control_;  // Only used by the owner
+    CapacityHint hint_;
+
+    // Only used by the thread
+    std::unordered_map<std::string, std::unique_ptr<OpenConversation>>
+        conversations_;
+    std::list<std::string> recent_;  // The most recently used first
+    std::vector<uint64_t> sequences_;
+
+    std::atomic<uint64_t> appended_;
+    std::atomic<uint64_t> queries_;
+    std::atomic<uint64_t> searches_;
+    std::atomic<uint64_t> indexed_;
+    std::atomic<uint64_t> loaded_;
+    std::atomic<uint64_t> failures_;
+    std::thread thread_;
+};
+
+// Sends the messages and the queries of a dispatch thread to the
+// HistoryStore, each thread needs its own writer
+class HistoryWriter {
+public:
+    HistoryWriter(zmq::context_t& context, const std::string& endpoint)
+          : socket_(context, ZMQ_PUSH) {
+        const int unlimited = 0;
+        socket_.setsockopt(ZMQ_SNDHWM, unlimited);
+        socket_.setsockopt(ZMQ_LINGER, 0);
+        socket_.connect(endpoint);
+    }
+
+    void Append(const std::string& conversation, const std::string& sender,
+                const std::string& content) {
+        using namespace std::chrono;
+        HistoryAppend message;
+        message.conversation = conversation;
+        message.timestamp = duration_cast<milliseconds>(
+                                system_clock::now().time_since_epoch())
+                                .count();
+        message.sender = sender;
+        message.content = content;
+        Send(std::string(), message);
+    }
+
+    void Query(const std::string& identity, uint64_t trace_id,
+               const std::string& conversation,
+               const HistoryRequest& request) {
+        HistoryQuery query;
+        query.conversation = conversation;
+        query.trace_id = trace_id;
+        query.group = request.group;
+        query.name = request.name;
+        query.cursor = request.cursor;
+        query.by_time = request.by_time;
+        query.before = request.before;
+        query.limit = request.limit;
+        Send(identity, query);
+    }
+
+    void Search(const std::string& identity, uint64_t trace_id,
+                const std::string& conversation,
+                const SearchRequest& request) {
+        HistorySearch search;
+        search.conversation = conversation;
+        search.trace_id = trace_id;
+        search.group = request.group;
+        search.name = request.name;
+        search.query = request.query;
+        search.cursor = request.cursor;
+        search.limit = request.limit;
+        Send(identity, search);
+    }
+
+private:
+    template <typename Message>
+    void Send(const std::string& identity, const Message& message) {
+        Serializer output(hint_);
+        Pack(output, message);
+        socket_.send(identity, ZMQ_SNDMORE);
+        socket_.send(std::move(output));
+    }
+
+private:
+    zmqw::socket socket_;
+    CapacityHint hint_;
+};
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Util/Log.hpp>
+#include <Util/Schema.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/Views.hpp>
+#include <Util/WriteAheadLog.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+#include "DataBase.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Offline inbox
+// The updates for users that are not connected are appended to a log of
+// segment files (see Util/WriteAheadLog.hpp), a group message is written
+// once for all its offline members. The memory only keeps an index entry per
+// pending message and user, with the position of the update in its segment,
+// and the limits of each user bound it.
+//
+// When the user connects its inbox is read back and sent to the identity in
+// multipart messages of up to kBatchMessages updates, each part is an update
+// as if it was sent alone. Then an ack record marks the messages of the user
+// as delivered, so they are not restored after a restart.
+//
+// The messages older than the retention are dropped, and so are the oldest
+// ones of a user over its limits. The segments are removed once all their
+// messages are gone.
+///////////////////////////////////////////////////////////////////////////////
+
+struct InboxLimits {
+    InboxLimits()
+          : retention_seconds(7 * 24 * 60 * 60),
+            max_messages(10000),
+            max_bytes(64 << 20) {}
+
+    uint64_t retention_seconds;
+    size_t max_messages;  // Per user
+    size_t max_bytes;     // Per user, of the updates
+};
+
+enum class InboxRecordType : uint8_t { MESSAGE = 1, ACK };
+
+// Update for the recipients, packed as it is sent
+struct InboxMessageRecord : Schema<static_cast<uint8_t>(
+                                InboxRecordType::MESSAGE)> {
+    std::vector<std::string> recipients;
+    uint64_t timestamp = 0;  // Milliseconds since the epoch
+    BinView update;
+    SCHEMA_FIELDS(recipients, timestamp, update)
+};
+
+// The messages of the user until the sequence are delivered or dropped
+struct InboxAckRecord : Schema<static_cast<uint8_t>(InboxRecordType::ACK)> {
+    InboxAckRecord() = default;
+    InboxAckRecord(const std::string& username, uint64_t sequence)
+          : username(username), sequence(sequence) {}
+
+    std::string username;
+    uint64_t sequence = 0;
+    SCHEMA_FIELDS(username, sequence)
+};
+
+class OfflineInbox {
+public:
+    // Updates sent in each multipart message when an inbox is drained
+    static const size_t kBatchMessages = 256;
+    static const size_t kBatchBytes = 1 << 20;
+
+    // A new segment is started after this size
+    static const uint64_t kSegmentSize = 64 << 20;
+
+public:
+    OfflineInbox(DataBase& database, const std::string& directory,
+                 const InboxLimits& limits)
+          : database_(database),
+            log_(directory),
+            limits_(limits),
+            replaying_(false),
+            last_expiration_(0),
+            reader_fd_(-1),
+            reader_segment_(0),
+            pending_messages_(0),
+            pending_bytes_(0),
+            stored_(0),
+            delivered_(0),
+            batches_(0),
+            dropped_(0),
+            expired_(0),
+            read_failures_(0) {}
+
+    ~OfflineInbox() {
+        log_.Close();
+        CloseReader();
+    }
+
+    OfflineInbox(const OfflineInbox&) = delete;
+    OfflineInbox& operator=(const OfflineInbox&) = delete;
+
+    // Restores the pending messages from the segments, the users of the
+    // database must be loaded already
+    bool Open() {
+        uint64_t now = Now();
+        replaying_ = true;
+        uint64_t last = log_.Replay(
+            0, [&](uint64_t sequence, const char* data, size_t size,
+                   const WriteAheadLog::Position& position) {
+                Restore(sequence, data, size, position, now);
+            });
+        replaying_ = false;
+        LOG_INFO("Restored " << pending_messages_
+                             << " offline messages from the inbox");
+        if (!log_.Open(last + 1, nullptr)) return false;
+        RemoveDeliveredSegments();
+        return true;
+    }
+
+    // Keeps the update for the users until they connect. The update is
+    // packed without trace envelope.
+    void Store(const std::vector<UserId>& recipients,
+               const Serializer& update) {
+        if (recipients.empty()) return;
+        uint64_t now = Now();
+        Expire(now);
+
+        InboxMessageRecord record;
+        record.timestamp = now;
+        record.update = BinView(update.data(), update.size());
+        for (UserId user : recipients) {
+            record.recipients.push_back(database_.GetUsername(user));
+        }
+
+        // The update is the last field, so it ends the record
+        Serializer output(hint_);
+        Pack(output, record);
+        uint64_t update_offset = output.size() - update.size();
+        WriteAheadLog::Position position;
+        uint64_t sequence =
+            log_.Append(output.data(), output.size(), &position);
+
+        // Kept here until it can be read from the segment, the durable
+        // ones are dropped so it doesn't grow while no user connects
+        TrimUnflushed(log_.DurableSequence());
+        unflushed_.emplace_back(sequence,
+                                std::string(update.data(), update.size()));
+
+        InboxEntry entry{sequence, position.segment,
+                         position.offset + update_offset,
+                         static_cast<uint32_t>(update.size()), now};
+        for (UserId user : recipients) Push(user, entry);
+        stored_++;
+
+        if (log_.SegmentSize() >= kSegmentSize) {
+            log_.Rotate();
+            RemoveDeliveredSegments();
+        }
+    }
+
+    bool HasMessages(UserId user) const {
+        return user < inboxes_.size() && !inboxes_[user].entries.empty();
+    }
+
+    // Passes the pending messages of the user in batches to send, each
+    // batch is the parts of a message to its identity, compressed if it
+    // negotiated compression. Removes them and returns the messages sent.
+    template <typename SendFunction>
+    size_t Drain(UserId user, lz::Context* compression, SendFunction send) {
+        Expire(Now());
+        if (!HasMessages(user)) return 0;
+
+        UserInbox& inbox = inboxes_[user];
+        uint64_t durable = log_.DurableSequence();
+        TrimUnflushed(durable);
+
+        std::vector<zmq::message_t> batch;
+        size_t batch_bytes = 0;
+        size_t sent = 0;
+        for (const InboxEntry& entry : inbox.entries) {
+            zmq::message_t frame;
+            if (!ReadUpdate(entry, durable, frame)) {
+                read_failures_++;
+                continue;
+            }
+            if (compression) {
+                Serializer output;
+                if (Serializer::Compress(
+                        *compression, static_cast<const char*>(frame.data()),
+                        frame.size(), output)) {
+                    frame = output.Release();
+                }
+            }
+            batch_bytes += frame.size();
+            batch.push_back(std::move(frame));
+            if (batch.size() >= kBatchMessages || batch_bytes >= kBatchBytes) {
+                sent += SendBatch(batch, send);
+                batch_bytes = 0;
+            }
+        }
+        sent += SendBatch(batch, send);
+        CloseReader();
+
+        delivered_ += sent;
+        Acknowledge(user, inbox.entries.back().sequence);
+        return sent;
+    }
+
+    void WriteJSON(std::ostream& os) const {
+        os << "{\"pending_messages\":" << pending_messages_
+           << ",\"pending_bytes\":" << pending_bytes_
+           << ",\"stored\":" << stored_ << ",\"delivered\":" << delivered_
+           << ",\"batches\":" << batches_ << ",\"dropped\":" << dropped_
+           << ",\"expired\":" << expired_
+           << ",\"read_failures\":" << read_failures_
+           << ",\"log_failures\":" << log_.Failures() << "}";
+    }
+
+private:
+    // Pending message of a user
+    struct InboxEntry {
+        uint64_t sequence;
+        uint64_t segment;
+        uint64_t offset;  // Of the update in the segment
+        uint32_t size;
+        uint64_t timestamp;
+    };
+
+    struct UserInbox {
+        std::deque<InboxEntry> entries;
+        size_t bytes = 0;
+    };
+
+    // Applies the records while they are replayed
+    struct RecordRestorer {
+        OfflineInbox& inbox;
+        uint64_t sequence;
+        const char* payload;
+        const WriteAheadLog::Position& position;
+        uint64_t now;
+
+        void operator()(const InboxMessageRecord& record) {
+            if (inbox.IsExpired(record.timestamp, now)) return;
+            uint64_t update_offset = record.update.data() - payload;
+            InboxEntry entry{sequence, position.segment,
+                             position.offset + update_offset,
+                             static_cast<uint32_t>(record.update.size()),
+                             record.timestamp};
+            for (auto& recipient : record.recipients) {
+                inbox.Push(inbox.database_.InternUser(recipient), entry);
+            }
+        }
+
+        void operator()(const InboxAckRecord& record) {
+            // The members of a group of other shard are not registered here
+            UserId user = inbox.database_.InternUser(record.username);
+            inbox.PopUntil(user, record.sequence);
+        }
+    };
+
+    using RecordDispatcher =
+        Dispatcher<RecordRestorer, InboxMessageRecord, InboxAckRecord>;
+
+    static uint64_t Now() {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(
+                   system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    bool IsExpired(uint64_t timestamp, uint64_t now) const {
+        return timestamp + limits_.retention_seconds * 1000 <= now;
+    }
+
+    void Restore(uint64_t sequence, const char* data, size_t size,
+                 const WriteAheadLog::Position& position, uint64_t now) {
+        try {
+            // The views of the record point to the payload, so the position
+            // of the update is known
+            zmq::message_t view(const_cast<char*>(data), size, nullptr,
+                                nullptr);
+            Deserializer input(std::move(view));
+            RecordRestorer restorer{*this, sequence, data, position, now};
+            RecordDispatcher::Dispatch(restorer, input);
+        } catch (std::exception& e) {
+            LOG_ERROR("Error restoring an inbox record: " << e.what());
+        }
+    }
+
+    UserInbox& GetInbox(UserId user) {
+        if (user >= inboxes_.size()) inboxes_.resize(database_.NumUsers());
+        return inboxes_[user];
+    }
+
+    // Appends the entry, dropping the oldest messages over the limits
+    void Push(UserId user, const InboxEntry& entry) {
+        UserInbox& inbox = GetInbox(user);
+        if (inbox.entries.empty()) fronts_.emplace(entry.sequence, user);
+        inbox.entries.push_back(entry);
+        inbox.bytes += entry.size;
+        pending_messages_++;
+        pending_bytes_ += entry.size;
+
+        uint64_t dropped_until = 0;
+        while (inbox.entries.size() > limits_.max_messages ||
+               inbox.bytes > limits_.max_bytes) {
+            dropped_until = inbox.entries.front().sequence;
+            PopFront(user);
+            dropped_++;
+        }
+        if (dropped_until != 0 && !replaying_) Log(user, dropped_until);
+    }
+
+    void PopFront(UserId user) {
+        UserInbox& inbox = inboxes_[user];
+        const InboxEntry& entry = inbox.entries.front();
+        fronts_.erase(std::make_pair(entry.sequence, user));
+        inbox.bytes -= entry.size;
+        pending_messages_--;
+        pending_bytes_ -= entry.size;
+        inbox.entries.pop_front();
+        if (!inbox.entries.empty()) {
+            fronts_.emplace(inbox.entries.front().sequence, user);
+        }
+    }
+
+    void PopUntil(UserId user, uint64_t sequence) {
+        if (user >= inboxes_.size()) return;
+        UserInbox& inbox = inboxes_[user];
+        while (!inbox.entries.empty() &&
+               inbox.entries.front().sequence <= sequence) {
+            PopFront(user);
+        }
+    }
+
+    void Acknowledge(UserId user, uint64_t sequence) {
+        PopUntil(user, sequence);
+        Log(user, sequence);
+    }
+
+    void Log(UserId user, uint64_t sequence) {
+        Serializer output(hint_);
+        Pack(output, InboxAckRecord(database_.GetUsername(user), sequence));
+        log_.Append(output.data(), output.size());
+    }
+
+    // Drops the expired messages, oldest first, at most once per second
+    void Expire(uint64_t now) {
+        if (now < last_expiration_ + 1000) return;
+        last_expiration_ = now;
+        while (!fronts_.empty()) {
+            UserId user = fronts_.begin()->second;
+            if (!IsExpired(inboxes_[user].entries.front().timestamp, now)) {
+                break;
+            }
+            PopFront(user);
+            expired_++;
+        }
+    }
+
+    // The segments before the oldest pending message only have delivered
+    // or dropped messages, and acks of them
+    void RemoveDeliveredSegments() {
+        uint64_t oldest = fronts_.empty() ? log_.LastSequence() + 1
+                                          : fronts_.begin()->first;
+        log_.RemoveSegmentsUntil(oldest - 1);
+    }
+
+    void TrimUnflushed(uint64_t durable) {
+        while (!unflushed_.empty() && unflushed_.front().first <= durable) {
+            unflushed_.pop_front();
+        }
+    }
+
+    // Reads the update of the entry from its segment, or from memory if the
+    // segment doesn't have it yet
+    bool ReadUpdate(const InboxEntry& entry, uint64_t durable,
+                    zmq::message_t& frame) {
+        if (entry.sequence > durable) {
+            auto it = std::lower_bound(
+                unflushed_.begin(), unflushed_.end(), entry.sequence,
+                [](const std::pair<uint64_t, std::string>& unflushed,
+                   uint64_t sequence) { return unflushed.first < sequence; });
+            if (it == unflushed_.end() || it->first != entry.sequence) {
+                return false;
+            }
+            frame = zmq::message_t(it->second.data(), it->second.size());
+            return true;
+        }
+
+        if (reader_fd_ < 0 || reader_segment_ != entry.segment) {
+            CloseReader();
+            std::string path = log_.SegmentPath(entry.segment);
+            reader_fd_ = ::open(path.c_str(), O_RDONLY);
+            if (reader_fd_ < 0) return false;
+            reader_segment_ = entry.segment;
+        }
+        frame = zmq::message_t(entry.size);
+        ssize_t read = ::pread(reader_fd_, frame.data(), entry.size,
+                               static_cast<off_t>(entry.offset));
+        return read == static_cast<ssize_t>(entry.size);
+    }
+
+    void CloseReader() {
+        if (reader_fd_ >= 0) ::close(reader_fd_);
+        reader_fd_ = -1;
+    }
+
+    // Sends the updates as the parts of a single message
+    template <typename SendFunction>
+    size_t SendBatch(std::vector<zmq::message_t>& batch, SendFunction& send) {
+        if (batch.empty()) return 0;
+        size_t sent = batch.size();
+        send(batch);
+        batch.clear();
+        batches_++;
+        return sent;
+    }
+
+private:
+    DataBase& database_;
+    WriteAheadLog log_;
+    InboxLimits limits_;
+    CapacityHint hint_;
+    bool replaying_;
+
+    std::vector<UserInbox> inboxes_;  // By UserId
+    // First pending message of each user, the oldest first
+    std::set<std::pair<uint64_t, UserId>> fronts_;
+    // Updates appended but not durable yet, by sequence
+    std::deque<std::pair<uint64_t, std::string>> unflushed_;
+    uint64_t last_expiration_;
+
+    int reader_fd_;
+    uint64_t reader_segment_;
+
+    size_t pending_messages_;
+    size_t pending_bytes_;
+    uint64_t stored_;
+    uint64_t delivered_;
+    uint64_t batches_;
+    uint64_t dropped_;
+    uint64_t expired_;
+    uint64_t read_failures_;
+};
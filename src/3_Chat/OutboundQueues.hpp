@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Util/ZMQWrapper.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Outbound queues
+// The messages to the clients are sent to the ROUTER socket without waiting,
+// with ZMQ_ROUTER_MANDATORY so a client whose pipe reached the high-water
+// mark is reported instead of its messages being dropped silently. Then the
+// message is kept in a queue of the identity, and the later ones go behind
+// it until Flush sends them. The queue of an identity is sent by class: the
+// responses first, then the text, the voice messages and the call audio.
+//
+// An identity keeps up to max_messages and max_bytes queued. Over them, or
+// over max_call_messages of call audio, the oldest call audio is dropped,
+// it is useless once late. A client that stays over the limits for
+// slow_timeout_ms, or goes over twice them, is a slow consumer: its queue is
+// dropped and it is reported by TakeDisconnected so its session is ended.
+//
+// Only used by the thread that owns the socket.
+///////////////////////////////////////////////////////////////////////////////
+
+enum class OutboundClass : uint8_t { RESPONSE, TEXT, VOICE, CALL };
+
+static const size_t kNumOutboundClasses = 4;
+
+// Name of the class in the statistics
+inline const char* OutboundClassName(OutboundClass type) {
+    static const char* const kNames[] = {"response", "text", "voice", "call"};
+    size_t index = static_cast<size_t>(type);
+    return index < kNumOutboundClasses ? kNames[index] : "unknown";
+}
+
+struct OutboundLimits {
+    OutboundLimits()
+          : max_messages(4096),
+            max_bytes(16 << 20),
+            max_call_messages(64),
+            slow_timeout_ms(10000) {}
+
+    size_t max_messages;       // Per identity
+    size_t max_bytes;          // Per identity
+    size_t max_call_messages;  // Per identity, the older ones are dropped
+    uint64_t slow_timeout_ms;  // Over the limits before the disconnection
+};
+
+class OutboundQueues {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Milliseconds between the flushes while there are queued messages
+    static const long kFlushIntervalMs = 2;
+
+public:
+    OutboundQueues(zmqw::socket& socket, const OutboundLimits& limits)
+          : socket_(socket),
+            limits_(limits),
+            queued_messages_(0),
+            queued_bytes_(0),
+            flushed_(0),
+            unroutable_(0),
+            slow_consumers_(0) {
+        const int mandatory = 1;
+        socket_.setsockopt(ZMQ_ROUTER_MANDATORY, mandatory);
+        for (size_t i = 0; i < kNumOutboundClasses; i++) {
+            sent_[i] = 0;
+            queued_[i] = 0;
+            dropped_[i] = 0;
+        }
+    }
+
+    OutboundQueues(const OutboundQueues&) = delete;
+    OutboundQueues& operator=(const OutboundQueues&) = delete;
+
+    zmqw::socket& GetSocket() {
+        return socket_;
+    }
+
+    // Sends the parts as a message to the identity, or queues them if its
+    // pipe is full. The parts are left empty.
+    void Send(const std::string& identity, zmq::message_t* parts,
+              size_t count, OutboundClass type) {
+        auto it = queues_.find(identity);
+        if (it == queues_.end()) {
+            SendResult result = TrySend(identity, parts, count);
+            if (result == SendResult::SENT) {
+                sent_[Index(type)]++;
+                return;
+            }
+            if (result == SendResult::UNROUTABLE) {
+                unroutable_++;  // The client is gone
+                return;
+            }
+            it = queues_.emplace(identity, IdentityQueue()).first;
+        }
+
+        IdentityQueue& queue = it->second;
+        QueuedMessage message;
+        for (size_t i = 0; i < count; i++) {
+            message.bytes += parts[i].size();
+            message.parts.push_back(std::move(parts[i]));
+        }
+        Push(queue, type, std::move(message));
+        TrimCalls(queue);
+        if (IsSlow(queue, Clock::now())) Disconnect(it);
+    }
+
+    // Sends the queued messages while the pipes of their identities have
+    // room, it has to be called every kFlushIntervalMs while HasPending
+    void Flush() {
+        Clock::time_point now = Clock::now();
+        for (auto it = queues_.begin(); it != queues_.end();) {
+            IdentityQueue& queue = it->second;
+            SendResult result = SendResult::SENT;
+            for (size_t i = 0; i < kNumOutboundClasses; i++) {
+                std::deque<QueuedMessage>& messages = queue.classes[i];
+                while (!messages.empty()) {
+                    QueuedMessage& message = messages.front();
+                    result = TrySend(it->first, message.parts.data(),
+                                     message.parts.size());
+                    if (result != SendResult::SENT) break;
+                    sent_[i]++;
+                    flushed_++;
+                    Pop(queue, i);
+                }
+                if (result != SendResult::SENT) break;
+            }
+
+            if (result == SendResult::UNROUTABLE) {
+                unroutable_ += queue.messages;
+                Clear(queue, false);
+                it = queues_.erase(it);
+            } else if (queue.messages == 0) {
+                it = queues_.erase(it);
+            } else if (IsSlow(queue, now)) {
+                it = Disconnect(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    bool HasPending() const {
+        return !queues_.empty();
+    }
+
+    // The slow consumers disconnected since the last call
+    std::vector<std::string> TakeDisconnected() {
+        std::vector<std::string> disconnected;
+        disconnected.swap(disconnected_);
+        return disconnected;
+    }
+
+    void WriteJSON(std::ostream& os) const {
+        os << "{\"queued_identities\":" << queues_.size()
+           << ",\"queued_messages\":" << queued_messages_
+           << ",\"queued_bytes\":" << queued_bytes_
+           << ",\"flushed\":" << flushed_
+           << ",\"unroutable\":" << unroutable_
+           << ",\"slow_consumers\":" << slow_consumers_ << ",\"classes\":{";
+        for (size_t i = 0; i < kNumOutboundClasses; i++) {
+            os << (i > 0 ? "," : "") << "\""
+               << OutboundClassName(static_cast<OutboundClass>(i))
+               << "\":{\"sent\":" << sent_[i] << ",\"queued\":" << queued_[i]
+               << ",\"dropped\":" << dropped_[i] << "}";
+        }
+        os << "}}";
+    }
+
+private:
+    enum class SendResult { SENT, FULL, UNROUTABLE };
+
+    struct QueuedMessage {
+        QueuedMessage() : bytes(0) {}
+
+        std::vector<zmq::message_t> parts;
+        size_t bytes;
+    };
+
+    struct IdentityQueue {
+        IdentityQueue() : messages(0), bytes(0) {}
+
+        std::deque<QueuedMessage> classes[kNumOutboundClasses];
+        size_t messages;
+        size_t bytes;
+        Clock::time_point over_since;  // Epoch while under the limits
+    };
+
+    using QueueMap = std::unordered_map<std::string, IdentityQueue>;
+
+    static size_t Index(OutboundClass type) {
+        return static_cast<size_t>(type);
+    }
+
+    // The message is sent whole or not at all, the ROUTER only refuses its
+    // first frame
+    SendResult TrySend(const std::string& identity, zmq::message_t* parts,
+                       size_t count) {
+        try {
+            if (!socket_.send(identity, ZMQ_SNDMORE | ZMQ_DONTWAIT)) {
+                return SendResult::FULL;
+            }
+            for (size_t i = 0; i < count; i++) {
+                int more = i + 1 < count ? ZMQ_SNDMORE : 0;
+                socket_.send(parts[i], more | ZMQ_DONTWAIT);
+            }
+            return SendResult::SENT;
+        } catch (zmq::error_t& e) {
+            if (e.num() != EHOSTUNREACH) throw;
+            return SendResult::UNROUTABLE;
+        }
+    }
+
+    void Push(IdentityQueue& queue, OutboundClass type,
+              QueuedMessage&& message) {
+        queue.messages++;
+        queue.bytes += message.bytes;
+        queued_messages_++;
+        queued_bytes_ += message.bytes;
+        queued_[Index(type)]++;
+        queue.classes[Index(type)].push_back(std::move(message));
+    }
+
+    void Pop(IdentityQueue& queue, size_t index) {
+        QueuedMessage& message = queue.classes[index].front();
+        queue.messages--;
+        queue.bytes -= message.bytes;
+        queued_messages_--;
+        queued_bytes_ -= message.bytes;
+        queue.classes[index].pop_front();
+    }
+
+    // Drops the oldest call audio while there is too much of it or the
+    // queue is over the limits
+    void TrimCalls(IdentityQueue& queue) {
+        size_t index = Index(OutboundClass::CALL);
+        std::deque<QueuedMessage>& calls = queue.classes[index];
+        while (!calls.empty() && (calls.size() > limits_.max_call_messages ||
+                                  IsOver(queue, 1))) {
+            Pop(queue, index);
+            dropped_[index]++;
+        }
+    }
+
+    bool IsOver(const IdentityQueue& queue, size_t factor) const {
+        return queue.messages > factor * limits_.max_messages ||
+               queue.bytes > factor * limits_.max_bytes;
+    }
+
+    // Whether the queue has been over the limits for too long, or is far
+    // over them
+    bool IsSlow(IdentityQueue& queue, Clock::time_point now) {
+        if (!IsOver(queue, 1)) {
+            queue.over_since = Clock::time_point();
+            return false;
+        }
+        if (queue.over_since == Clock::time_point()) queue.over_since = now;
+        return IsOver(queue, 2) ||
+               now - queue.over_since >=
+                   std::chrono::milliseconds(limits_.slow_timeout_ms);
+    }
+
+    // Drops the queued messages, counted as dropped if requested
+    void Clear(IdentityQueue& queue, bool count_dropped) {
+        for (size_t i = 0; i < kNumOutboundClasses; i++) {
+            if (count_dropped) dropped_[i] += queue.classes[i].size();
+            while (!queue.classes[i].empty()) Pop(queue, i);
+        }
+    }
+
+    QueueMap::iterator Disconnect(QueueMap::iterator it) {
+        Clear(it->second, true);
+        slow_consumers_++;
+        disconnected_.push_back(it->first);
+        return queues_.erase(it);
+    }
+
+private:
+    zmqw::socket& socket_;
+    OutboundLimits limits_;
+    QueueMap queues_;  // Only the identities with queued messages
+    std::vector<std::string> disconnected_;
+
+    size_t queued_messages_;
+    size_t queued_bytes_;
+    uint64_t sent_[kNumOutboundClasses];
+    uint64_t queued_[kNumOutboundClasses];
+    uint64_t dropped_[kNumOutboundClasses];
+    uint64_t flushed_;
+    uint64_t unroutable_;
+    uint64_t slow_consumers_;
+};
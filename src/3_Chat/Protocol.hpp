@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Util/Schema.hpp>
+
+#include "ServerCodes.hpp"
+#include "SessionToken.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Chat protocol messages, see SPECIFICATION.md
+// The tag of each message packs its kind in the upper bits and its action in
+// the lower ones, so it is always encoded in a single byte.
+///////////////////////////////////////////////////////////////////////////////
+
+// The SHARD messages are internal to the sharded server, see
+// ShardProtocol.hpp
+enum class MessageKind : uint8_t { REQUEST, RESPONSE, UPDATE, TRACE, SHARD };
+
+enum class Action : uint8_t {
+    REGISTER = 1,
+    LOGIN,
+    LOGOUT,
+    ADD_CONTACT,
+    WHISPER,
+    CREATE_GROUP,
+    JOIN_GROUP,
+    MSG_GROUP,
+    VOICE_MSG,
+    JOIN_CALL,
+    CALL_DATA,
+    LEAVE_GROUP,
+    HISTORY,
+    SEARCH
+};
+
+// Name of the action in SPECIFICATION.md
+inline const char* ActionName(Action action) {
+    static const char* const kNames[] = {
+        "unknown",
+        "register",
+        "login",
+        "logout",
+        "add_contact",
+        "whisper",
+        "create_group",
+        "join_group",
+        "msg_group",
+        "voice_msg",
+        "join_call",
+        "call_data",
+        "leave_group",
+        "history",
+        "search"};
+    size_t index = static_cast<size_t>(action);
+    return index < sizeof(kNames) / sizeof(kNames[0]) ? kNames[index]
+                                                      : kNames[0];
+}
+
+template <MessageKind Kind, Action A>
+struct ChatMessage : Schema<(static_cast<uint8_t>(Kind) << 5) |
+                            static_cast<uint8_t>(A)> {
+    static constexpr Action kAction = A;
+};
+
+template <MessageKind Kind, Action A>
+constexpr Action ChatMessage<Kind, A>::kAction;
+
+// Prefix of the frames of a sampled trace, see Util/Trace.hpp. The server
+// copies the trace id to the response and the updates of the request.
+struct TraceEnvelope
+      : Schema<static_cast<uint8_t>(MessageKind::TRACE) << 5> {
+    TraceEnvelope() = default;
+    TraceEnvelope(uint64_t trace_id, uint64_t timestamp)
+          : trace_id(trace_id), timestamp(timestamp) {}
+
+    uint64_t trace_id = 0;
+    uint64_t timestamp = 0;  // Microseconds since the epoch when it was sent
+    SCHEMA_FIELDS(trace_id, timestamp)
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Responses
+///////////////////////////////////////////////////////////////////////////////
+
+// Response of the requests that only return its code
+template <Action A>
+struct StatusResponse : ChatMessage<MessageKind::RESPONSE, A> {
+    ServerCodes code = ServerCodes::SUCCESS;
+    SCHEMA_FIELDS(code)
+};
+
+struct LoginResponse : ChatMessage<MessageKind::RESPONSE, Action::LOGIN> {
+    ServerCodes code = ServerCodes::SUCCESS;
+    std::string username;
+    SessionToken token;
+    bool compression = false;  // The server accepts compressed frames
+    SCHEMA_FIELDS(code, username, token, compression)
+};
+
+struct JoinCallResponse
+      : ChatMessage<MessageKind::RESPONSE, Action::JOIN_CALL> {
+    ServerCodes code = ServerCodes::SUCCESS;
+    std::string group_name;
+    SCHEMA_FIELDS(code, group_name)
+};
+
+// Message of a conversation, packed as an array of its fields
+struct HistoryMessage {
+    uint64_t sequence = 0;   // Position in the conversation, from 1
+    uint64_t timestamp = 0;  // Milliseconds since the epoch
+    std::string sender;
+    std::string content;
+};
+
+struct HistoryResponse : ChatMessage<MessageKind::RESPONSE, Action::HISTORY> {
+    ServerCodes code = ServerCodes::SUCCESS;
+    bool group = false;
+    std::string name;
+    std::vector<HistoryMessage> messages;  // The oldest first
+    bool more = false;  // There are more messages past the page
+    SCHEMA_FIELDS(code, group, name, messages, more)
+};
+
+struct SearchResponse : ChatMessage<MessageKind::RESPONSE, Action::SEARCH> {
+    ServerCodes code = ServerCodes::SUCCESS;
+    bool group = false;
+    std::string name;
+    std::string query;
+    std::vector<HistoryMessage> messages;  // The oldest first
+    bool more = false;  // There are older messages that match
+    SCHEMA_FIELDS(code, group, name, query, messages, more)
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests, from the client to the server
+// The requests after the login are authenticated with the session token, the
+// server knows the user from it.
+// The audio messages are templates over the type of the samples, the client
+// packs them from a std::vector<int16_t> and the server keeps them encoded
+// as a RawObject to forward them.
+///////////////////////////////////////////////////////////////////////////////
+
+struct RegisterRequest : ChatMessage<MessageKind::REQUEST, Action::REGISTER> {
+    using Response = StatusResponse<Action::REGISTER>;
+    std::string username;
+    std::string password;
+    SCHEMA_FIELDS(username, password)
+};
+
+struct LoginRequest : ChatMessage<MessageKind::REQUEST, Action::LOGIN> {
+    using Response = LoginResponse;
+    std::string username;
+    std::string password;
+    bool compression = false;  // The client accepts compressed frames
+    SCHEMA_FIELDS(username, password, compression)
+};
+
+struct LogoutRequest : ChatMessage<MessageKind::REQUEST, Action::LOGOUT> {
+    using Response = StatusResponse<Action::LOGOUT>;
+    SessionToken token;
+    SCHEMA_FIELDS(token)
+};
+
+struct AddContactRequest
+      : ChatMessage<MessageKind::REQUEST, Action::ADD_CONTACT> {
+    using Response = StatusResponse<Action::ADD_CONTACT>;
+    SessionToken token;
+    std::string contact;
+    SCHEMA_FIELDS(token, contact)
+};
+
+struct WhisperRequest : ChatMessage<MessageKind::REQUEST, Action::WHISPER> {
+    using Response = StatusResponse<Action::WHISPER>;
+    SessionToken token;
+    std::string recipient;
+    std::string content;
+    SCHEMA_FIELDS(token, recipient, content)
+};
+
+struct CreateGroupRequest
+      : ChatMessage<MessageKind::REQUEST, Action::CREATE_GROUP> {
+    using Response = StatusResponse<Action::CREATE_GROUP>;
+    SessionToken token;
+    std::string group_name;
+    SCHEMA_FIELDS(token, group_name)
+};
+
+struct JoinGroupRequest
+      : ChatMessage<MessageKind::REQUEST, Action::JOIN_GROUP> {
+    using Response = StatusResponse<Action::JOIN_GROUP>;
+    SessionToken token;
+    std::string group_name;
+    SCHEMA_FIELDS(token, group_name)
+};
+
+struct LeaveGroupRequest
+      : ChatMessage<MessageKind::REQUEST, Action::LEAVE_GROUP> {
+    using Response = StatusResponse<Action::LEAVE_GROUP>;
+    SessionToken token;
+    std::string group_name;
+    SCHEMA_FIELDS(token, group_name)
+};
+
+struct MessageGroupRequest
+      : ChatMessage<MessageKind::REQUEST, Action::MSG_GROUP> {
+    using Response = StatusResponse<Action::MSG_GROUP>;
+    SessionToken token;
+    std::string group_name;
+    std::string content;
+    SCHEMA_FIELDS(token, group_name, content)
+};
+
+template <typename SampleData>
+struct BasicVoiceMessageRequest
+      : ChatMessage<MessageKind::REQUEST, Action::VOICE_MSG> {
+    using Response = StatusResponse<Action::VOICE_MSG>;
+    SessionToken token;
+    std::string recipient;
+    size_t channels = 1;
+    size_t sample_rate = 44100;
+    SampleData samples;
+    SCHEMA_FIELDS(token, recipient, channels, sample_rate, samples)
+};
+
+struct JoinCallRequest : ChatMessage<MessageKind::REQUEST, Action::JOIN_CALL> {
+    using Response = JoinCallResponse;
+    SessionToken token;
+    std::string group_name;
+    SCHEMA_FIELDS(token, group_name)
+};
+
+// Page of the conversation with a user or of a group, the messages before
+// or after the cursor. The cursor is a sequence, or a timestamp if by_time,
+// and 0 before is the end of the conversation.
+struct HistoryRequest : ChatMessage<MessageKind::REQUEST, Action::HISTORY> {
+    using Response = HistoryResponse;
+    SessionToken token;
+    bool group = false;  // The name is a group, otherwise a user
+    std::string name;
+    uint64_t cursor = 0;
+    bool by_time = false;
+    bool before = true;
+    uint32_t limit = 50;
+    SCHEMA_FIELDS(token, group, name, cursor, by_time, before, limit)
+};
+
+// The last messages of the conversation with a user or of a group that
+// have all the words of the query, before the cursor sequence (0 is the
+// end). A word that ends with '*' matches the words that start with it.
+struct SearchRequest : ChatMessage<MessageKind::REQUEST, Action::SEARCH> {
+    using Response = SearchResponse;
+    SessionToken token;
+    bool group = false;  // The name is a group, otherwise a user
+    std::string name;
+    std::string query;
+    uint64_t cursor = 0;
+    uint32_t limit = 20;
+    SCHEMA_FIELDS(token, group, name, query, cursor, limit)
+};
+
+// Audio of the user in a call, it has no response
+template <typename SampleData>
+struct BasicSendCallDataUpdate
+      : ChatMessage<MessageKind::UPDATE, Action::CALL_DATA> {
+    SessionToken token;
+    std::string group_name;
+    SampleData samples;
+    SCHEMA_FIELDS(token, group_name, samples)
+};
+
+using VoiceMessageRequest = BasicVoiceMessageRequest<std::vector<int16_t>>;
+using SendCallDataUpdate = BasicSendCallDataUpdate<std::vector<int16_t>>;
+
+///////////////////////////////////////////////////////////////////////////////
+// Updates, from the server to the client
+///////////////////////////////////////////////////////////////////////////////
+
+struct WhisperUpdate : ChatMessage<MessageKind::UPDATE, Action::WHISPER> {
+    std::string sender;
+    std::string content;
+    SCHEMA_FIELDS(sender, content)
+};
+
+struct MessageGroupUpdate
+      : ChatMessage<MessageKind::UPDATE, Action::MSG_GROUP> {
+    std::string group_name;
+    std::string sender;
+    std::string content;
+    SCHEMA_FIELDS(group_name, sender, content)
+};
+
+template <typename SampleData>
+struct BasicVoiceMessageUpdate
+      : ChatMessage<MessageKind::UPDATE, Action::VOICE_MSG> {
+    std::string sender;
+    size_t channels = 1;
+    size_t sample_rate = 44100;
+    SampleData samples;
+    SCHEMA_FIELDS(sender, channels, sample_rate, samples)
+};
+
+template <typename SampleData>
+struct BasicCallDataUpdate
+      : ChatMessage<MessageKind::UPDATE, Action::CALL_DATA> {
+    std::string sender;
+    SampleData samples;
+    SCHEMA_FIELDS(sender, samples)
+};
+
+using VoiceMessageUpdate = BasicVoiceMessageUpdate<std::vector<int16_t>>;
+using CallDataUpdate = BasicCallDataUpdate<std::vector<int16_t>>;
+
+// Versions of the audio messages that keep the samples encoded, used by the
+// server to forward them without unpacking
+using RawVoiceMessageRequest = BasicVoiceMessageRequest<RawObject>;
+using RawSendCallDataUpdate = BasicSendCallDataUpdate<RawObject>;
+using RawVoiceMessageUpdate = BasicVoiceMessageUpdate<RawObject>;
+using RawCallDataUpdate = BasicCallDataUpdate<RawObject>;
+
+// User defined class template specialization
+namespace msgpack {
+inline namespace v2 {
+namespace adaptor {
+
+template <>
+struct convert<HistoryMessage> {
+    const msgpack::object& operator()(const msgpack::object& o,
+                                      HistoryMessage& v) const {
+        if (o.type != msgpack::type::ARRAY || o.via.array.size != 4)
+            throw msgpack::type_error();
+        v.sequence = o.via.array.ptr[0].as<uint64_t>();
+        v.timestamp = o.via.array.ptr[1].as<uint64_t>();
+        v.sender = o.via.array.ptr[2].as<std::string>();
+        v.content = o.via.array.ptr[3].as<std::string>();
+        return o;
+    }
+};
+
+template <>
+struct pack<HistoryMessage> {
+    template <typename Stream>
+    packer<Stream>& operator()(msgpack::packer<Stream>& o,
+                               const HistoryMessage& v) const {
+        o.pack_array(4);
+        o.pack(v.sequence);
+        o.pack(v.timestamp);
+        o.pack(v.sender);
+        o.pack(v.content);
+        return o;
+    }
+};
+
+}  // namespace adaptor
+}  // namespace v2
+}  // namespace msgpack
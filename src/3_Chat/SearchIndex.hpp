@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Util/FileSystem.hpp>
+#include <Util/Log.hpp>
+#include <Util/MappedFile.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/Views.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Search index
+// Inverted index of the messages of a conversation. Each term has a posting
+// list with the sequences of the messages where it appears, stored as the
+// varint of the difference with the previous sequence, so most take a
+// single byte and a new message only appends to the lists of its terms.
+// The terms are sorted, the terms with a prefix are a range of them.
+//
+// The terms are the runs of letters and digits lowercased, the bytes over
+// 0x7F are part of the terms so the UTF-8 words are kept whole.
+//
+// The index is saved in a file of the directory of the history:
+//     "chat-terms" | version | count | terms | (term | last | postings)...
+// The messages after the count are indexed again from the history.
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint32_t kTermsVersion = 1;
+
+class TermIndex {
+public:
+    // Longer terms are cut
+    static const size_t kMaxTermSize = 32;
+
+public:
+    TermIndex() : count_(0), unsaved_(0) {}
+
+    // The terms of the text in order, they may repeat
+    static void Tokenize(const std::string& text,
+                         std::vector<std::string>& terms) {
+        terms.clear();
+        std::string term;
+        for (char c : text) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (std::isalnum(byte) || byte > 0x7F) {
+                if (term.size() < kMaxTermSize) {
+                    term += static_cast<char>(std::tolower(byte));
+                }
+            } else if (!term.empty()) {
+                terms.push_back(std::move(term));
+                term.clear();
+            }
+        }
+        if (!term.empty()) terms.push_back(std::move(term));
+    }
+
+    // Messages indexed, the sequence of the last one
+    uint64_t Count() const {
+        return count_;
+    }
+
+    // Messages indexed since the index was saved or loaded
+    uint64_t Unsaved() const {
+        return unsaved_;
+    }
+
+    size_t NumTerms() const {
+        return terms_.size();
+    }
+
+    // The messages must be added in the order of their sequences
+    void Add(uint64_t sequence, const std::string& content) {
+        Tokenize(content, scratch_);
+        for (const std::string& term : scratch_) {
+            PostingList& list = terms_[term];
+            if (list.last == sequence) continue;  // Repeated in the message
+            AppendVarint(list.postings, sequence - list.last);
+            list.last = sequence;
+        }
+        count_ = sequence;
+        unsaved_++;
+    }
+
+    // Sequences of the last limit messages before the cursor, 0 is the end,
+    // that have all the words of the query. A word that ends with '*' is a
+    // prefix. more is set if there are others before them.
+    void Search(const std::string& query, uint64_t cursor, size_t limit,
+                std::vector<uint64_t>& sequences, bool& more) const {
+        sequences.clear();
+        more = false;
+
+        std::vector<uint64_t> matches, other, common;
+        std::vector<std::string> terms;
+        bool first = true;
+        std::istringstream words(query);
+        std::string word;
+        while (words >> word) {
+            bool prefix = word.back() == '*';
+            Tokenize(word, terms);
+            for (size_t i = 0; i < terms.size(); i++) {
+                // The prefix is only the last term of the word
+                std::vector<uint64_t>& list = first ? matches : other;
+                Find(terms[i], prefix && i + 1 == terms.size(), list);
+                if (!first) {
+                    // The output can't overlap the inputs
+                    common.clear();
+                    std::set_intersection(matches.begin(), matches.end(),
+                                          other.begin(), other.end(),
+                                          std::back_inserter(common));
+                    matches.swap(common);
+                }
+                first = false;
+                if (matches.empty()) return;
+            }
+        }
+
+        auto end = cursor == 0 ? matches.end()
+                               : std::lower_bound(matches.begin(),
+                                                  matches.end(), cursor);
+        size_t found = static_cast<size_t>(end - matches.begin());
+        size_t skipped = found > limit ? found - limit : 0;
+        sequences.assign(matches.begin() + skipped, end);
+        more = skipped > 0;
+    }
+
+    void Clear() {
+        terms_.clear();
+        count_ = 0;
+        unsaved_ = 0;
+    }
+
+    bool Save(const std::string& directory, const std::string& name) {
+        Serializer output;
+        output << std::string("chat-terms") << kTermsVersion << count_
+               << static_cast<uint64_t>(terms_.size());
+        for (const auto& pair : terms_) {
+            const std::string& postings = pair.second.postings;
+            output << pair.first << pair.second.last
+                   << BinView(postings.data(), postings.size());
+        }
+        if (!fs::WriteFileAtomically(directory, name, output.data(),
+                                     output.size())) {
+            LOG_ERROR("Can't save the search index " << name);
+            return false;
+        }
+        unsaved_ = 0;
+        return true;
+    }
+
+    // The index is empty if the file doesn't exist, it returns false and is
+    // left empty if the file is not valid
+    bool Load(const std::string& path) {
+        Clear();
+        if (!fs::FileExists(path)) return true;
+
+        MappedFile file;
+        if (!file.Open(path)) {
+            LOG_ERROR("Can't open the search index " << path);
+            return false;
+        }
+        if (file.Size() == 0) return true;
+
+        try {
+            // The Deserializer reads the mapped pages, the postings are
+            // copied to the index
+            zmq::message_t view(const_cast<char*>(file.Data()), file.Size(),
+                                nullptr, nullptr);
+            Deserializer input(std::move(view));
+            std::string magic;
+            uint32_t version = 0;
+            uint64_t count = 0;
+            uint64_t num_terms = 0;
+            input >> magic >> version >> count >> num_terms;
+            if (magic == "chat-terms" && version == kTermsVersion) {
+                std::string term;
+                BinView postings;
+                for (uint64_t i = 0; i < num_terms; i++) {
+                    PostingList list;
+                    input >> term >> list.last >> postings;
+                    list.postings.assign(postings.data(), postings.size());
+                    terms_.emplace_hint(terms_.end(), std::move(term),
+                                        std::move(list));
+                }
+                count_ = count;
+                return true;
+            }
+        } catch (std::exception& e) {
+            LOG_ERROR("Error loading the search index: " << e.what());
+        }
+        LOG_ERROR("The search index " << path << " is not valid");
+        Clear();
+        return false;
+    }
+
+private:
+    struct PostingList {
+        PostingList() : last(0) {}
+
+        std::string postings;  // Varints of the differences
+        uint64_t last;         // The last sequence
+    };
+
+    static void AppendVarint(std::string& output, uint64_t value) {
+        while (value >= 0x80) {
+            output += static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        output += static_cast<char>(value);
+    }
+
+    static void Decode(const PostingList& list,
+                       std::vector<uint64_t>& sequences) {
+        uint64_t sequence = 0;
+        uint64_t value = 0;
+        unsigned shift = 0;
+        for (char c : list.postings) {
+            uint8_t byte = static_cast<uint8_t>(c);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if (byte < 0x80) {
+                sequence += value;
+                sequences.push_back(sequence);
+                value = 0;
+                shift = 0;
+            }
+        }
+    }
+
+    // Sorted sequences of the messages with the term, or with a term that
+    // starts with it
+    void Find(const std::string& term, bool prefix,
+              std::vector<uint64_t>& sequences) const {
+        sequences.clear();
+        if (!prefix) {
+            auto it = terms_.find(term);
+            if (it != terms_.end()) Decode(it->second, sequences);
+            return;
+        }
+
+        size_t lists = 0;
+        for (auto it = terms_.lower_bound(term);
+             it != terms_.end() &&
+             it->first.compare(0, term.size(), term) == 0;
+             ++it) {
+            Decode(it->second, sequences);
+            lists++;
+        }
+        if (lists > 1) {
+            std::sort(sequences.begin(), sequences.end());
+            sequences.erase(std::unique(sequences.begin(), sequences.end()),
+                            sequences.end());
+        }
+    }
+
+private:
+    std::map<std::string, PostingList> terms_;
+    uint64_t count_;
+    uint64_t unsaved_;
+    std::vector<std::string> scratch_;
+};
@@ -44,6 +44,6 @@ static std::map<ServerCodes, std::string> ServerCodesString{
     {ServerCodes::GROUP_MEMBER_ALREADY_EXIST, "GROUP_MEMBER_ALREADY_EXIST"},
     {ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST, "GROUP_MEMBER_DOES_NOT_EXIST"}};
 
-std::ostream& operator<<(std::ostream& o, ServerCodes code) {
+inline std::ostream& operator<<(std::ostream& o, ServerCodes code) {
     return o << ServerCodesString[code];
 }
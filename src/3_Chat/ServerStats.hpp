@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+
+#include <Util/Histogram.hpp>
+
+#include "Protocol.hpp"
+#include "ServerCodes.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Server statistics
+// Counters and histograms of the requests handled by the dispatch thread.
+// They are only touched from that thread so there is no synchronization, a
+// request costs two clock reads and two histogram records (~50ns).
+///////////////////////////////////////////////////////////////////////////////
+
+class ServerStats {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct ActionStats {
+        uint64_t requests = 0;
+        std::map<ServerCodes, uint64_t> failures;  // Requests by error code
+        Histogram latency;  // ns from the reception to the response sent
+        Histogram fanout;   // Updates sent by each request
+    };
+
+public:
+    ServerStats()
+          : start_(Clock::now()),
+            unknown_(0),
+            invalid_(0),
+            updates_(0),
+            fanout_(0) {}
+
+    // Counts an update sent by the request being handled
+    void CountUpdate() {
+        fanout_++;
+        updates_++;
+    }
+
+    // Records a request handled since start, with the updates it sent
+    void RecordRequest(Action action, ServerCodes code,
+                       Clock::time_point start) {
+        uint64_t latency = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start)
+                .count());
+
+        ActionStats& stats = GetAction(action);
+        stats.requests++;
+        if (code != ServerCodes::SUCCESS) stats.failures[code]++;
+        stats.latency.Record(latency);
+        stats.fanout.Record(fanout_);
+        fanout_ = 0;
+    }
+
+    // Messages with a tag that is not a request
+    void RecordUnknown() {
+        unknown_++;
+        fanout_ = 0;
+    }
+
+    // Messages that couldn't be unpacked
+    void RecordInvalid() {
+        invalid_++;
+        fanout_ = 0;
+    }
+
+    // Messages that were waiting in the socket when the server woke up
+    void RecordQueueDepth(size_t depth) {
+        queue_depth_.Record(depth);
+    }
+
+    void WriteJSON(std::ostream& os) const {
+        os << "{\"uptime_s\":"
+           << std::chrono::duration_cast<std::chrono::seconds>(Clock::now() -
+                                                               start_)
+                  .count()
+           << ",\"unknown\":" << unknown_ << ",\"invalid\":" << invalid_
+           << ",\"updates\":" << updates_ << ",\"queue_depth\":";
+        WriteHistogram(os, queue_depth_);
+
+        os << ",\"actions\":{";
+        bool first = true;
+        for (size_t i = 0; i < kNumActions; i++) {
+            if (!actions_[i]) continue;
+            const ActionStats& stats = *actions_[i];
+            if (!first) os << ",";
+            first = false;
+
+            os << "\"" << ActionName(static_cast<Action>(i))
+               << "\":{\"requests\":" << stats.requests << ",\"failures\":{";
+            bool first_code = true;
+            for (auto& failure : stats.failures) {
+                if (!first_code) os << ",";
+                first_code = false;
+                os << "\"" << failure.first << "\":" << failure.second;
+            }
+            os << "},\"latency_ns\":";
+            WriteHistogram(os, stats.latency);
+            os << ",\"fanout\":";
+            WriteHistogram(os, stats.fanout);
+            os << "}";
+        }
+        os << "}}";
+    }
+
+private:
+    static const size_t kNumActions = 32;  // The action uses 5 bits of the tag
+
+    ActionStats& GetAction(Action action) {
+        std::unique_ptr<ActionStats>& stats =
+            actions_[static_cast<size_t>(action) % kNumActions];
+        if (!stats) stats.reset(new ActionStats);
+        return *stats;
+    }
+
+    static void WriteHistogram(std::ostream& os, const Histogram& histogram) {
+        os << "{\"count\":" << histogram.Count()
+           << ",\"mean\":" << histogram.Mean()
+           << ",\"p50\":" << histogram.Percentile(50)
+           << ",\"p99\":" << histogram.Percentile(99)
+           << ",\"p999\":" << histogram.Percentile(99.9)
+           << ",\"max\":" << histogram.Max() << "}";
+    }
+
+private:
+    Clock::time_point start_;
+    uint64_t unknown_;
+    uint64_t invalid_;
+    uint64_t updates_;
+    uint64_t fanout_;  // Updates sent by the current request
+    Histogram queue_depth_;
+    std::unique_ptr<ActionStats> actions_[kNumActions];
+};
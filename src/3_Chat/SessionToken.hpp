@@ -0,0 +1,143 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <Util/MsgPackAdaptors.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Session token
+// 128 random bits given to the user at login, the other requests are
+// authenticated with it instead of the username. It is sent as a bin of 16
+// bytes and the server finds the session with a single hash probe.
+//
+// The bits come from the random generator of the kernel, a token can't be
+// guessed from the ones seen before.
+///////////////////////////////////////////////////////////////////////////////
+
+struct SessionToken {
+    static const size_t kSize = 16;
+
+    // The empty token, no session has it
+    SessionToken() {
+        std::memset(bytes, 0, kSize);
+    }
+
+    // A random token, never the empty one
+    static SessionToken Generate() {
+        SessionToken token;
+        do {
+            ReadRandom(token.bytes, kSize);
+        } while (token.Empty());
+        return token;
+    }
+
+    bool Empty() const {
+        return *this == SessionToken();
+    }
+
+    // Hexadecimal representation, to show it to the user
+    std::string ToString() const {
+        static const char hexdigits[] = "0123456789abcdef";
+        std::string output;
+        output.reserve(2 * kSize);
+        for (size_t i = 0; i < kSize; i++) {
+            output.push_back(hexdigits[bytes[i] >> 4]);
+            output.push_back(hexdigits[bytes[i] & 0x0f]);
+        }
+        return output;
+    }
+
+    friend bool operator==(const SessionToken& a, const SessionToken& b) {
+        return std::memcmp(a.bytes, b.bytes, kSize) == 0;
+    }
+
+    friend bool operator!=(const SessionToken& a, const SessionToken& b) {
+        return !(a == b);
+    }
+
+    uint8_t bytes[kSize];
+
+private:
+    // Fills the buffer from getrandom, or /dev/urandom where it is missing
+    static void ReadRandom(uint8_t* buffer, size_t size) {
+#ifdef SYS_getrandom
+        size_t done = 0;
+        while (done < size) {
+            long result = ::syscall(SYS_getrandom, buffer + done, size - done,
+                                    0);
+            if (result > 0) {
+                done += static_cast<size_t>(result);
+            } else if (result < 0 && errno == ENOSYS) {
+                break;
+            } else if (result < 0 && errno != EINTR) {
+                throw std::runtime_error("getrandom failed");
+            }
+        }
+        if (done == size) return;
+#endif
+        int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Can't open /dev/urandom");
+        size_t read_size = 0;
+        while (read_size < size) {
+            ssize_t result = ::read(fd, buffer + read_size, size - read_size);
+            if (result > 0) {
+                read_size += static_cast<size_t>(result);
+            } else if (result == 0 || errno != EINTR) {
+                ::close(fd);
+                throw std::runtime_error("Can't read /dev/urandom");
+            }
+        }
+        ::close(fd);
+    }
+};
+
+// The tokens are random, so their last 8 bytes are already a good hash
+struct SessionTokenHash {
+    size_t operator()(const SessionToken& token) const {
+        uint64_t value;
+        std::memcpy(&value, token.bytes + SessionToken::kSize - 8, 8);
+        return static_cast<size_t>(value);
+    }
+};
+
+// User defined class template specialization
+namespace msgpack {
+inline namespace v2 {
+namespace adaptor {
+
+template <>
+struct convert<SessionToken> {
+    const msgpack::object& operator()(const msgpack::object& o,
+                                      SessionToken& v) const {
+        if (o.type != msgpack::type::BIN ||
+            o.via.bin.size != SessionToken::kSize)
+            throw msgpack::type_error();
+        std::memcpy(v.bytes, o.via.bin.ptr, SessionToken::kSize);
+        return o;
+    }
+};
+
+template <>
+struct pack<SessionToken> {
+    template <typename Stream>
+    packer<Stream>& operator()(msgpack::packer<Stream>& o,
+                               const SessionToken& v) const {
+        o.pack_bin(SessionToken::kSize);
+        o.pack_bin_body(reinterpret_cast<const char*>(v.bytes),
+                        SessionToken::kSize);
+        return o;
+    }
+};
+
+}  // namespace adaptor
+}  // namespace v2
+}  // namespace msgpack
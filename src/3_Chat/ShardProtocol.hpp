@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Util/Schema.hpp>
+
+#include "Protocol.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Messages between the shards of the sharded server, see ShardedServer.hpp
+// They travel over inproc sockets as two frames, the identity of the client
+// that made the request (empty if there is none) and the message. The message
+// may be prefixed by the trace envelope of the request. The messages of the
+// shards to the clients have a frame with their OutboundClass after the
+// identity, and may have several parts.
+//
+// The forwarded requests have the action of the client request, they carry
+// the name of the user that sent it because it was already authenticated by
+// its shard.
+///////////////////////////////////////////////////////////////////////////////
+
+// Actions of the messages that only exist between the shards, far from the
+// ones of the protocol
+enum class ShardAction : uint8_t {
+    MEMBERSHIP = 24,
+    MEMBER_ONLINE,
+    STATS,
+    STOP,
+    DISCONNECT
+};
+
+template <Action A>
+using ForwardedMessage = ChatMessage<MessageKind::SHARD, A>;
+
+template <ShardAction A>
+using ShardMessage =
+    ChatMessage<MessageKind::SHARD, static_cast<Action>(A)>;
+
+///////////////////////////////////////////////////////////////////////////////
+// Forwarded requests, from the shard of the user to the shard of the
+// recipient, the contact or the group. That shard replies to the client.
+///////////////////////////////////////////////////////////////////////////////
+
+// The shard of the contact checks that it exists and sends it back to the
+// shard of the user, which stores the contact and replies
+struct ForwardedAddContact : ForwardedMessage<Action::ADD_CONTACT> {
+    using Response = StatusResponse<Action::ADD_CONTACT>;
+    std::string sender;
+    std::string contact;
+    bool checked = false;  // Set by the shard of the contact
+    bool exists = false;
+    SCHEMA_FIELDS(sender, contact, checked, exists)
+};
+
+struct ForwardedWhisper : ForwardedMessage<Action::WHISPER> {
+    using Response = StatusResponse<Action::WHISPER>;
+    std::string sender;
+    std::string recipient;
+    std::string content;
+    SCHEMA_FIELDS(sender, recipient, content)
+};
+
+struct ForwardedVoiceMessage : ForwardedMessage<Action::VOICE_MSG> {
+    using Response = StatusResponse<Action::VOICE_MSG>;
+    std::string sender;
+    std::string recipient;
+    size_t channels = 1;
+    size_t sample_rate = 44100;
+    RawObject samples;
+    SCHEMA_FIELDS(sender, recipient, channels, sample_rate, samples)
+};
+
+// The identities of the sender are online in the group from the start. The
+// shard of the group answers to the join and leave requests with Membership.
+template <Action A>
+struct BasicForwardedJoin : ForwardedMessage<A> {
+    using Response = StatusResponse<A>;
+    std::string sender;
+    std::string group_name;
+    std::vector<std::string> identities;
+    std::vector<bool> compressed;
+    SCHEMA_FIELDS(sender, group_name, identities, compressed)
+};
+
+using ForwardedCreateGroup = BasicForwardedJoin<Action::CREATE_GROUP>;
+using ForwardedJoinGroup = BasicForwardedJoin<Action::JOIN_GROUP>;
+
+template <Action A, typename R>
+struct BasicForwardedGroupRequest : ForwardedMessage<A> {
+    using Response = R;
+    std::string sender;
+    std::string group_name;
+    SCHEMA_FIELDS(sender, group_name)
+};
+
+using ForwardedLeaveGroup =
+    BasicForwardedGroupRequest<Action::LEAVE_GROUP,
+                               StatusResponse<Action::LEAVE_GROUP>>;
+using ForwardedJoinCall =
+    BasicForwardedGroupRequest<Action::JOIN_CALL, JoinCallResponse>;
+
+struct ForwardedMessageGroup : ForwardedMessage<Action::MSG_GROUP> {
+    using Response = StatusResponse<Action::MSG_GROUP>;
+    std::string sender;
+    std::string group_name;
+    std::string content;
+    SCHEMA_FIELDS(sender, group_name, content)
+};
+
+// Audio of the user in a call, it has no response
+struct ForwardedCallData : ForwardedMessage<Action::CALL_DATA> {
+    std::string sender;
+    std::string group_name;
+    RawObject samples;
+    SCHEMA_FIELDS(sender, group_name, samples)
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Shard messages
+///////////////////////////////////////////////////////////////////////////////
+
+// Whether the user is member of a group of other shard after a request that
+// may change it, sent to the shard of the user so it knows which groups to
+// notify when it connects
+struct Membership : ShardMessage<ShardAction::MEMBERSHIP> {
+    std::string username;
+    std::string group_name;
+    bool joined = false;
+    SCHEMA_FIELDS(username, group_name, joined)
+};
+
+// Connected identities of a member, sent to the shard of the group when they
+// change. It replaces the previous ones, an empty list means offline.
+struct MemberOnline : ShardMessage<ShardAction::MEMBER_ONLINE> {
+    std::string username;
+    std::string group_name;
+    std::vector<std::string> identities;
+    std::vector<bool> compressed;
+    SCHEMA_FIELDS(username, group_name, identities, compressed)
+};
+
+// The shard replies with the JSON of its statistics to the front-end
+struct ShardStatsRequest : ShardMessage<ShardAction::STATS> {
+    SCHEMA_FIELDS()
+};
+
+// The shard stops after handling the messages received before it
+struct ShardStop : ShardMessage<ShardAction::STOP> {
+    SCHEMA_FIELDS()
+};
+
+// The front-end disconnected a slow consumer, every shard logs it out if it
+// is logged in there
+struct ShardDisconnect : ShardMessage<ShardAction::DISCONNECT> {
+    std::string identity;
+    SCHEMA_FIELDS(identity)
+};
@@ -0,0 +1,974 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <Util/AllocationTracker.hpp>
+#include <Util/FileSystem.hpp>
+#include <Util/Log.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/Trace.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+#include "ChatServer.hpp"
+#include "DurableStore.hpp"
+#include "OfflineInbox.hpp"
+#include "Protocol.hpp"
+#include "ShardProtocol.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sharded chat server
+// The front-end thread owns the client socket and routes each request to one
+// of N shard threads, each one with its own ServerState and DataBase:
+// - The users belong to the shard of the hash of their name, the register
+//   and login requests are routed by the username. The session tokens are
+//   generated so their hash is the shard of the user, the other requests are
+//   routed by the token.
+// - The groups belong to the shard of the hash of their name. The shard of
+//   the user authenticates the group requests and forwards them to the shard
+//   of the group, which keeps the members and their online identities.
+// - The whispers, voice messages and contacts are forwarded to the shard of
+//   the recipient.
+//
+// The shards talk over inproc PUSH/PULL sockets (see ShardProtocol.hpp). The
+// shard that handles a request sends the response and the updates to the
+// front-end, which sends them to the clients through its outbound queues
+// (see OutboundQueues.hpp). The slow consumers it disconnects are logged out
+// by every shard.
+//
+// The client requests reach each shard through a socket of their own, apart
+// from the messages between the threads, and the front-end drops the frames
+// that are not client messages. So a client can't send a shard message and
+// skip the authentication of the shard of the user.
+//
+// Every message between two threads goes through a single FIFO pipe, so the
+// requests of a user are handled in order by its shard and the messages of
+// a user to the same recipient or group arrive in order. The responses of
+// requests handled by different shards may arrive out of order.
+//
+// With a data directory each shard logs its own database and inbox in a
+// subdirectory of the number of shards, since the placement of the users and
+// groups depends on it. The server doesn't start if the directory has the
+// data of another number of shards. The shard of a group keeps the group
+// messages for its offline members, and sends them when the shard of the
+// member tells it is online.
+///////////////////////////////////////////////////////////////////////////////
+
+// Shard that owns the user or the group with the name. The hash is FNV-1a
+// and not std::hash, the stored data of a shard depends on it so it must be
+// the same in every build.
+inline size_t ShardOf(const std::string& name, size_t num_shards) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : name) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash % num_shards);
+}
+
+// Name of the data of another number of shards in the data directory, or
+// empty if there is none. Its users and groups would be looked for in other
+// shards, so the server must not start with it. The single threaded server
+// is 1 shard and keeps its data at the top of the directory.
+inline std::string FindOtherShardsData(const std::string& directory,
+                                       size_t num_shards) {
+    std::string own = "shards-" + std::to_string(num_shards);
+    for (const std::string& name : fs::ListFiles(directory, "")) {
+        bool sharded = name.compare(0, 7, "shards-") == 0;
+        bool single = name.compare(0, 8, "snapshot") == 0 ||
+                      name.compare(0, 4, "wal-") == 0 || name == "inbox";
+        if ((sharded && name != own) || (single && num_shards != 1)) {
+            return name;
+        }
+    }
+    return "";
+}
+
+// Shard of the user of the session
+inline size_t ShardOf(const SessionToken& token, size_t num_shards) {
+    return SessionTokenHash()(token) % num_shards;
+}
+
+// Whether the tag is of a message the clients may send, the requests and
+// the call data
+inline bool IsClientTag(uint8_t tag) {
+    MessageKind kind = static_cast<MessageKind>(tag >> 5);
+    return kind == MessageKind::REQUEST || kind == MessageKind::UPDATE;
+}
+
+// Bytes of a compressed request decompressed to read its routing key, the
+// trace envelope, the tag and the session token
+static const size_t kRoutingPrefix = 64;
+
+// Shard of a request from a client, the frames that can't be unpacked go to
+// the first one which rejects them. Returns false if the frame is not a
+// client message, it must be dropped.
+inline bool RouteRequest(zmq::message_t& frame, size_t num_shards,
+                         size_t& shard) {
+    shard = 0;
+    try {
+        // The copy shares the payload, only the routing key is unpacked. Of
+        // a compressed frame only the start is decompressed, the register
+        // and login requests are never compressed.
+        const char* data = static_cast<const char*>(frame.data());
+        std::vector<char> prefix;
+        if (lz::IsCompressed(data, frame.size())) {
+            lz::DecompressPrefix(data, frame.size(), kRoutingPrefix, prefix);
+        }
+        Deserializer input = prefix.empty()
+                                 ? Deserializer(OutgoingUpdate::Share(frame))
+                                 : Deserializer(prefix.data(), prefix.size());
+        TraceEnvelope envelope;
+        UnpackIf(input, envelope);
+
+        uint8_t tag = 0;
+        input >> tag;
+        if (!IsClientTag(tag)) return false;
+        if (tag == RegisterRequest::kTag || tag == LoginRequest::kTag) {
+            std::string username;
+            input >> username;
+            shard = ShardOf(username, num_shards);
+            return true;
+        }
+        SessionToken token;
+        input >> token;
+        shard = ShardOf(token, num_shards);
+    } catch (std::exception&) {
+    }
+    return true;
+}
+
+// The inproc queues between the threads are unbounded, with a limit two
+// threads that send to each other could block forever. The pending messages
+// are dropped when the server is destroyed.
+inline void ConfigureInternalSocket(zmqw::socket& socket) {
+    const int unlimited = 0;
+    socket.setsockopt(ZMQ_SNDHWM, unlimited);
+    socket.setsockopt(ZMQ_RCVHWM, unlimited);
+    socket.setsockopt(ZMQ_LINGER, 0);
+}
+
+class ChatShard {
+public:
+    ChatShard(zmq::context_t& context, const std::string& prefix,
+              size_t index, size_t num_shards)
+          : requests_(context, ZMQ_PULL),
+            inbox_(context, ZMQ_PULL),
+            outbound_(context, ZMQ_PUSH),
+            state_(outbound_, database_),
+            index_(index),
+            num_shards_(num_shards),
+            prefix_(prefix),
+            running_(false) {
+        ConfigureInternalSocket(requests_);
+        ConfigureInternalSocket(inbox_);
+        ConfigureInternalSocket(outbound_);
+        requests_.bind(RequestsEndpoint(prefix, index));
+        inbox_.bind(Endpoint(prefix, index));
+        state_.SetShard(index, num_shards);
+        state_.SetSendClasses(true);
+    }
+
+    ChatShard(const ChatShard&) = delete;
+    ChatShard& operator=(const ChatShard&) = delete;
+
+    static std::string Endpoint(const std::string& prefix, size_t index) {
+        return prefix + "-" + std::to_string(index);
+    }
+
+    // The client requests routed by the front-end, apart from the messages
+    // between the threads so a client can't send them
+    static std::string RequestsEndpoint(const std::string& prefix,
+                                        size_t index) {
+        return prefix + "-requests-" + std::to_string(index);
+    }
+
+    static std::string OutboundEndpoint(const std::string& prefix) {
+        return prefix + "-outbound";
+    }
+
+    ServerState& GetState() {
+        return state_;
+    }
+
+    // Makes the database of the shard durable in the directory and keeps
+    // the messages for the offline users, it must be called before Start
+    bool Open(zmq::context_t& context, const std::string& directory,
+              uint64_t snapshot_interval, const InboxLimits& limits) {
+        store_.reset(new DurableStore(context, directory, snapshot_interval));
+        if (!store_->Open(database_)) return false;
+        state_.SetStore(store_.get());
+
+        offline_.reset(new OfflineInbox(
+            database_, fs::JoinPath(directory, "inbox"), limits));
+        if (!offline_->Open()) return false;
+        state_.SetInbox(offline_.get());
+        return true;
+    }
+
+    // Keeps the conversations of the shard in the HistoryStore of the
+    // endpoint, it must be called before Start
+    void SetHistory(zmq::context_t& context, const std::string& endpoint) {
+        history_.reset(new HistoryWriter(context, endpoint));
+        state_.SetHistory(history_.get());
+    }
+
+    // Connects to the front-end and to the other shards, all of them must be
+    // bound already
+    void Connect(zmq::context_t& context) {
+        outbound_.connect(OutboundEndpoint(prefix_));
+        for (size_t i = 0; i < num_shards_; i++) {
+            peers_.emplace_back(new zmqw::socket(context, ZMQ_PUSH));
+            ConfigureInternalSocket(*peers_.back());
+            peers_.back()->connect(Endpoint(prefix_, i));
+        }
+    }
+
+    void Start() {
+        running_ = true;
+        thread_ = std::thread(&ChatShard::Run, this);
+    }
+
+    // Waits until the shard handles a ShardStop
+    void Join() {
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void Stop() {
+        running_ = false;
+    }
+
+    bool IsLocal(const std::string& name) const {
+        return ShardOf(name, num_shards_) == index_;
+    }
+
+    // The client requests that touch a user or a group of other shard are
+    // authenticated here and forwarded to it, the others are handled here
+    template <typename Request>
+    bool Forward(const NetIdentity& /*identity*/, uint64_t /*trace_id*/,
+                 const Request& /*request*/) {
+        return false;
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const AddContactRequest& request) {
+        UserId user = ForwardedUser(request.token, request.contact);
+        if (user == kInvalidId) return false;
+        ForwardedAddContact message;
+        message.sender = state_.GetUsername(user);
+        message.contact = request.contact;
+        Send(request.contact, identity, trace_id, message);
+        return true;
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const WhisperRequest& request) {
+        UserId user = ForwardedUser(request.token, request.recipient);
+        if (user == kInvalidId) return false;
+        ForwardedWhisper message;
+        message.sender = state_.GetUsername(user);
+        message.recipient = request.recipient;
+        message.content = request.content;
+        Send(request.recipient, identity, trace_id, message);
+        return true;
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const RawVoiceMessageRequest& request) {
+        UserId user = ForwardedUser(request.token, request.recipient);
+        if (user == kInvalidId) return false;
+        ForwardedVoiceMessage message;
+        message.sender = state_.GetUsername(user);
+        message.recipient = request.recipient;
+        message.channels = request.channels;
+        message.sample_rate = request.sample_rate;
+        message.samples = request.samples;
+        Send(request.recipient, identity, trace_id, message);
+        return true;
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const CreateGroupRequest& request) {
+        return ForwardJoin<ForwardedCreateGroup>(identity, trace_id, request);
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const JoinGroupRequest& request) {
+        return ForwardJoin<ForwardedJoinGroup>(identity, trace_id, request);
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const LeaveGroupRequest& request) {
+        return ForwardGroupRequest<ForwardedLeaveGroup>(identity, trace_id,
+                                                        request);
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const JoinCallRequest& request) {
+        return ForwardGroupRequest<ForwardedJoinCall>(identity, trace_id,
+                                                      request);
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const MessageGroupRequest& request) {
+        UserId user = ForwardedUser(request.token, request.group_name);
+        if (user == kInvalidId) return false;
+        ForwardedMessageGroup message;
+        message.sender = state_.GetUsername(user);
+        message.group_name = request.group_name;
+        message.content = request.content;
+        Send(request.group_name, identity, trace_id, message);
+        return true;
+    }
+
+    bool Forward(const NetIdentity& identity, uint64_t trace_id,
+                 const RawSendCallDataUpdate& update) {
+        UserId user = ForwardedUser(update.token, update.group_name);
+        if (user == kInvalidId) return false;
+        ForwardedCallData message;
+        message.sender = state_.GetUsername(user);
+        message.group_name = update.group_name;
+        message.samples = update.samples;
+        Send(update.group_name, identity, trace_id, message);
+        return true;
+    }
+
+    // Answers a forwarded contact to the shard of the user
+    void CheckContact(const NetIdentity& identity, uint64_t trace_id,
+                      const ForwardedAddContact& message) {
+        ForwardedAddContact answer = message;
+        answer.checked = true;
+        answer.exists = database_.FindUser(message.contact) != kInvalidId;
+        Send(message.sender, identity, trace_id, answer);
+    }
+
+    // Tells the shard of the user if it is member of the group
+    void SendMembership(const std::string& username,
+                        const std::string& group_name) {
+        GroupId group = database_.FindGroup(group_name);
+        UserId user = database_.InternUser(username);
+
+        Membership message;
+        message.username = username;
+        message.group_name = group_name;
+        message.joined = group != kInvalidId &&
+                         database_.GetGroup(group).IsMember(user);
+        Send(username, NetIdentity(), 0, message);
+    }
+
+    void UpdateMembership(const Membership& message) {
+        UserId user = database_.FindUser(message.username);
+        if (user == kInvalidId) return;
+        GroupId group =
+            state_.SetMembership(user, message.group_name, message.joined);
+        if (message.joined) SyncGroup(user, group);
+    }
+
+    // Sends the identities of the user to the shards of its groups, after
+    // they change
+    void SyncGroups(UserId user) {
+        if (user == kInvalidId) return;
+        for (GroupId group : database_.GetUser(user).GetGroups()) {
+            if (!database_.GetGroup(group).IsRegistered()) {
+                SyncGroup(user, group);
+            }
+        }
+    }
+
+    void SetMemberOnline(const MemberOnline& message) {
+        GroupId group = database_.FindGroup(message.group_name);
+        if (group == kInvalidId) return;
+        state_.SetOnlineMember(group, database_.InternUser(message.username),
+                               message.identities, message.compressed);
+    }
+
+    // Sends the statistics of the shard to the front-end, without identity
+    void SendStats() {
+        std::ostringstream json;
+        json << "{\"shard\":" << index_
+             << ",\"users\":" << database_.NumUsers()
+             << ",\"groups\":" << database_.NumGroups()
+             << ",\"connected_users\":" << state_.NumConnectedUsers()
+             << ",\"identities\":" << state_.NumIdentities()
+             << ",\"group_calls\":" << state_.NumGroupCalls()
+             << ",\"messages_in\":"
+             << requests_.MessagesReceived() + inbox_.MessagesReceived()
+             << ",\"compressed\":"
+             << outbound_.GetCompression().Compressed()
+             << ",\"held_responses\":" << state_.NumHeldResponses()
+             << ",\"dispatch\":";
+        state_.GetStats().WriteJSON(json);
+        if (store_) {
+            json << ",\"store\":";
+            store_->WriteJSON(json);
+        }
+        if (offline_) {
+            json << ",\"inbox\":";
+            offline_->WriteJSON(json);
+        }
+        json << "}";
+
+        outbound_.send(NetIdentity(), ZMQ_SNDMORE);
+        outbound_.send(json.str());
+    }
+
+private:
+    // User of the token when the request has to be forwarded to the shard of
+    // the name, kInvalidId if it is handled here
+    UserId ForwardedUser(const SessionToken& token, const std::string& name) {
+        if (IsLocal(name)) return kInvalidId;
+        return state_.FindSession(token);
+    }
+
+    template <typename Message, typename Request>
+    bool ForwardJoin(const NetIdentity& identity, uint64_t trace_id,
+                     const Request& request) {
+        UserId user = ForwardedUser(request.token, request.group_name);
+        if (user == kInvalidId) return false;
+        Message message;
+        message.sender = state_.GetUsername(user);
+        message.group_name = request.group_name;
+        message.identities = state_.GetIdentities(user);
+        for (auto& user_identity : message.identities) {
+            message.compressed.push_back(state_.IsCompressed(user_identity));
+        }
+        Send(request.group_name, identity, trace_id, message);
+        return true;
+    }
+
+    template <typename Message, typename Request>
+    bool ForwardGroupRequest(const NetIdentity& identity, uint64_t trace_id,
+                             const Request& request) {
+        UserId user = ForwardedUser(request.token, request.group_name);
+        if (user == kInvalidId) return false;
+        Message message;
+        message.sender = state_.GetUsername(user);
+        message.group_name = request.group_name;
+        Send(request.group_name, identity, trace_id, message);
+        return true;
+    }
+
+    void SyncGroup(UserId user, GroupId group) {
+        MemberOnline message;
+        message.username = database_.GetUsername(user);
+        message.group_name = database_.GetGroupName(group);
+        if (state_.UserConnected(user)) {
+            message.identities = state_.GetIdentities(user);
+            for (auto& identity : message.identities) {
+                message.compressed.push_back(state_.IsCompressed(identity));
+            }
+        }
+        Send(message.group_name, NetIdentity(), 0, message);
+    }
+
+    // Sends the message to the shard of the name
+    template <typename Message>
+    void Send(const std::string& name, const NetIdentity& identity,
+              uint64_t trace_id, const Message& message) {
+        Serializer output(forward_hint_);
+        if (trace_id) Pack(output, TraceEnvelope(trace_id, trace::Now()));
+        Pack(output, message);
+        zmqw::socket& peer = *peers_[ShardOf(name, num_shards_)];
+        peer.send(identity, ZMQ_SNDMORE);
+        peer.send(std::move(output));
+    }
+
+    void Run();
+
+private:
+    zmqw::socket requests_;  // From the clients, through the front-end
+    zmqw::socket inbox_;     // From the other threads
+    zmqw::socket outbound_;  // To the front-end
+    std::vector<std::unique_ptr<zmqw::socket>> peers_;  // By shard
+    DataBase database_;
+    std::unique_ptr<DurableStore> store_;  // nullptr if only in memory
+    std::unique_ptr<OfflineInbox> offline_;  // Only with a store
+    std::unique_ptr<HistoryWriter> history_;  // Only with a store
+    ServerState state_;
+    size_t index_;
+    size_t num_shards_;
+    std::string prefix_;
+    CapacityHint forward_hint_;
+    bool running_;
+    std::thread thread_;
+};
+
+// Handles the messages received by a shard, the client requests with the
+// RequestHandler of the shard state unless they are forwarded
+struct ShardHandler {
+    ChatShard& shard;
+    const NetIdentity& identity;
+    ServerStats::Clock::time_point start;  // When the message was received
+    uint64_t trace_id;
+    AllocationScope& allocations;
+
+    template <typename Request>
+    void operator()(const Request& request) {
+        if (!shard.Forward(identity, trace_id, request)) Reply(request);
+    }
+
+    void operator()(const LoginRequest& request) {
+        Reply(request);
+        ServerState& server = shard.GetState();
+        shard.SyncGroups(server.GetDataBase().FindUser(request.username));
+    }
+
+    void operator()(const LogoutRequest& request) {
+        UserId user = shard.GetState().FindSession(request.token);
+        Reply(request);
+        shard.SyncGroups(user);
+    }
+
+    void operator()(const ForwardedAddContact& message) {
+        if (message.checked) {
+            Reply(message);
+        } else {
+            shard.CheckContact(identity, trace_id, message);
+        }
+    }
+
+    template <Action A>
+    void operator()(const BasicForwardedJoin<A>& message) {
+        Reply(message);
+        shard.SendMembership(message.sender, message.group_name);
+    }
+
+    void operator()(const ForwardedLeaveGroup& message) {
+        Reply(message);
+        shard.SendMembership(message.sender, message.group_name);
+    }
+
+    void operator()(const ForwardedCallData& update) {
+        allocations.SetName(ActionName(ForwardedCallData::kAction));
+        trace::Span span(trace_id, "server.handler");
+        ServerState& server = shard.GetState();
+        server.ProcessGroupCallData(
+            server.GetDataBase().InternUser(update.sender), update.group_name,
+            update.samples);
+        server.GetStats().RecordRequest(ForwardedCallData::kAction,
+                                        ServerCodes::SUCCESS, start);
+    }
+
+    void operator()(const Membership& message) {
+        shard.UpdateMembership(message);
+    }
+
+    void operator()(const MemberOnline& message) {
+        shard.SetMemberOnline(message);
+    }
+
+    void operator()(const ShardStatsRequest& /*request*/) {
+        shard.SendStats();
+    }
+
+    void operator()(const ShardStop& /*request*/) {
+        shard.Stop();
+    }
+
+    void operator()(const ShardDisconnect& message) {
+        shard.SyncGroups(shard.GetState().Disconnect(message.identity));
+    }
+
+    template <typename Request>
+    void Reply(const Request& request) {
+        RequestHandler handler{shard.GetState(), identity, start, trace_id,
+                               allocations};
+        handler(request);
+    }
+};
+
+// The client requests, the only messages of the requests socket
+using ShardRequestDispatcher =
+    Dispatcher<ShardHandler, RegisterRequest, LoginRequest, LogoutRequest,
+               AddContactRequest, WhisperRequest, CreateGroupRequest,
+               JoinGroupRequest, LeaveGroupRequest, MessageGroupRequest,
+               RawVoiceMessageRequest, JoinCallRequest, HistoryRequest,
+               SearchRequest, RawSendCallDataUpdate>;
+
+// The messages between the threads, the only ones of the inbox
+using ShardDispatcher =
+    Dispatcher<ShardHandler, ForwardedAddContact, ForwardedWhisper,
+               ForwardedVoiceMessage, ForwardedCreateGroup,
+               ForwardedJoinGroup, ForwardedLeaveGroup, ForwardedMessageGroup,
+               ForwardedJoinCall, ForwardedCallData, Membership, MemberOnline,
+               ShardStatsRequest, ShardStop, ShardDisconnect>;
+
+// Waits for messages or commits of the store, then handles the messages
+// already queued. The requests routed before the ShardStop are handled
+// before stopping.
+inline void ChatShard::Run() {
+    zmq::pollitem_t items[] = {
+        {static_cast<void*>(requests_), 0, ZMQ_POLLIN, 0},
+        {static_cast<void*>(inbox_), 0, ZMQ_POLLIN, 0},
+        {store_ ? static_cast<void*>(store_->GetCommits()) : nullptr, 0,
+         ZMQ_POLLIN, 0}};
+    int num_items = store_ ? 3 : 2;
+
+    while (running_) {
+        try {
+            zmq::poll(items, num_items, -1);
+        } catch (zmq::error_t&) {
+            continue;  // Interrupted by a signal
+        }
+        if (items[2].revents & ZMQ_POLLIN) {
+            state_.ReleaseCommitted();
+        }
+        if (items[1].revents & ZMQ_POLLIN) {
+            size_t depth = 0;
+            while (running_ && depth < kMaxBurst &&
+                   DispatchMessage<ShardHandler, ShardDispatcher>(
+                       inbox_, *this, state_, ZMQ_DONTWAIT)) {
+                depth++;
+            }
+        }
+        if (items[0].revents & ZMQ_POLLIN) {
+            size_t depth = 0;
+            while (running_ && depth < kMaxBurst &&
+                   DispatchMessage<ShardHandler, ShardRequestDispatcher>(
+                       requests_, *this, state_, ZMQ_DONTWAIT)) {
+                depth++;
+            }
+            state_.GetStats().RecordQueueDepth(depth);
+        }
+    }
+
+    while (DispatchMessage<ShardHandler, ShardRequestDispatcher>(
+        requests_, *this, state_, ZMQ_DONTWAIT)) {
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Forwarded request handlers, run in the shard of the recipient, the contact
+// or the group. The sender is known by name, it is interned without being
+// registered if it belongs to other shard.
+///////////////////////////////////////////////////////////////////////////////
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedAddContact& message,
+                   ForwardedAddContact::Response& response) {
+    DataBase& database = server.GetDataBase();
+    if (!message.exists) {
+        response.code = ServerCodes::USER_DOES_NOT_EXIST;
+        return;
+    }
+    server.AddKnownContact(database.FindUser(message.sender),
+                           database.InternUser(message.contact));
+    LOG_INFO("[User] '" << message.sender << "' added '" << message.contact
+                        << "'");
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedWhisper& message,
+                   ForwardedWhisper::Response& response) {
+    response.code =
+        server.Whisper(server.GetDataBase().InternUser(message.sender),
+                       message.recipient, message.content);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedVoiceMessage& message,
+                   ForwardedVoiceMessage::Response& response) {
+    response.code = server.SendVoiceMessage(
+        server.GetDataBase().InternUser(message.sender), message.recipient,
+        message.channels, message.sample_rate, message.samples);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedCreateGroup& message,
+                   ForwardedCreateGroup::Response& response) {
+    DataBase& database = server.GetDataBase();
+    UserId user = database.InternUser(message.sender);
+    response.code = server.CreateGroup(user, message.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        server.SetOnlineMember(database.FindGroup(message.group_name), user,
+                               message.identities, message.compressed);
+        LOG_INFO("[Group] '" << message.group_name << "' created, owner '"
+                             << message.sender << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedJoinGroup& message,
+                   ForwardedJoinGroup::Response& response) {
+    DataBase& database = server.GetDataBase();
+    UserId user = database.InternUser(message.sender);
+    response.code = server.JoinGroup(user, message.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        server.SetOnlineMember(database.FindGroup(message.group_name), user,
+                               message.identities, message.compressed);
+        LOG_INFO("[Group] '" << message.sender << "' just joined '"
+                             << message.group_name << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedLeaveGroup& message,
+                   ForwardedLeaveGroup::Response& response) {
+    response.code =
+        server.LeaveGroup(server.GetDataBase().InternUser(message.sender),
+                          message.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        LOG_INFO("[Group] '" << message.sender << "' just left '"
+                             << message.group_name << "'");
+    }
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedMessageGroup& message,
+                   ForwardedMessageGroup::Response& response) {
+    response.code =
+        server.MessageGroup(server.GetDataBase().InternUser(message.sender),
+                            message.group_name, message.content);
+}
+
+inline void Handle(ServerState& server, const NetIdentity& /*identity*/,
+                   const ForwardedJoinCall& message,
+                   ForwardedJoinCall::Response& response) {
+    response.code =
+        server.JoinCall(server.GetDataBase().InternUser(message.sender),
+                        message.group_name);
+    if (response.code == ServerCodes::SUCCESS) {
+        response.group_name = message.group_name;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Front-end
+///////////////////////////////////////////////////////////////////////////////
+
+class ShardedServer {
+public:
+    ShardedServer(zmq::context_t& context, size_t num_shards)
+          : context_(context),
+            outbound_(context, ZMQ_PULL),
+            rejected_(0),
+            stats_requested_(false) {
+        // Unique names, so several servers can live in the same context
+        std::ostringstream prefix;
+        prefix << "inproc://chat-shards-" << static_cast<const void*>(this);
+        prefix_ = prefix.str();
+
+        ConfigureInternalSocket(outbound_);
+        outbound_.bind(ChatShard::OutboundEndpoint(prefix_));
+        for (size_t i = 0; i < num_shards; i++) {
+            shards_.emplace_back(
+                new ChatShard(context, prefix_, i, num_shards));
+        }
+
+        for (size_t i = 0; i < num_shards; i++) {
+            shards_[i]->Connect(context);
+            inboxes_.emplace_back(new zmqw::socket(context, ZMQ_PUSH));
+            ConfigureInternalSocket(*inboxes_.back());
+            inboxes_.back()->connect(ChatShard::Endpoint(prefix_, i));
+            requests_.emplace_back(new zmqw::socket(context, ZMQ_PUSH));
+            ConfigureInternalSocket(*requests_.back());
+            requests_.back()->connect(
+                ChatShard::RequestsEndpoint(prefix_, i));
+        }
+    }
+
+    ~ShardedServer() {
+        Stop();
+    }
+
+    ShardedServer(const ShardedServer&) = delete;
+    ShardedServer& operator=(const ShardedServer&) = delete;
+
+    // Makes the databases of the shards durable in the directory, it must be
+    // called before Register and Start. The history is shared by the shards,
+    // so it doesn't depend on their number.
+    bool Open(const std::string& directory, uint64_t snapshot_interval,
+              const InboxLimits& limits) {
+        std::string other = FindOtherShardsData(directory, NumShards());
+        if (!other.empty()) {
+            LOG_ERROR("The data directory has data of another number of "
+                      "shards: " << fs::JoinPath(directory, other));
+            return false;
+        }
+        std::string base = fs::JoinPath(
+            directory, "shards-" + std::to_string(NumShards()));
+        for (size_t i = 0; i < NumShards(); i++) {
+            std::string shard_directory =
+                fs::JoinPath(base, std::to_string(i));
+            if (!shards_[i]->Open(context_, shard_directory,
+                                  snapshot_interval, limits)) {
+                return false;
+            }
+        }
+
+        history_.reset(
+            new HistoryStore(context_, fs::JoinPath(directory, "history")));
+        if (!history_->Open()) return false;
+        for (auto& shard : shards_) {
+            shard->SetHistory(context_, history_->GetEndpoint());
+        }
+        return true;
+    }
+
+    // Registers the user in its shard, it must be called before Start
+    ServerCodes Register(const std::string& username,
+                         const std::string& password) {
+        size_t shard = ShardOf(username, shards_.size());
+        return shards_[shard]->GetState().Register(username, password);
+    }
+
+    void Start() {
+        for (auto& shard : shards_) shard->Start();
+    }
+
+    // The shards stop after handling the messages already routed to them
+    void Stop() {
+        for (size_t i = 0; i < inboxes_.size(); i++) {
+            SendToShard(i, ShardStop());
+        }
+        for (auto& shard : shards_) shard->Join();
+        inboxes_.clear();
+        requests_.clear();
+        if (history_) history_->Stop();
+    }
+
+    size_t NumShards() const {
+        return shards_.size();
+    }
+
+    // Socket with the messages of the shards to the clients, to poll it
+    zmqw::socket& GetOutbound() {
+        return outbound_;
+    }
+
+    // nullptr if the server is not durable
+    HistoryStore* GetHistory() {
+        return history_.get();
+    }
+
+    // Routes the requests queued in the client socket to their shards, a
+    // bounded number so the other polled sockets are not starved. The
+    // frames that are not client messages are dropped.
+    void RoutePending(zmqw::socket& socket) {
+        for (size_t i = 0; i < kMaxBurst; i++) {
+            zmq::message_t identity;
+            zmq::message_t frame;
+            if (!socket.recv(identity, ZMQ_DONTWAIT)) break;
+            socket.recv(frame);
+
+            size_t shard = 0;
+            if (!RouteRequest(frame, NumShards(), shard)) {
+                rejected_++;
+                continue;
+            }
+            zmqw::socket& requests = *requests_[shard];
+            requests.send(identity, ZMQ_SNDMORE);
+            requests.send(frame);
+        }
+    }
+
+    // Sends the messages of the shards to the clients through the queues,
+    // the ones without identity are the statistics of a shard
+    void ForwardPending(OutboundQueues& queues) {
+        for (size_t i = 0; i < kMaxBurst; i++) {
+            std::string identity;
+            if (!outbound_.recv(identity, ZMQ_DONTWAIT)) break;
+
+            zmq::message_t frame;
+            outbound_.recv(frame);
+            if (identity.empty()) {
+                shard_stats_.emplace_back(static_cast<char*>(frame.data()),
+                                          frame.size());
+                continue;
+            }
+
+            OutboundClass type = OutboundClass::RESPONSE;
+            if (frame.size() == 1) {
+                type = static_cast<OutboundClass>(
+                    *static_cast<const uint8_t*>(frame.data()));
+            }
+            parts_.clear();
+            do {
+                parts_.emplace_back();
+                outbound_.recv(parts_.back());
+            } while (parts_.back().more());
+            queues.Send(identity, parts_.data(), parts_.size(), type);
+        }
+    }
+
+    // Tells the shards to log out the slow consumers dropped by the queues,
+    // it has to be called after they send or flush
+    void DisconnectSlowConsumers(OutboundQueues& queues) {
+        for (const std::string& identity : queues.TakeDisconnected()) {
+            LOG_WARNING("[User] Identity disconnected, too slow to receive");
+            ShardDisconnect message;
+            message.identity = identity;
+            for (size_t i = 0; i < inboxes_.size(); i++) {
+                SendToShard(i, message);
+            }
+        }
+    }
+
+    // Replies the requests of the stats socket with the statistics of the
+    // front-end and of each shard. The shards are asked when the request
+    // arrives and it is replied once all of them answered, so it has to be
+    // called after each poll.
+    void ServeStats(zmqw::socket& stats_socket, OutboundQueues& queues) {
+        if (!stats_requested_) {
+            std::string request;
+            if (!stats_socket.recv(request, ZMQ_DONTWAIT)) return;
+            stats_requested_ = true;
+            shard_stats_.clear();
+            for (size_t i = 0; i < inboxes_.size(); i++) {
+                SendToShard(i, ShardStatsRequest());
+            }
+        }
+        if (shard_stats_.size() < NumShards()) return;
+
+        zmqw::socket& socket = queues.GetSocket();
+        std::ostringstream json;
+        json << "{\"server\":{\"shards\":" << NumShards()
+             << ",\"messages_in\":" << socket.MessagesReceived()
+             << ",\"messages_out\":" << socket.MessagesSent()
+             << ",\"bytes_in\":" << socket.BytesReceived()
+             << ",\"bytes_out\":" << socket.BytesSent()
+             << ",\"rejected\":" << rejected_ << "}";
+        json << ",\"outbound\":";
+        queues.WriteJSON(json);
+        if (history_) {
+            json << ",\"history\":";
+            history_->WriteJSON(json);
+        }
+        json << ",\"shards\":[";
+        for (size_t i = 0; i < shard_stats_.size(); i++) {
+            json << (i > 0 ? "," : "") << shard_stats_[i];
+        }
+        json << "],\"allocations\":";
+        AllocationTracker::Instance().WriteJSON(json);
+        json << "}";
+
+        stats_socket.send(json.str());
+        stats_requested_ = false;
+    }
+
+private:
+    template <typename Message>
+    void SendToShard(size_t shard, const Message& message) {
+        Serializer output;
+        Pack(output, message);
+        inboxes_[shard]->send(NetIdentity(), ZMQ_SNDMORE);
+        inboxes_[shard]->send(std::move(output));
+    }
+
+private:
+    zmq::context_t& context_;
+    zmqw::socket outbound_;
+    std::string prefix_;
+    std::unique_ptr<HistoryStore> history_;  // Outlives the shards
+    std::vector<std::unique_ptr<ChatShard>> shards_;
+    std::vector<std::unique_ptr<zmqw::socket>> inboxes_;   // By shard
+    std::vector<std::unique_ptr<zmqw::socket>> requests_;  // By shard
+    std::vector<std::string> shard_stats_;
+    std::vector<zmq::message_t> parts_;  // Of the message being forwarded
+    uint64_t rejected_;  // Client frames that were not client messages
+    bool stats_requested_;
+};
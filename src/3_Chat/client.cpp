@@ -5,17 +5,22 @@
 #include <chrono>
 #include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
 
 #include <SFML/Audio.hpp>
 
+#include <Util/Options.hpp>
 #include <Util/Serializer.hpp>
+#include <Util/Trace.hpp>
 #include <Util/ZMQWrapper.hpp>
 
 #include "SafeQueue.hpp"
+#include "Protocol.hpp"
 #include "ServerCodes.hpp"
 
 static volatile std::sig_atomic_t gSignalStatus = 0;
@@ -34,10 +39,10 @@ std::string TrimSpaces(const std::string& str) {
 
 class ChatClient {
 public:
-    ChatClient(const std::string& ip, size_t port)
-          : context_(1), socket_(context_, ZMQ_DEALER) {
+    explicit ChatClient(const std::string& endpoint)
+          : context_(1), socket_(context_, ZMQ_DEALER), compression_(false) {
         // Connect to the server
-        socket_.connect("tcp://" + ip + ':' + std::to_string(port));
+        socket_.connect(endpoint);
 
         is_running_ = true;
         listener_ = std::thread(&ChatClient::ResponseListener, this);
@@ -52,58 +57,93 @@ public:
 
     bool Register(const std::string& username, const std::string password) {
         if (username.empty() || password.empty()) return false;
-        Serializer request;
-        request << ("request") << ("register") << username << password;
-        return socket_.send(request);
+        RegisterRequest request;
+        request.username = username;
+        request.password = password;
+        return Send(request);
     }
 
     bool Login(const std::string& username, const std::string password) {
         if (!username_.empty() || username.empty() || password.empty())
             return false;
-        Serializer request;
-        request << ("request") << ("login") << username << password;
-        return socket_.send(request);
+        LoginRequest request;
+        request.username = username;
+        request.password = password;
+        request.compression = true;
+        return Send(request);
     }
 
     bool Logout() {
         if (username_.empty()) return false;
-        Serializer request;
-        request << ("request") << ("logout") << username_;
-        return socket_.send(request);
+        LogoutRequest request;
+        request.token = token_;
+        return Send(request);
     }
 
     bool AddContact(const std::string& contact) {
         if (username_.empty() || contact.empty()) return false;
-        Serializer request;
-        request << ("request") << ("add_contact") << username_ << token_
-                << contact;
-        return socket_.send(request);
+        AddContactRequest request;
+        request.token = token_;
+        request.contact = contact;
+        return Send(request);
     }
 
     bool Whisper(const std::string& recipient, const std::string content) {
         std::string tcontent = TrimSpaces(content);
         if (username_.empty() || recipient.empty() || tcontent.empty())
             return false;
-        Serializer request;
-        request << ("request") << ("whisper") << username_ << token_
-                << recipient << tcontent;
-        return socket_.send(request);
+        WhisperRequest request;
+        request.token = token_;
+        request.recipient = recipient;
+        request.content = tcontent;
+        return Send(request);
     }
 
     bool CreateGroup(const std::string& group_name) {
         if (username_.empty() || group_name.empty()) return false;
-        Serializer request;
-        request << ("request") << ("create_group") << username_ << token_
-                << group_name;
-        return socket_.send(request);
+        CreateGroupRequest request;
+        request.token = token_;
+        request.group_name = group_name;
+        return Send(request);
     }
 
     bool JoinGroup(const std::string& group_name) {
         if (username_.empty()) return false;
-        Serializer request;
-        request << ("request") << ("join_group") << username_ << token_
-                << group_name;
-        return socket_.send(request);
+        JoinGroupRequest request;
+        request.token = token_;
+        request.group_name = group_name;
+        return Send(request);
+    }
+
+    bool LeaveGroup(const std::string& group_name) {
+        if (username_.empty() || group_name.empty()) return false;
+        LeaveGroupRequest request;
+        request.token = token_;
+        request.group_name = group_name;
+        return Send(request);
+    }
+
+    // The last messages of the conversation with a user or of a group
+    bool History(const std::string& name, bool group, uint32_t limit) {
+        if (username_.empty() || name.empty()) return false;
+        HistoryRequest request;
+        request.token = token_;
+        request.group = group;
+        request.name = name;
+        request.limit = limit;
+        return Send(request);
+    }
+
+    // The last messages of the conversation that have the words
+    bool Search(const std::string& name, bool group, const std::string& query) {
+        std::string tquery = TrimSpaces(query);
+        if (username_.empty() || name.empty() || tquery.empty()) return false;
+        SearchRequest request;
+        request.token = token_;
+        request.group = group;
+        request.name = name;
+        request.query = tquery;
+        return Send(request);
     }
 
     bool MessageGroup(const std::string& group_name,
@@ -111,63 +151,159 @@ public:
         std::string tcontent = TrimSpaces(content);
         if (username_.empty() || group_name.empty() || tcontent.empty())
             return false;
-        Serializer request;
-        request << ("request") << ("msg_group") << username_ << token_
-                << group_name << tcontent;
-        return socket_.send(request);
+        MessageGroupRequest request;
+        request.token = token_;
+        request.group_name = group_name;
+        request.content = tcontent;
+        return Send(request);
     }
 
     bool SendVoiceMessage(const std::string& recipient, size_t channels,
-                          size_t sample_rate,
-                          const std::vector<int16_t>& samples) {
+                          size_t sample_rate, std::vector<int16_t> samples) {
         if (username_.empty() || recipient.empty()) return false;
 
-        Serializer request;
-        request << ("request") << ("voice_msg") << username_ << token_
-                << recipient << channels << sample_rate << samples;
-        return socket_.send(request);
+        VoiceMessageRequest request;
+        request.token = token_;
+        request.recipient = recipient;
+        request.channels = channels;
+        request.sample_rate = sample_rate;
+        request.samples = std::move(samples);
+        return Send(request);
     }
 
     bool JoinCall(const std::string& group_name) {
         if (username_.empty() || group_name.empty()) return false;
 
-        Serializer request;
-        request << ("request") << ("join_call") << username_ << token_
-                << group_name;
-        return socket_.send(request);
+        JoinCallRequest request;
+        request.token = token_;
+        request.group_name = group_name;
+        return Send(request);
     }
 
     bool SendCallData(const std::string& group_name,
-                      const std::vector<int16_t>& samples) {
+                      std::vector<int16_t> samples) {
         if (username_.empty() || group_name.empty()) return false;
 
-        Serializer request;
-        request << ("update") << ("call_data") << username_ << token_
-                << group_name << samples;
-        return socket_.send(request);
+        SendCallDataUpdate update;
+        update.token = token_;
+        update.group_name = group_name;
+        update.samples = std::move(samples);
+        return Send(update);
     }
 
 private:
+    // Forwards the messages from the server to the handle functions
+    struct MessageHandler {
+        ChatClient& client;
+
+        template <Action A>
+        void operator()(const StatusResponse<A>& response) {
+            client.HandleResponse(A, response.code);
+        }
+
+        void operator()(const LoginResponse& response) {
+            client.HandleLogin(response);
+        }
+
+        void operator()(const JoinCallResponse& response) {
+            client.HandleJoinCall(response);
+        }
+
+        void operator()(const HistoryResponse& response) {
+            client.HandleHistory(response);
+        }
+
+        void operator()(const SearchResponse& response) {
+            client.HandleSearch(response);
+        }
+
+        void operator()(const WhisperUpdate& update) {
+            client.HandleWhisper(update);
+        }
+
+        void operator()(const MessageGroupUpdate& update) {
+            client.HandleMessageGroup(update);
+        }
+
+        void operator()(VoiceMessageUpdate& update) {
+            client.HandleVoiceMessage(update);
+        }
+
+        void operator()(CallDataUpdate& update) {
+            client.HandleCallData(update);
+        }
+    };
+
+    using ServerDispatcher = Dispatcher<
+        MessageHandler, StatusResponse<Action::REGISTER>, LoginResponse,
+        StatusResponse<Action::LOGOUT>, StatusResponse<Action::ADD_CONTACT>,
+        StatusResponse<Action::WHISPER>, StatusResponse<Action::CREATE_GROUP>,
+        StatusResponse<Action::JOIN_GROUP>, StatusResponse<Action::MSG_GROUP>,
+        StatusResponse<Action::VOICE_MSG>, JoinCallResponse,
+        StatusResponse<Action::LEAVE_GROUP>, HistoryResponse, SearchResponse,
+        WhisperUpdate, MessageGroupUpdate, VoiceMessageUpdate, CallDataUpdate>;
+
+    // Called from the input and the call threads
+    template <typename Message>
+    bool Send(const Message& message) {
+        uint64_t trace_id = trace::Tracer::Instance().StartTrace();
+        trace::Span span(trace_id, "client.send");
+
+        Serializer output;
+        if (trace_id) Pack(output, TraceEnvelope(trace_id, trace::Now()));
+        Pack(output, message);
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        // The register and login requests are always raw, the server only
+        // accepts compressed frames after the login
+        if (compression_ && Message::kTag != RegisterRequest::kTag &&
+            Message::kTag != LoginRequest::kTag) {
+            output.Compress(socket_.GetCompression());
+        }
+        return socket_.send(std::move(output));
+    }
+
     void ResponseListener() {
         Deserializer server_msg;
+        MessageHandler handler{*this};
         while (is_running_) {
-            if (!socket_.recv(server_msg, ZMQ_NOBLOCK)) continue;
-            std::string type;
-            server_msg >> type;
-            if (type == "response") {
-                HandleResponse(server_msg);
-            } else if (type == "update") {
-                HandleUpdate(server_msg);
-            } else {
+            try {
+                if (!socket_.recv(server_msg, ZMQ_NOBLOCK)) continue;
+
+                // Time since the server sent the message
+                TraceEnvelope envelope;
+                if (UnpackIf(server_msg, envelope)) {
+                    trace::Tracer::Instance().Record(
+                        envelope.trace_id, "client.delivery",
+                        envelope.timestamp, trace::Now());
+                }
+
+                trace::Span span(envelope.trace_id, "client.handler");
+                ServerDispatcher::Dispatch(handler, server_msg);
+            } catch (std::exception& e) {
                 // Ignore the message
             }
         }
     }
 
 protected:
-    virtual void HandleResponse(Deserializer& /*response*/) = 0;
+    // Response of the requests that only return its code
+    virtual void HandleResponse(Action action, ServerCodes code) = 0;
 
-    virtual void HandleUpdate(Deserializer& /*update*/) = 0;
+    virtual void HandleLogin(const LoginResponse& response) = 0;
+
+    virtual void HandleJoinCall(const JoinCallResponse& response) = 0;
+
+    virtual void HandleHistory(const HistoryResponse& response) = 0;
+
+    virtual void HandleSearch(const SearchResponse& response) = 0;
+
+    virtual void HandleWhisper(const WhisperUpdate& update) = 0;
+
+    virtual void HandleMessageGroup(const MessageGroupUpdate& update) = 0;
+
+    virtual void HandleVoiceMessage(VoiceMessageUpdate& update) = 0;
+
+    virtual void HandleCallData(CallDataUpdate& update) = 0;
 
 protected:
     bool is_running_;
@@ -176,7 +312,10 @@ protected:
     zmqw::socket socket_;     // Client socket
 
     std::string username_;  // The username of the currently logged user
-    std::string token_;     // The user request token
+    SessionToken token_;    // The session of the user
+    bool compression_;      // The server accepts compressed frames
+
+    std::mutex send_mutex_;
 
     std::thread listener_;  // The listener of responses and updates
 };
@@ -188,7 +327,10 @@ static std::string HELP(R"(Usage:
     /msg [recipient] [content]           Send a text message to another user
     /create_group [group_name]           Create a new group
     /join_group [group_name]             Join an existent group
+    /leave_group [group_name]            Leave a group
     /msg_group [group_name] [content]    Send a text message to a group
+    /history [user|#group] [count]       Show the last messages of a chat
+    /search [user|#group] [words]        Search a chat, word* matches a prefix
     /record [recipient]                  Record and send a voice message to a user
     /play                                Play the last received voice message
     /call [recipient]                    Call a user
@@ -263,9 +405,9 @@ private:
 
 class ChatCLI : public ChatClient {
 public:
-    ChatCLI(const std::string& ip, size_t port)
-          : ChatClient(ip, port), responses_arrived_(0), outgoing_call_(false) {
-        std::cout << "Connecting to chat in " << ip << ":" << port << '\n';
+    explicit ChatCLI(const std::string& endpoint)
+          : ChatClient(endpoint), responses_arrived_(0), outgoing_call_(false) {
+        std::cout << "Connecting to chat in " << endpoint << '\n';
         std::cout << "Use /help for more information\n";
     }
 
@@ -315,6 +457,22 @@ public:
             std::string group_name;
             stream >> group_name;
             request_sent = JoinGroup(group_name);
+        } else if (action == "/leave_group") {
+            std::string group_name;
+            stream >> group_name;
+            request_sent = LeaveGroup(group_name);
+        } else if (action == "/history") {
+            std::string name;
+            uint32_t count = 20;
+            stream >> name >> count;
+            bool group = !name.empty() && name[0] == '#';
+            request_sent = History(group ? name.substr(1) : name, group, count);
+        } else if (action == "/search") {
+            std::string name, query;
+            stream >> name;
+            std::getline(stream, query);
+            bool group = !name.empty() && name[0] == '#';
+            request_sent = Search(group ? name.substr(1) : name, group, query);
         } else if (action == "/msg_group") {
             std::string group_name, content;
             stream >> group_name;
@@ -379,7 +537,7 @@ private:
             buffer.getSamples(), buffer.getSamples() + buffer.getSampleCount());
 
         SendVoiceMessage(recipient, buffer.getChannelCount(),
-                         buffer.getSampleRate(), samples);
+                         buffer.getSampleRate(), std::move(samples));
 
         return true;
     }
@@ -392,7 +550,7 @@ private:
         }
 
         RecorderLOL recorder([&](std::vector<int16_t>&& samples) {
-            SendCallData(group_name, samples);
+            SendCallData(group_name, std::move(samples));
         });
         std::cout << "Starting call.\n";
         size_t sample_rate = 44100;
@@ -432,81 +590,134 @@ private:
         recorder.stop();
     }
 
-    void HandleResponse(Deserializer& response) {
-        std::string action;
-        ServerCodes status = ServerCodes::SUCCESS;
-        response >> action >> status;
-
-        if (status == ServerCodes::SUCCESS) {
-            if (action == "login") {
-                response >> username_;
-                response >> token_;
-                std::cout << "User " << username_
-                          << " successfully logged in.\n";
-                std::cout << "Token: " << token_ << '\n';
-            } else if (action == "register") {
+    void HandleResponse(Action action, ServerCodes code) {
+        if (code == ServerCodes::SUCCESS) {
+            if (action == Action::REGISTER) {
                 std::cout << "Register successful.\n";
-            } else if (action == "logout") {
+            } else if (action == Action::LOGOUT) {
                 std::cout << "Logout successful.\n";
                 username_.clear();
-                token_.clear();
-            } else if (action == "whisper") {
+                token_ = SessionToken();
+                compression_ = false;
+            } else if (action == Action::WHISPER) {
                 // ???
-            } else if (action == "create_group") {
+            } else if (action == Action::CREATE_GROUP) {
                 std::cout << "Group creation successful.\n";
-            } else if (action == "join_group") {
+            } else if (action == Action::JOIN_GROUP) {
                 std::cout << "Group join successful.\n";
-            } else if (action == "voice_msg") {
+            } else if (action == Action::LEAVE_GROUP) {
+                std::cout << "Group leave successful.\n";
+            } else if (action == Action::VOICE_MSG) {
                 std::cout << "Voice message sent.\n";
-            } else if (action == "join_call") {
-                std::string group_name;
-                response >> group_name;
-                if (call_thread_.joinable()) call_thread_.join();
-                call_thread_ = std::thread(&ChatCLI::DoCall, this, group_name);
             }
         } else {
-            std::cout << "Command failed with error code "
-                      << static_cast<int>(status) << ": " << status << '\n';
+            PrintError(code);
         }
 
-        responses_arrived_++;
-        cv_.notify_one();
+        ResponseArrived();
     }
 
-    void HandleUpdate(Deserializer& response) {
-        std::string type;
-        response >> type;
-
-        if (type == "whisper") {
-            std::string sender, content;
-            response >> sender >> content;
-            if (sender == username_)
-                return;  // Ignore the message if is sent by the user
-            std::cout << "[whisper] " << sender << ": " << content << '\n';
-        } else if (type == "msg_group") {
-            std::string group_name, sender, content;
-            response >> group_name >> sender >> content;
-            if (sender == username_)
-                return;  // Ignore the message if is sent by the user
-            std::cout << "[" << group_name << "] " << sender << ": " << content
-                      << '\n';
-        } else if (type == "voice_msg") {
-            std::string sender;
-            size_t channels = 1;
-            size_t sample_rate = 44100;
-            std::vector<int16_t> samples;
-            response >> sender >> channels >> sample_rate >> samples;
-            last_voice_msg_.loadFromSamples(samples.data(), samples.size(),
-                                            channels, sample_rate);
-            std::cout << "[ALERT] " << sender
-                      << " sent you a voice message, /play to listen it."
-                      << '\n';
-        } else if (outgoing_call_ && type == "call_data") {
-            std::string sender;
-            std::vector<int16_t> samples;
-            response >> sender >> samples;
-            call_samples_.push({sender, std::move(samples)});
+    void HandleLogin(const LoginResponse& response) {
+        if (response.code == ServerCodes::SUCCESS) {
+            username_ = response.username;
+            token_ = response.token;
+            compression_ = response.compression;
+            std::cout << "User " << username_ << " successfully logged in.\n";
+            std::cout << "Token: " << token_.ToString() << '\n';
+        } else {
+            PrintError(response.code);
         }
+
+        ResponseArrived();
+    }
+
+    void HandleJoinCall(const JoinCallResponse& response) {
+        if (response.code == ServerCodes::SUCCESS) {
+            if (call_thread_.joinable()) call_thread_.join();
+            call_thread_ =
+                std::thread(&ChatCLI::DoCall, this, response.group_name);
+        } else {
+            PrintError(response.code);
+        }
+
+        ResponseArrived();
+    }
+
+    void HandleHistory(const HistoryResponse& response) {
+        if (response.code == ServerCodes::SUCCESS) {
+            if (response.more) std::cout << "...\n";
+            PrintMessages(response.group, response.name, response.messages);
+        } else {
+            PrintError(response.code);
+        }
+
+        ResponseArrived();
+    }
+
+    void HandleSearch(const SearchResponse& response) {
+        if (response.code != ServerCodes::SUCCESS) {
+            PrintError(response.code);
+        } else if (response.messages.empty()) {
+            std::cout << "No messages match '" << response.query << "'.\n";
+        } else {
+            if (response.more) std::cout << "...\n";
+            PrintMessages(response.group, response.name, response.messages);
+        }
+
+        ResponseArrived();
+    }
+
+    void PrintMessages(bool group, const std::string& name,
+                       const std::vector<HistoryMessage>& messages) {
+        for (const HistoryMessage& message : messages) {
+            if (group) {
+                std::cout << "[" << name << "] ";
+            } else {
+                std::cout << "[whisper] ";
+            }
+            std::cout << message.sender << ": " << message.content << '\n';
+        }
+    }
+
+    void HandleWhisper(const WhisperUpdate& update) {
+        if (update.sender == username_)
+            return;  // Ignore the message if is sent by the user
+        std::cout << "[whisper] " << update.sender << ": " << update.content
+                  << '\n';
+    }
+
+    void HandleMessageGroup(const MessageGroupUpdate& update) {
+        if (update.sender == username_)
+            return;  // Ignore the message if is sent by the user
+        std::cout << "[" << update.group_name << "] " << update.sender << ": "
+                  << update.content << '\n';
+    }
+
+    void HandleVoiceMessage(VoiceMessageUpdate& update) {
+        last_voice_msg_.loadFromSamples(
+            update.samples.data(), update.samples.size(),
+            static_cast<unsigned int>(update.channels),
+            static_cast<unsigned int>(update.sample_rate));
+        std::cout << "[ALERT] " << update.sender
+                  << " sent you a voice message, /play to listen it." << '\n';
+    }
+
+    void HandleCallData(CallDataUpdate& update) {
+        if (!outgoing_call_) return;
+        call_samples_.push({update.sender, std::move(update.samples)});
+    }
+
+    void PrintError(ServerCodes code) {
+        std::cout << "Command failed with error code " << static_cast<int>(code)
+                  << ": " << code << '\n';
+    }
+
+    void ResponseArrived() {
+        {
+            std::lock_guard<std::mutex> lk(cv_mutex_);
+            responses_arrived_++;
+        }
+        cv_.notify_one();
     }
 
 private:
@@ -527,11 +738,18 @@ private:
 #define fileno _fileno
 #endif
 
-int main(/*int argc, char* argv[]*/) {
+int main(int argc, char* argv[]) {
+    std::string endpoint = "tcp://localhost:4242";
+    TakeOption(argc, argv, "--endpoint", endpoint);
+
+    if (argc != 1 || !IsValidEndpoint(endpoint)) {
+        std::cout << "usage: " << argv[0] << " [--endpoint ENDPOINT]\n";
+        return 1;
+    }
+
     // The state of the client aplication
-    std::string ip = "localhost";
-    size_t port = 4242;
-    ChatCLI client(ip, port);
+    trace::Tracer::Instance().Initialize("Chat_Client");
+    ChatCLI client(endpoint);
 
     std::signal(SIGINT, gSignalHandler);
     std::signal(SIGTERM, gSignalHandler);
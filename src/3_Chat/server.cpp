@@ -1,19 +1,25 @@
-#include <cassert>
 #include <csignal>
+#include <cstdint>
 
+#include <algorithm>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
 
-#include <Util/Serializer.hpp>
-#include <Util/UUID.hpp>
+#include <Util/AllocationHooks.hpp>
+#include <Util/FileSystem.hpp>
+#include <Util/Log.hpp>
+#include <Util/Options.hpp>
+#include <Util/Trace.hpp>
 #include <Util/ZMQWrapper.hpp>
 
-#include "ServerCodes.hpp"
-
-// TODO: Check if incomming parameters are valid
+#include "ChatServer.hpp"
+#include "DurableStore.hpp"
+#include "HistoryStore.hpp"
+#include "OfflineInbox.hpp"
+#include "OutboundQueues.hpp"
+#include "ShardedServer.hpp"
 
 static volatile std::sig_atomic_t gSignalStatus = 0;
 
@@ -21,633 +27,248 @@ static void gSignalHandler(int signal_value) {
     gSignalStatus = signal_value;
 }
 
-using NetIdentity = std::string;
-
-class User {
-public:
-    User() {}
-
-    User(const std::string& username, const std::string& password)
-          : username_(username), password_(password) {}
-
-    const std::string& GetUsername() const {
-        return username_;
-    }
-
-    bool IsPassword(const std::string& password) const {
-        return password_ == password;
-    }
-
-    bool AddContact(const std::string& user) {
-        return contacts_.insert(user).second;
-    }
-
-private:
-    std::string username_;
-    std::string password_;
-    std::unordered_set<std::string> contacts_;
-};
-
-class Group {
-public:
-    using MemberSet = std::unordered_set<std::string>;
-
-public:
-    Group() {}
-
-    Group(const std::string& name, const std::string& owner)
-          : name_(name), owner_(owner) {}
-
-    bool AddMember(const std::string& username) {
-        return members_.insert(username).second;
-    }
-
-    bool RemoveMember(const std::string& username) {
-        return members_.erase(username) > 0;
-    }
-
-    bool IsMember(const std::string& username) const {
-        auto it = members_.find(username);
-        return it != members_.end();
-    }
-
-    const std::string& GetName() const {
-        return name_;
-    }
-
-    const MemberSet& GetMembers() const {
-        return members_;
-    }
-
-private:
-    std::string name_;
-    std::string owner_;
-    MemberSet members_;
-};
-
-class DataBase {
-public:
-    User& AddUser(User&& user) {
-        return users_[user.GetUsername()] = user;
-    }
-
-    Group& AddGroup(Group&& group) {
-        return groups_[group.GetName()] = group;
-    }
-
-    User& GetUser(const std::string& username) {
-        return users_.find(username)->second;
-    }
-
-    Group& GetGroup(const std::string& group_name) {
-        return groups_.find(group_name)->second;
-    }
-
-    bool UserExists(const std::string& username) const {
-        auto it = users_.find(username);
-        return it != users_.end();
-    }
-
-    bool GroupExists(const std::string& group_name) const {
-        auto it = groups_.find(group_name);
-        return it != groups_.end();
-    }
+// The signals may be delivered to a shard thread, so the front-end wakes up
+// periodically to check them
+static const long kSignalCheckMs = 100;
 
-private:
-    std::unordered_map<std::string, User> users_;
-    std::unordered_map<std::string, Group> groups_;
+// Where the database is stored, in memory if the directory is empty. The
+// offline inbox and the history are only kept with a directory.
+struct StorageOptions {
+    std::string directory;
+    uint64_t snapshot_interval;
+    InboxLimits inbox;
 };
 
-struct UserConnection {
-    UserConnection() = default;
-    UserConnection(User* user, std::string token,
-                   std::vector<NetIdentity>&& identities)
-          : user(user), token(token), identities(identities) {}
-    User* user;
-    std::string token;
-    std::string current_call;
-    std::vector<NetIdentity> identities;
-};
-
-struct GroupCall {
-    GroupCall() = default;
-    GroupCall(Group* group, std::unordered_set<std::string>&& participants)
-          : group(group), participants(participants) {}
-    Group* group;
-    std::unordered_set<std::string> participants;
-};
-
-class ServerState {
-public:
-    ServerState(zmqw::socket& socket, DataBase& db)
-          : socket_(socket), database_(db) {}
-
-    zmqw::socket& GetSocket() {
-        return socket_;
-    }
-
-    ServerCodes Register(const std::string& username,
-                         const std::string& password) {
-        if (database_.UserExists(username))
-            return ServerCodes::USER_ALREADY_EXIST;
-        database_.AddUser({username, password});
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes Login(const NetIdentity& identity, const std::string& username,
-                      const std::string& password) {
-        // Check if an user is already connected with this identity
-        if (IdentityConnected(identity))
-            return ServerCodes::IDENTITY_ALREADY_CONNECTED;
-
-        // Check if the user exist in the database
-        if (!database_.UserExists(username))
-            return ServerCodes::USER_DOES_NOT_EXIST;
-
-        // Check if the user password match
-        User* user = &database_.GetUser(username);
-        if (!user->IsPassword(password))
-            return ServerCodes::USER_WRONG_PASSWORD;
-
-        // Add the identity to the ServerState set
-        identities_.insert(identity);
-
-        if (UserConnected(username)) {
-            // Add the new user identity user
-            users_[username].identities.push_back(identity);
-        } else {
-            // Add the user to the server and register its identity
-            users_[username] =
-                UserConnection(user, UUID::UUID4().AsString(), {identity});
-        }
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes Logout(const NetIdentity& identity,
-                       const std::string& username) {
-        // Check if the identity is not connected
-        if (!IdentityConnected(identity))
-            return ServerCodes::IDENTITY_ALREADY_CONNECTED;
-
-        // Check is the user is not connected
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        // Check if the user own the identity
-        std::vector<NetIdentity>& identities = users_[username].identities;
-        auto it = std::find(identities.begin(), identities.end(), identity);
-        if (it == identities.end()) return ServerCodes::USER_INCORRECT_IDENTITY;
-
-        identities.erase(it);         // Remove from the user identities
-        identities_.erase(identity);  // Remove from the server identities
-
-        // If identities left in the server remove the user
-        if (identities.empty() && identities_.count(identity) == 0) {
-            users_.erase(username);
-        }
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes AddContact(const std::string& username,
-                           const std::string& token,
-                           const std::string& contact) {
-        // Check if the user exist in the database
-        if (!database_.UserExists(username) || !database_.UserExists(contact))
-            return ServerCodes::USER_DOES_NOT_EXIST;
-
-        // Check if the user or contact are not conected
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        User& user = GetUser(username);
-        user.AddContact(contact);
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes Whisper(const std::string& username, const std::string& token,
-                        const std::string& recipient,
-                        const std::string& content) {
-        if (!UserConnected(username) || !UserConnected(recipient))
-            return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
+// Waits until a socket is readable, at most the timeout or until the
+// outbound queues have to be flushed
+static long PollTimeout(const OutboundQueues& outbound, long timeout) {
+    if (!outbound.HasPending()) return timeout;
+    long flush = OutboundQueues::kFlushIntervalMs;
+    return timeout < 0 ? flush : std::min(timeout, flush);
+}
 
-        Serializer update;
-        update << ("update") << ("whisper") << username << content;
-        for (auto& identity : GetIdentities(recipient)) {
-            socket_.send(identity, ZMQ_SNDMORE);
-            socket_.send(update);
+// Serves the clients with a single thread
+static int RunServer(zmq::context_t& context, zmqw::socket& socket,
+                     zmqw::socket& stats_socket,
+                     const StorageOptions& storage,
+                     const OutboundLimits& limits) {
+    // Create the database, loaded from the data directory if there is one
+    DataBase database;
+    std::unique_ptr<DurableStore> store;
+    std::unique_ptr<OfflineInbox> inbox;
+    std::unique_ptr<HistoryStore> history;
+    std::unique_ptr<HistoryWriter> history_writer;
+    if (!storage.directory.empty()) {
+        std::string other = FindOtherShardsData(storage.directory, 1);
+        if (!other.empty()) {
+            LOG_ERROR("The data directory has data of a sharded server: "
+                      << fs::JoinPath(storage.directory, other));
+            return 1;
         }
+        store.reset(new DurableStore(context, storage.directory,
+                                     storage.snapshot_interval));
+        if (!store->Open(database)) return 1;
+        inbox.reset(new OfflineInbox(
+            database, fs::JoinPath(storage.directory, "inbox"),
+            storage.inbox));
+        if (!inbox->Open()) return 1;
+        history.reset(new HistoryStore(
+            context, fs::JoinPath(storage.directory, "history")));
+        if (!history->Open()) return 1;
+        history_writer.reset(
+            new HistoryWriter(context, history->GetEndpoint()));
+    }
+
+    // Create and initialize the ServerState, the demo users are only added
+    // the first time
+    OutboundQueues outbound(socket, limits);
+    ServerState state(socket, database);
+    state.SetOutbound(&outbound);
+    state.SetStore(store.get());
+    state.SetInbox(inbox.get());
+    state.SetHistory(history_writer.get());
+    state.Register("edoren", "123");
+    state.Register("pepe", "123");
+    state.Register("grillo", "123");
 
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes CreateGroup(const std::string& username,
-                            const std::string& token,
-                            const std::string& group_name) {
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        if (database_.GroupExists(group_name))
-            return ServerCodes::GROUP_ALREADY_EXIST;
-
-        Group& group = database_.AddGroup({group_name, username});
-        group.AddMember(username);
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes JoinGroup(const std::string& username, const std::string& token,
-                          const std::string& group_name) {
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        if (!database_.GroupExists(group_name))
-            return ServerCodes::GROUP_DOES_NOT_EXIST;
-
-        Group& group = database_.GetGroup(group_name);
-        if (!group.AddMember(username))
-            return ServerCodes::GROUP_MEMBER_ALREADY_EXIST;
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes MessageGroup(const std::string& username,
-                             const std::string& token,
-                             const std::string& group_name,
-                             const std::string& content) {
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        if (!database_.GroupExists(group_name))
-            return ServerCodes::GROUP_DOES_NOT_EXIST;
-
-        Group& group = database_.GetGroup(group_name);
-        if (!group.IsMember(username))
-            return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
+    // The commits of the store and the history pages only exist with a
+    // data directory
+    zmq::pollitem_t items[] = {
+        {static_cast<void*>(socket), 0, ZMQ_POLLIN, 0},
+        {static_cast<void*>(stats_socket), 0, ZMQ_POLLIN, 0},
+        {store ? static_cast<void*>(store->GetCommits()) : nullptr, 0,
+         ZMQ_POLLIN, 0},
+        {history ? static_cast<void*>(history->GetReplies()) : nullptr, 0,
+         ZMQ_POLLIN, 0}};
+    int num_items = store ? 4 : 2;
 
-        Serializer update;
-        update << ("update") << ("msg_group") << group_name << username
-               << content;
-        for (auto& member : group.GetMembers()) {
-            if (UserConnected(member)) {
-                for (auto& identity : GetIdentities(member)) {
-                    socket_.send(identity, ZMQ_SNDMORE);
-                    socket_.send(update);
-                }
+    while (true) {
+        try {
+            zmq::poll(items, num_items, PollTimeout(outbound, -1));
+            outbound.Flush();
+            if (items[2].revents & ZMQ_POLLIN) {
+                state.ReleaseCommitted();
             }
+            if (items[3].revents & ZMQ_POLLIN) {
+                history->ForwardReplies(outbound);
+            }
+            if (items[0].revents & ZMQ_POLLIN) {
+                DispatchPending(state);
+            }
+            state.DisconnectSlowConsumers();
+            if (items[1].revents & ZMQ_POLLIN) {
+                ServeStats(stats_socket, state, history.get());
+            }
+        } catch (zmq::error_t& e) {
         }
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes SendVoiceMessage(const std::string& username,
-                                 const std::string& token,
-                                 const std::string& recipient, size_t channels,
-                                 size_t sample_rate,
-                                 const std::vector<int16_t>& samples) {
-        if (!UserConnected(username) || !UserConnected(recipient))
-            return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        Serializer update;
-        update << ("update") << ("voice_msg") << username << channels
-               << sample_rate << samples;
-        for (auto& identity : GetIdentities(recipient)) {
-            socket_.send(identity, ZMQ_SNDMORE);
-            socket_.send(update);
-        }
-
-        return ServerCodes::SUCCESS;
-    }
-
-    ServerCodes JoinCall(const std::string& username, const std::string& token,
-                         const std::string& group_name) {
-        if (!UserConnected(username)) return ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return ServerCodes::USER_INCORRECT_TOKEN;
-
-        if (!database_.GroupExists(group_name))
-            return ServerCodes::GROUP_DOES_NOT_EXIST;
-
-        Group& group = database_.GetGroup(group_name);
-        if (!group.IsMember(username))
-            return ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST;
-
-        auto it = group_calls_.find(group_name);
-        if (it == group_calls_.end()) {
-            group_calls_[group_name] = GroupCall(&group, {username});
-        } else {
-            group_calls_[group_name].participants.insert(username);
+        if (gSignalStatus) {
+            LOG_INFO("Interrupt signal received, killing server...");
+            break;
         }
-
-        return ServerCodes::SUCCESS;
     }
 
-    void ProcessGroupCallData(const std::string& username,
-                              const std::string& token,
-                              const std::string& group_name,
-                              const std::vector<int16_t>& samples) {
-        if (!UserConnected(username))
-            return;  // ServerCodes::USER_NOT_CONNECTED;
-
-        if (GetToken(username) != token)
-            return;  // ServerCodes::USER_INCORRECT_TOKEN
-
-        if (!GroupCallExist(group_name))
-            return;  // ServerCodes::GROUP_DOES_NOT_EXIST
-
-        GroupCall& group_call = GetGroupCall(group_name);
-        Group& group = *group_call.group;
-        auto& participants = group_call.participants;
-
-        if (!group.IsMember(username))
-            return;  // ServerCodes::GROUP_MEMBER_DOES_NOT_EXIST
+    lz::Context& compression = socket.GetCompression();
+    LOG_INFO("Compressed " << compression.Compressed() << " updates, "
+                           << compression.BytesIn() << " bytes to "
+                           << compression.BytesOut() << " bytes");
+    return 0;
+}
 
-        Serializer update;
-        update << ("update") << ("call_data") << username << samples;
+// Serves the clients with a front-end thread and a thread per shard, see
+// ShardedServer.hpp
+static int RunShardedServer(zmq::context_t& context, zmqw::socket& socket,
+                            zmqw::socket& stats_socket, size_t num_shards,
+                            const StorageOptions& storage,
+                            const OutboundLimits& limits) {
+    ShardedServer server(context, num_shards);
+    if (!storage.directory.empty() &&
+        !server.Open(storage.directory, storage.snapshot_interval,
+                     storage.inbox)) {
+        return 1;
+    }
+    server.Register("edoren", "123");
+    server.Register("pepe", "123");
+    server.Register("grillo", "123");
+    server.Start();
+    LOG_INFO("Running " << num_shards << " shards");
+
+    OutboundQueues queues(socket, limits);
+    zmqw::socket& outbound = server.GetOutbound();
+    HistoryStore* history = server.GetHistory();
+    zmq::pollitem_t items[] = {
+        {static_cast<void*>(socket), 0, ZMQ_POLLIN, 0},
+        {static_cast<void*>(outbound), 0, ZMQ_POLLIN, 0},
+        {static_cast<void*>(stats_socket), 0, ZMQ_POLLIN, 0},
+        {history ? static_cast<void*>(history->GetReplies()) : nullptr, 0,
+         ZMQ_POLLIN, 0}};
+    int num_items = history ? 4 : 3;
 
-        for (auto& member : group.GetMembers()) {
-            // Check if member is not the user who send the data, is connected
-            // and is participant of the group call
-            if (member != username && UserConnected(member) &&
-                participants.find(member) != participants.end()) {
-                for (auto& identity : GetIdentities(member)) {
-                    socket_.send(identity, ZMQ_SNDMORE);
-                    socket_.send(update);
-                }
+    while (true) {
+        try {
+            zmq::poll(items, num_items, PollTimeout(queues, kSignalCheckMs));
+            queues.Flush();
+            if (items[0].revents & ZMQ_POLLIN) {
+                server.RoutePending(socket);
             }
+            if (items[1].revents & ZMQ_POLLIN) {
+                server.ForwardPending(queues);
+            }
+            if (items[3].revents & ZMQ_POLLIN) {
+                history->ForwardReplies(queues);
+            }
+            server.DisconnectSlowConsumers(queues);
+            server.ServeStats(stats_socket, queues);
+        } catch (zmq::error_t& e) {
+        }
+        if (gSignalStatus) {
+            LOG_INFO("Interrupt signal received, killing server...");
+            break;
         }
-
-        return;  // ServerCodes::SUCCESS
-    }
-
-    bool UserConnected(const std::string& username) const {
-        auto it = users_.find(username);
-        return (it != users_.end());
-    }
-
-    bool GroupCallExist(const std::string& group_name) const {
-        auto it = group_calls_.find(group_name);
-        return (it != group_calls_.end());
-    }
-
-    bool IdentityConnected(const NetIdentity& identity) {
-        auto it = identities_.find(identity);
-        return (it != identities_.end());
-    }
-
-    User& GetUser(const std::string& username) {
-        return *users_.find(username)->second.user;
-    }
-
-    GroupCall& GetGroupCall(const std::string& group_name) {
-        return group_calls_.find(group_name)->second;
-    }
-
-    const std::string& GetToken(const std::string& username) {
-        return users_.find(username)->second.token;
-    }
-
-    const std::vector<NetIdentity>& GetIdentities(
-        const std::string& username) const {
-        return users_.find(username)->second.identities;
-    }
-
-private:
-    // Server socket
-    zmqw::socket& socket_;
-
-    // In-Memory storage
-    DataBase& database_;
-
-    // Server state
-    std::unordered_set<NetIdentity> identities_;
-    std::unordered_map<std::string, UserConnection> users_;
-    std::unordered_map<std::string, GroupCall> group_calls_;
-};
-
-void Register(ServerState& server, Deserializer& request,
-              Serializer& response) {
-    std::string username, password;
-    request >> username >> password;
-    ServerCodes result = server.Register(username, password);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[User] '" << username << "' just registered\n";
-    }
-}
-
-void Login(ServerState& server, const NetIdentity& identity,
-           Deserializer& request, Serializer& response) {
-    std::string username, password;
-    request >> username >> password;
-    ServerCodes result = server.Login(identity, username, password);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[User] '" << username << "' joins the chat server\n";
-        response << username << server.GetToken(username);
-    }
-}
-
-void Logout(ServerState& server, const NetIdentity& identity,
-            Deserializer& request, Serializer& response) {
-    std::string username;
-    request >> username;
-    ServerCodes result = server.Logout(identity, username);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[User] '" << username << "' disconected.\n";
-    }
-}
-
-void AddContact(ServerState& server, Deserializer& request,
-                Serializer& response) {
-    std::string username, token, contact;
-    request >> username >> token >> contact;
-    ServerCodes result = server.AddContact(username, token, contact);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[User] '" << username << "' added '" << contact << "'\n";
-    }
-}
-
-void Whisper(ServerState& server, Deserializer& request, Serializer& response) {
-    std::string username, token, recipient, content;
-    request >> username >> token >> recipient >> content;
-    ServerCodes result = server.Whisper(username, token, recipient, content);
-    response << result;
-}
-
-void CreateGroup(ServerState& server, Deserializer& request,
-                 Serializer& response) {
-    std::string username, token, group_name;
-    request >> username >> token >> group_name;
-    ServerCodes result = server.CreateGroup(username, token, group_name);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[Group] '" << group_name << "' created, owner '"
-                  << username << "'\n";
-    }
-}
-
-void JoinGroup(ServerState& server, Deserializer& request,
-               Serializer& response) {
-    std::string username, token, group_name;
-    request >> username >> token >> group_name;
-    ServerCodes result = server.JoinGroup(username, token, group_name);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        std::cout << "[Group] '" << username << "' just joined '" << group_name
-                  << "'\n";
-    }
-}
-
-void MessageGroup(ServerState& server, Deserializer& request,
-                  Serializer& response) {
-    std::string username, token, group_name, content;
-    request >> username >> token >> group_name >> content;
-    ServerCodes result =
-        server.MessageGroup(username, token, group_name, content);
-    response << result;
-}
-
-void SendVoiceMessage(ServerState& server, Deserializer& request,
-                      Serializer& response) {
-    std::string username, token, recipient;
-    size_t channels, sample_rate;
-    std::vector<int16_t> samples;
-    request >> username >> token >> recipient >> channels >> sample_rate >>
-        samples;
-    ServerCodes result = server.SendVoiceMessage(
-        username, token, recipient, channels, sample_rate, samples);
-    response << result;
-}
-
-void JoinCall(ServerState& server, Deserializer& request,
-              Serializer& response) {
-    std::string username, token, group_name;
-    request >> username >> token >> group_name;
-    ServerCodes result = server.JoinCall(username, token, group_name);
-    response << result;
-    if (result == ServerCodes::SUCCESS) {
-        response << group_name;
     }
-}
 
-void ProcessGroupCallData(ServerState& server, Deserializer& update) {
-    std::string username, token, group_name;
-    std::vector<int16_t> samples;
-    update >> username >> token >> group_name >> samples;
-    server.ProcessGroupCallData(username, token, group_name, samples);
+    server.Stop();
+    return 0;
 }
 
-void Dispatch(ServerState& server) {
-    std::string identity;
-    Deserializer message;
-
+int main(int argc, char* argv[]) {
+    std::string endpoint = "tcp://*:4242";
+    std::string stats_endpoint = "tcp://*:4243";
+    std::string shards_option = "1";
+    std::string snapshot_option = "10000";
+    std::string retention_option = "604800";
+    std::string max_messages_option = "10000";
+    std::string max_bytes_option = "67108864";
+    std::string outbound_messages_option = "4096";
+    std::string outbound_bytes_option = "16777216";
+    std::string slow_timeout_option = "10000";
+    StorageOptions storage;
+    OutboundLimits outbound;
+    TakeOption(argc, argv, "--endpoint", endpoint);
+    TakeOption(argc, argv, "--stats-endpoint", stats_endpoint);
+    TakeOption(argc, argv, "--shards", shards_option);
+    TakeOption(argc, argv, "--data-dir", storage.directory);
+    TakeOption(argc, argv, "--snapshot-interval", snapshot_option);
+    TakeOption(argc, argv, "--inbox-retention", retention_option);
+    TakeOption(argc, argv, "--inbox-max-messages", max_messages_option);
+    TakeOption(argc, argv, "--inbox-max-bytes", max_bytes_option);
+    TakeOption(argc, argv, "--outbound-max-messages",
+               outbound_messages_option);
+    TakeOption(argc, argv, "--outbound-max-bytes", outbound_bytes_option);
+    TakeOption(argc, argv, "--slow-consumer-timeout", slow_timeout_option);
+
+    size_t num_shards = 0;
+    storage.snapshot_interval = 0;
     try {
-        server.GetSocket().recv(identity);
-        server.GetSocket().recv(message);
+        num_shards = std::stoul(shards_option);
+        storage.snapshot_interval = std::stoull(snapshot_option);
+        storage.inbox.retention_seconds = std::stoull(retention_option);
+        storage.inbox.max_messages = std::stoul(max_messages_option);
+        storage.inbox.max_bytes = std::stoul(max_bytes_option);
+        outbound.max_messages = std::stoul(outbound_messages_option);
+        outbound.max_bytes = std::stoul(outbound_bytes_option);
+        outbound.slow_timeout_ms = std::stoull(slow_timeout_option);
     } catch (std::exception& e) {
-        if (gSignalStatus) return;
-        std::cerr << e.what() << '\n';
-        std::cerr << "Error receiving data.\n";
-        return;
+        num_shards = 0;
     }
 
-    std::string msg_type;
-    std::string action;
-    try {
-        message >> msg_type;
-        message >> action;
-    } catch (std::exception& e) {
-        std::cerr << e.what() << '\n';
-        std::cerr << "Error unpacking data, maybe not a valid message.\n";
-        return;
+    if (argc != 1 || num_shards == 0 || storage.snapshot_interval == 0 ||
+        !IsValidEndpoint(endpoint) || !IsValidEndpoint(stats_endpoint)) {
+        std::cout << "usage: " << argv[0]
+                  << " [--endpoint ENDPOINT] [--stats-endpoint ENDPOINT]"
+                     " [--shards N] [--data-dir DIR]"
+                     " [--snapshot-interval RECORDS]"
+                     " [--inbox-retention SECONDS]"
+                     " [--inbox-max-messages N] [--inbox-max-bytes BYTES]"
+                     " [--outbound-max-messages N]"
+                     " [--outbound-max-bytes BYTES]"
+                     " [--slow-consumer-timeout MS]\n";
+        return 1;
     }
 
-    if (msg_type == "request") {
-        Serializer response;
-        response << "response" << action;
-
-        if (action == "register") {
-            Register(server, message, response);
-        } else if (action == "login") {
-            Login(server, identity, message, response);
-        } else if (action == "logout") {
-            Logout(server, identity, message, response);
-        } else if (action == "add_contact") {
-            AddContact(server, message, response);
-        } else if (action == "whisper") {
-            Whisper(server, message, response);
-        } else if (action == "create_group") {
-            CreateGroup(server, message, response);
-        } else if (action == "join_group") {
-            JoinGroup(server, message, response);
-        } else if (action == "msg_group") {
-            MessageGroup(server, message, response);
-        } else if (action == "voice_msg") {
-            SendVoiceMessage(server, message, response);
-        } else if (action == "join_call") {
-            JoinCall(server, message, response);
-        } else {
-            return;
-        }
-
-        server.GetSocket().send(identity, ZMQ_SNDMORE);
-        server.GetSocket().send(response);
-    } else if (msg_type == "update") {
-        if (action == "call_data") {
-            ProcessGroupCallData(server, message);
-        }
-    }
-}
-
-int main(/*int argc, char* argv[]*/) {
     zmq::context_t context(1);
 
     // Create the listening
     zmqw::socket socket(context, ZMQ_ROUTER);
-    socket.bind("tcp://*:4242");
+    LOG_INFO("Binding to " << endpoint << "...");
+    socket.bind(endpoint);
 
-    std::signal(SIGINT, gSignalHandler);
-    std::signal(SIGTERM, gSignalHandler);
+    // Any request to this socket is replied with the server statistics
+    zmqw::socket stats_socket(context, ZMQ_REP);
+    stats_socket.bind(stats_endpoint);
 
-    // Create the in memory database
-    DataBase database;
+    trace::Tracer::Instance().Initialize("Chat_Server");
 
-    // Create and initialize the ServerState\n;
-    ServerState state(socket, database);
-    state.Register("edoren", "123");
-    state.Register("pepe", "123");
-    state.Register("grillo", "123");
+    std::signal(SIGINT, gSignalHandler);
+    std::signal(SIGTERM, gSignalHandler);
 
-    while (true) {
-        try {
-            Dispatch(state);
-        } catch (zmq::error_t& e) {
-        }
-        if (gSignalStatus) {
-            std::cout << "\nInterrupt signal received, killing server...\n";
-            break;
-        }
+    int result = 0;
+    if (num_shards == 1) {
+        result = RunServer(context, socket, stats_socket, storage, outbound);
+    } else {
+        result = RunShardedServer(context, socket, stats_socket, num_shards,
+                                  storage, outbound);
     }
 
-    std::cout << "Server closed.\n";
-    return gSignalStatus;
+    LOG_INFO("Server closed.");
+    return result != 0 ? result : gSignalStatus;
 }
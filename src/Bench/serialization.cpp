@@ -0,0 +1,518 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.hpp>
+
+#include <3_Chat/Protocol.hpp>
+#include <Util/Matrix.hpp>
+#include <Util/Schema.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+using Clock = std::chrono::steady_clock;
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+// Every operator new of the process is counted, including the ones of the
+// echo thread in the round trips. ZMQ allocates with malloc, so its own
+// allocations are not included.
+///////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<uint64_t> g_allocations(0);
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size > 0 ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+// Keeps the compiler from removing the benchmarked code
+static volatile size_t g_sink;
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+///////////////////////////////////////////////////////////////////////////////
+
+struct BenchOptions {
+    double min_time = 0.5;  // seconds per benchmark
+    std::string filter;
+    std::string transports = "inproc,ipc,tcp";
+};
+
+struct Benchmark {
+    std::string name;
+    size_t bytes;                     // Size of the frame of each operation
+    std::function<void(size_t)> run;  // Runs the given number of operations
+};
+
+// The chat messages are framed with their tag like in the chat server, the
+// other values are packed on their own like in the MatrixOps server
+struct MessageCodec {
+    template <typename Message>
+    static void Encode(Serializer& output, const Message& message) {
+        Pack(output, message);
+    }
+
+    template <typename Message>
+    static void Decode(Deserializer& input, Message& message) {
+        uint8_t tag;
+        input >> tag;
+        Unpack(input, message);
+    }
+};
+
+struct ValueCodec {
+    template <typename T>
+    static void Encode(Serializer& output, const T& value) {
+        output << value;
+    }
+
+    template <typename T>
+    static void Decode(Deserializer& input, T& value) {
+        input >> value;
+    }
+};
+
+template <typename Codec, typename T>
+std::string Encode(const T& value) {
+    Serializer output;
+    Codec::Encode(output, value);
+    return std::string(output.data(), output.size());
+}
+
+template <typename Codec, typename T>
+Benchmark PackBench(const std::string& name, const T& value) {
+    auto hint = std::make_shared<CapacityHint>();
+    size_t bytes = Encode<Codec>(value).size();
+    return {"pack " + name, bytes, [hint, value](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++) {
+                    Serializer output(*hint);
+                    Codec::Encode(output, value);
+                    g_sink += output.size();
+                }
+            }};
+}
+
+// Decodes the frame of value as a Result, the frame is wrapped in a
+// zmq::message_t without copying it like a received message
+template <typename Codec, typename Result, typename T>
+Benchmark UnpackBench(const std::string& name, const T& value) {
+    auto frame = std::make_shared<std::string>(Encode<Codec>(value));
+    return {"unpack " + name, frame->size(), [frame](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++) {
+                    zmq::message_t msg(&(*frame)[0], frame->size(), nullptr);
+                    Deserializer input(std::move(msg));
+                    Result result;
+                    Codec::Decode(input, result);
+                    g_sink += input.AtEnd();
+                }
+            }};
+}
+
+template <typename Codec, typename T>
+void AddCodecBenches(std::vector<Benchmark>& benchmarks,
+                     const std::string& name, const T& value) {
+    benchmarks.push_back(PackBench<Codec>(name, value));
+    benchmarks.push_back(UnpackBench<Codec, T>(name, value));
+}
+
+// Packs the value, sends it to the echo server, receives it back and
+// unpacks it
+template <typename Codec, typename T>
+Benchmark RoundTripBench(const std::string& name, zmqw::socket& client,
+                         const T& value) {
+    auto hint = std::make_shared<CapacityHint>();
+    size_t bytes = Encode<Codec>(value).size();
+    return {name, bytes, [hint, &client, value](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++) {
+                    Serializer output(*hint);
+                    Codec::Encode(output, value);
+                    client.send(std::move(output));
+
+                    Deserializer input;
+                    client.recv(input);
+                    T result;
+                    Codec::Decode(input, result);
+                    g_sink += input.AtEnd();
+                }
+            }};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Echo server
+// Sends back every frame it receives from a thread, like a server that
+// doesn't do any work. An empty frame stops it.
+///////////////////////////////////////////////////////////////////////////////
+
+class EchoServer {
+public:
+    EchoServer(zmq::context_t& context, const std::string& transport)
+          : context_(context), socket_(context, ZMQ_ROUTER) {
+        if (transport == "inproc") {
+            socket_.bind("inproc://serialization_bench");
+        } else if (transport == "tcp") {
+            socket_.bind("tcp://127.0.0.1:*");
+        } else {
+            socket_.bind(transport + "://*");
+        }
+
+        char endpoint[256];
+        size_t size = sizeof(endpoint);
+        socket_.getsockopt(ZMQ_LAST_ENDPOINT, endpoint, &size);
+        endpoint_.assign(endpoint, size > 0 ? size - 1 : 0);
+
+        thread_ = std::thread(&EchoServer::Run, this);
+    }
+
+    ~EchoServer() {
+        zmq::socket_t stop(context_, ZMQ_DEALER);
+        stop.connect(endpoint_);
+        stop.send("", 0);
+        thread_.join();
+    }
+
+    const std::string& GetEndpoint() const {
+        return endpoint_;
+    }
+
+private:
+    void Run() {
+        while (true) {
+            zmq::message_t identity, payload;
+            socket_.recv(&identity);
+            socket_.recv(&payload);
+            if (payload.size() == 0) break;
+            socket_.send(identity, ZMQ_SNDMORE);
+            socket_.send(payload);
+        }
+    }
+
+private:
+    zmq::context_t& context_;
+    zmq::socket_t socket_;
+    std::string endpoint_;
+    std::thread thread_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Test data
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t kSampleSizes[] = {256, 4096, 65536};
+static const size_t kMatrixSizes[] = {4, 32, 256};
+
+std::vector<int16_t> MakeSamples(size_t size) {
+    // A 440Hz tone, the samples use all the integer sizes of MessagePack
+    std::vector<int16_t> samples(size);
+    for (size_t i = 0; i < size; i++) {
+        samples[i] = static_cast<int16_t>(
+            8000 * std::sin(2 * 3.14159265 * 440 * i / 44100.0));
+    }
+    return samples;
+}
+
+Matrix<float> MakeMatrix(size_t size) {
+    Matrix<float> matrix(size, size);
+    std::vector<float> data(size * size);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i * 0.5f;
+    matrix.SetData(data);
+    return matrix;
+}
+
+std::vector<Benchmark> CodecBenches() {
+    std::vector<Benchmark> benchmarks;
+
+    std::string username = "username0001";
+    std::string password = "password0001";
+    SessionToken token = SessionToken::Generate();
+    std::string content =
+        "The quick brown fox jumps over the lazy dog, again and again.";
+    std::vector<int16_t> voice_samples = MakeSamples(44100);  // 1s
+    std::vector<int16_t> call_samples = MakeSamples(1024);
+
+    // Requests
+    RegisterRequest register_request;
+    register_request.username = username;
+    register_request.password = password;
+    AddCodecBenches<MessageCodec>(benchmarks, "RegisterRequest",
+                                  register_request);
+
+    LoginRequest login_request;
+    login_request.username = username;
+    login_request.password = password;
+    login_request.compression = true;
+    AddCodecBenches<MessageCodec>(benchmarks, "LoginRequest", login_request);
+
+    LogoutRequest logout_request;
+    logout_request.token = token;
+    AddCodecBenches<MessageCodec>(benchmarks, "LogoutRequest",
+                                  logout_request);
+
+    AddContactRequest add_contact_request;
+    add_contact_request.token = token;
+    add_contact_request.contact = "username0002";
+    AddCodecBenches<MessageCodec>(benchmarks, "AddContactRequest",
+                                  add_contact_request);
+
+    WhisperRequest whisper_request;
+    whisper_request.token = token;
+    whisper_request.recipient = "username0002";
+    whisper_request.content = content;
+    AddCodecBenches<MessageCodec>(benchmarks, "WhisperRequest",
+                                  whisper_request);
+
+    CreateGroupRequest create_group_request;
+    create_group_request.token = token;
+    create_group_request.group_name = "group0001";
+    AddCodecBenches<MessageCodec>(benchmarks, "CreateGroupRequest",
+                                  create_group_request);
+
+    JoinGroupRequest join_group_request;
+    join_group_request.token = token;
+    join_group_request.group_name = "group0001";
+    AddCodecBenches<MessageCodec>(benchmarks, "JoinGroupRequest",
+                                  join_group_request);
+
+    MessageGroupRequest message_group_request;
+    message_group_request.token = token;
+    message_group_request.group_name = "group0001";
+    message_group_request.content = content;
+    AddCodecBenches<MessageCodec>(benchmarks, "MessageGroupRequest",
+                                  message_group_request);
+
+    VoiceMessageRequest voice_request;
+    voice_request.token = token;
+    voice_request.recipient = "username0002";
+    voice_request.samples = voice_samples;
+    AddCodecBenches<MessageCodec>(benchmarks, "VoiceMessageRequest",
+                                  voice_request);
+    benchmarks.push_back(UnpackBench<MessageCodec, RawVoiceMessageRequest>(
+        "RawVoiceMessageRequest", voice_request));
+
+    JoinCallRequest join_call_request;
+    join_call_request.token = token;
+    join_call_request.group_name = "group0001";
+    AddCodecBenches<MessageCodec>(benchmarks, "JoinCallRequest",
+                                  join_call_request);
+
+    SendCallDataUpdate send_call_data;
+    send_call_data.token = token;
+    send_call_data.group_name = "group0001";
+    send_call_data.samples = call_samples;
+    AddCodecBenches<MessageCodec>(benchmarks, "SendCallDataUpdate",
+                                  send_call_data);
+    benchmarks.push_back(UnpackBench<MessageCodec, RawSendCallDataUpdate>(
+        "RawSendCallDataUpdate", send_call_data));
+
+    // Responses
+    AddCodecBenches<MessageCodec>(benchmarks, "StatusResponse",
+                                  StatusResponse<Action::REGISTER>());
+
+    LoginResponse login_response;
+    login_response.token = token;
+    login_response.compression = true;
+    AddCodecBenches<MessageCodec>(benchmarks, "LoginResponse",
+                                  login_response);
+
+    JoinCallResponse join_call_response;
+    join_call_response.group_name = "group0001";
+    AddCodecBenches<MessageCodec>(benchmarks, "JoinCallResponse",
+                                  join_call_response);
+
+    // Updates
+    WhisperUpdate whisper_update;
+    whisper_update.sender = username;
+    whisper_update.content = content;
+    AddCodecBenches<MessageCodec>(benchmarks, "WhisperUpdate",
+                                  whisper_update);
+
+    MessageGroupUpdate message_group_update;
+    message_group_update.group_name = "group0001";
+    message_group_update.sender = username;
+    message_group_update.content = content;
+    AddCodecBenches<MessageCodec>(benchmarks, "MessageGroupUpdate",
+                                  message_group_update);
+
+    VoiceMessageUpdate voice_update;
+    voice_update.sender = username;
+    voice_update.samples = voice_samples;
+    AddCodecBenches<MessageCodec>(benchmarks, "VoiceMessageUpdate",
+                                  voice_update);
+
+    CallDataUpdate call_data_update;
+    call_data_update.sender = username;
+    call_data_update.samples = call_samples;
+    AddCodecBenches<MessageCodec>(benchmarks, "CallDataUpdate",
+                                  call_data_update);
+
+    // Values
+    for (size_t size : kSampleSizes) {
+        std::string name = "samples[" + std::to_string(size) + "]";
+        AddCodecBenches<ValueCodec>(benchmarks, name, MakeSamples(size));
+    }
+    for (size_t size : kMatrixSizes) {
+        std::string name = "matrix[" + std::to_string(size) + "x" +
+                           std::to_string(size) + "]";
+        AddCodecBenches<ValueCodec>(benchmarks, name, MakeMatrix(size));
+    }
+
+    return benchmarks;
+}
+
+std::vector<Benchmark> RoundTripBenches(const std::string& transport,
+                                        zmqw::socket& client) {
+    std::vector<Benchmark> benchmarks;
+    std::string prefix = "round trip " + transport + " ";
+
+    WhisperRequest whisper_request;
+    whisper_request.token = SessionToken::Generate();
+    whisper_request.recipient = "username0002";
+    whisper_request.content = "Hello";
+    benchmarks.push_back(RoundTripBench<MessageCodec>(
+        prefix + "WhisperRequest", client, whisper_request));
+
+    for (size_t size : kSampleSizes) {
+        std::string name = "samples[" + std::to_string(size) + "]";
+        benchmarks.push_back(RoundTripBench<ValueCodec>(
+            prefix + name, client, MakeSamples(size)));
+    }
+    for (size_t size : kMatrixSizes) {
+        std::string name = "matrix[" + std::to_string(size) + "x" +
+                           std::to_string(size) + "]";
+        benchmarks.push_back(RoundTripBench<ValueCodec>(
+            prefix + name, client, MakeMatrix(size)));
+    }
+
+    return benchmarks;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runner
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t kMaxIterations = 1 << 30;
+
+void RunBenchmark(const Benchmark& benchmark, const BenchOptions& options) {
+    // Fill the buffer pool and the capacity hints before measuring
+    benchmark.run(1);
+
+    // Grow the number of iterations until they take the minimum time
+    size_t iterations = 1;
+    while (true) {
+        uint64_t allocations = g_allocations.load();
+        Clock::time_point start = Clock::now();
+        benchmark.run(iterations);
+        double elapsed =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        allocations = g_allocations.load() - allocations;
+
+        if (elapsed >= options.min_time || iterations >= kMaxIterations) {
+            std::cout << std::left << std::setw(48) << benchmark.name
+                      << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(14) << elapsed * 1e9 / iterations
+                      << std::setw(12) << benchmark.bytes
+                      << std::setprecision(2) << std::setw(12)
+                      << static_cast<double>(allocations) / iterations
+                      << std::endl;
+            return;
+        }
+
+        // Aim a bit over the minimum time so the next run is the last one
+        size_t target = elapsed > 0
+                            ? static_cast<size_t>(iterations * 1.2 *
+                                                  options.min_time / elapsed)
+                            : iterations * 100;
+        iterations = std::max(iterations * 2,
+                              std::min(iterations * 100, target));
+    }
+}
+
+void RunBenchmarks(const std::vector<Benchmark>& benchmarks,
+                   const BenchOptions& options) {
+    for (auto& benchmark : benchmarks) {
+        if (benchmark.name.find(options.filter) != std::string::npos) {
+            RunBenchmark(benchmark, options);
+        }
+    }
+}
+
+static const char* HELP = R"(Usage: Serialization_Bench [options]
+    --min-time SECONDS      Minimum duration of each benchmark (default 0.5)
+    --filter TEXT           Only run the benchmarks whose name contains TEXT
+    --transports LIST       Transports of the round trips, empty for none
+                            (default inproc,ipc,tcp)
+)";
+
+bool ParseOptions(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        if (i + 1 >= argc) return false;
+        std::string value(argv[++i]);
+        try {
+            if (option == "--min-time") {
+                options.min_time = std::stod(value);
+            } else if (option == "--filter") {
+                options.filter = value;
+            } else if (option == "--transports") {
+                options.transports = value;
+            } else {
+                return false;
+            }
+        } catch (std::exception& e) {
+            return false;
+        }
+    }
+    return options.min_time > 0;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+
+    if (!ParseOptions(argc, argv, options)) {
+        std::cout << HELP;
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(48) << "Benchmark" << std::right
+              << std::setw(14) << "ns/op" << std::setw(12) << "bytes/op"
+              << std::setw(12) << "allocs/op" << std::endl;
+
+    RunBenchmarks(CodecBenches(), options);
+
+    zmq::context_t context(1);
+    std::stringstream stream(options.transports);
+    std::string transport;
+    while (std::getline(stream, transport, ',')) {
+        EchoServer server(context, transport);
+        zmqw::socket client(context, ZMQ_DEALER);
+        client.setsockopt(ZMQ_LINGER, 0);
+        client.connect(server.GetEndpoint());
+        RunBenchmarks(RoundTripBenches(transport, client), options);
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "EmbeddedServer.hpp"
+
+#include <cerrno>
+#include <sstream>
+#include <utility>
+
+///////////////////////////////////////////////////////////////////////////////
+// EmbeddedServer
+///////////////////////////////////////////////////////////////////////////////
+
+EmbeddedServer::EmbeddedServer(zmq::context_t& context)
+      : context_(context), control_(context, ZMQ_PAIR) {
+    // The address of the object makes the endpoint unique in the context
+    std::ostringstream endpoint;
+    endpoint << "inproc://embedded-control-" << static_cast<void*>(this);
+    control_endpoint_ = endpoint.str();
+    control_.bind(control_endpoint_);
+}
+
+EmbeddedServer::~EmbeddedServer() {
+    Stop();
+}
+
+void EmbeddedServer::Start() {
+    if (IsRunning()) return;
+    thread_ = std::thread(&EmbeddedServer::Run, this);
+}
+
+void EmbeddedServer::Stop() {
+    if (!IsRunning()) return;
+    zmq::socket_t stop(context_, ZMQ_PAIR);
+    stop.connect(control_endpoint_);
+    stop.send("", 0);
+    thread_.join();
+}
+
+void EmbeddedServer::Run() {
+    zmq::pollitem_t items[] = {
+        {static_cast<void*>(GetSocket()), 0, ZMQ_POLLIN, 0},
+        {static_cast<void*>(control_), 0, ZMQ_POLLIN, 0}};
+
+    while (true) {
+        try {
+            zmq::poll(items, 2, -1);
+        } catch (zmq::error_t& e) {
+            if (e.num() == ETERM) break;
+            continue;
+        }
+        if (items[1].revents & ZMQ_POLLIN) {
+            zmq::message_t stop;
+            control_.recv(&stop);
+            break;
+        }
+        if (items[0].revents & ZMQ_POLLIN) HandleMessages();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EmbeddedChatServer
+///////////////////////////////////////////////////////////////////////////////
+
+EmbeddedChatServer::EmbeddedChatServer(zmq::context_t& context,
+                                       const std::string& endpoint)
+      : EmbeddedServer(context),
+        socket_(context, ZMQ_ROUTER),
+        state_(socket_, database_) {
+    socket_.bind(endpoint);
+}
+
+// The thread must be stopped before the members it uses are destroyed
+EmbeddedChatServer::~EmbeddedChatServer() {
+    Stop();
+}
+
+void EmbeddedChatServer::HandleMessages() {
+    DispatchPending(state_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EmbeddedMatrixServer
+///////////////////////////////////////////////////////////////////////////////
+
+EmbeddedMatrixServer::EmbeddedMatrixServer(zmq::context_t& context,
+                                           const std::string& endpoint)
+      : EmbeddedServer(context), socket_(context, ZMQ_REP) {
+    socket_.bind(endpoint);
+}
+
+EmbeddedMatrixServer::~EmbeddedMatrixServer() {
+    Stop();
+}
+
+void EmbeddedMatrixServer::HandleMessages() {
+    zmq::message_t msg;
+    while (socket_.recv(&msg, ZMQ_DONTWAIT)) {
+        AllocationScope allocations;
+        Deserializer request(std::move(msg));
+        Serializer response(response_hint_);
+
+        ProcessRequest(request, response, allocations);
+
+        if (request.WasCompressed()) response.Compress(compression_);
+
+        zmq::message_t reply = response.Release();
+        socket_.send(reply);
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string>
+#include <thread>
+
+#include <zmq.hpp>
+
+#include <2_MatrixOps/MatrixHandlers.hpp>
+#include <3_Chat/ChatServer.hpp>
+#include <Util/Compression.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/ZMQWrapper.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Embedded servers
+// Run the chat and the MatrixOps servers in a thread of the calling process,
+// e.g. for tests and benchmarks that don't want a separate server process.
+// With an inproc endpoint the client must use the same zmq::context_t, the
+// messages are then passed between the threads without the network stack.
+//
+//     zmq::context_t context(1);
+//     EmbeddedChatServer server(context, "inproc://chat");
+//     server.GetState().Register("edoren", "123");
+//     server.Start();
+//
+//     zmqw::socket client(context, ZMQ_DEALER);
+//     client.connect("inproc://chat");
+///////////////////////////////////////////////////////////////////////////////
+
+// Runs the loop of a server in its own thread until it is stopped, the
+// server socket is bound by the constructor of the derived class so the
+// clients can connect as soon as it is constructed
+class EmbeddedServer {
+public:
+    virtual ~EmbeddedServer();
+
+    EmbeddedServer(const EmbeddedServer&) = delete;
+    EmbeddedServer& operator=(const EmbeddedServer&) = delete;
+
+    void Start();
+
+    // Waits until the messages being handled are done, the ones still
+    // queued in the socket are not handled
+    void Stop();
+
+    bool IsRunning() const {
+        return thread_.joinable();
+    }
+
+protected:
+    explicit EmbeddedServer(zmq::context_t& context);
+
+    virtual zmq::socket_t& GetSocket() = 0;
+
+    // Called from the server thread when the socket has messages
+    virtual void HandleMessages() = 0;
+
+private:
+    void Run();
+
+private:
+    zmq::context_t& context_;
+    zmq::socket_t control_;  // Receives the stop message
+    std::string control_endpoint_;
+    std::thread thread_;
+};
+
+// Chat server, the state must only be touched before Start or after Stop
+class EmbeddedChatServer : public EmbeddedServer {
+public:
+    EmbeddedChatServer(zmq::context_t& context,
+                       const std::string& endpoint = "inproc://chat");
+    ~EmbeddedChatServer();
+
+    ServerState& GetState() {
+        return state_;
+    }
+
+protected:
+    zmq::socket_t& GetSocket() override {
+        return socket_;
+    }
+
+    void HandleMessages() override;
+
+private:
+    zmqw::socket socket_;
+    DataBase database_;
+    ServerState state_;
+};
+
+// MatrixOps server, it replies the requests with ProcessRequest
+class EmbeddedMatrixServer : public EmbeddedServer {
+public:
+    EmbeddedMatrixServer(zmq::context_t& context,
+                         const std::string& endpoint = "inproc://matrix");
+    ~EmbeddedMatrixServer();
+
+protected:
+    zmq::socket_t& GetSocket() override {
+        return socket_;
+    }
+
+    void HandleMessages() override;
+
+private:
+    zmq::socket_t socket_;
+    CapacityHint response_hint_;
+    lz::Context compression_;
+};
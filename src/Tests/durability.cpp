@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <Util/FileSystem.hpp>
+#include <Util/MappedFile.hpp>
+#include <Util/Serializer.hpp>
+#include <Util/WriteAheadLog.hpp>
+
+#include "3_Chat/DataBase.hpp"
+#include "3_Chat/DurableStore.hpp"
+#include "3_Chat/HistoryStore.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Durability tests
+// Round trips of the write-ahead log and the snapshot of the chat database,
+// and the recovery after a crash that left a torn record or snapshot, also in
+// the history of a conversation.
+///////////////////////////////////////////////////////////////////////////////
+
+static int gFailures = 0;
+
+#define CHECK(condition)                                               \
+    do {                                                               \
+        if (!(condition)) {                                            \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK("     \
+                      << #condition << ") failed" << std::endl;        \
+            gFailures++;                                               \
+        }                                                              \
+    } while (false)
+
+// Empty directory of a test, removed at the end
+class TempDirectory {
+public:
+    TempDirectory() {
+        char path[] = "/tmp/durability-XXXXXX";
+        if (::mkdtemp(path)) path_ = path;
+    }
+
+    ~TempDirectory() {
+        for (auto& name : fs::ListFiles(path_, "")) {
+            fs::RemoveFile(fs::JoinPath(path_, name));
+        }
+        ::rmdir(path_.c_str());
+    }
+
+    const std::string& Path() const {
+        return path_;
+    }
+
+private:
+    std::string path_;
+};
+
+static std::string Payload(uint64_t index) {
+    return "record-" + std::to_string(index) +
+           std::string(index % 37, static_cast<char>('a' + index % 26));
+}
+
+struct ReplayedRecord {
+    uint64_t sequence;
+    std::string payload;
+    WriteAheadLog::Position position;
+};
+
+static std::vector<ReplayedRecord> Replay(const std::string& directory,
+                                          uint64_t after, uint64_t& last) {
+    std::vector<ReplayedRecord> records;
+    WriteAheadLog log(directory);
+    last = log.Replay(after, [&](uint64_t sequence, const char* data,
+                                 size_t size,
+                                 const WriteAheadLog::Position& position) {
+        records.push_back({sequence, std::string(data, size), position});
+    });
+    return records;
+}
+
+// Appends the records and waits until they are durable
+static void AppendRecords(const std::string& directory, uint64_t first,
+                          uint64_t count, bool rotate) {
+    WriteAheadLog log(directory);
+    CHECK(log.Open(first, nullptr));
+    for (uint64_t i = 0; i < count; i++) {
+        std::string payload = Payload(first + i);
+        log.Append(payload.data(), payload.size());
+        if (rotate && i == count / 2) log.Rotate();
+    }
+    log.Close();
+    CHECK(log.DurableSequence() == first + count - 1);
+}
+
+static void TestLogRoundTrip() {
+    TempDirectory directory;
+    AppendRecords(directory.Path(), 1, 1000, true);
+
+    uint64_t last = 0;
+    std::vector<ReplayedRecord> records = Replay(directory.Path(), 0, last);
+    CHECK(last == 1000);
+    CHECK(records.size() == 1000);
+    for (size_t i = 0; i < records.size(); i++) {
+        CHECK(records[i].sequence == i + 1);
+        CHECK(records[i].payload == Payload(i + 1));
+    }
+
+    // The positions point to the payloads in the segments
+    for (const ReplayedRecord& record : records) {
+        WriteAheadLog log(directory.Path());
+        MappedFile file;
+        CHECK(file.Open(log.SegmentPath(record.position.segment)));
+        CHECK(record.position.offset + record.payload.size() <= file.Size());
+        CHECK(std::string(file.Data() + record.position.offset,
+                          record.payload.size()) == record.payload);
+    }
+
+    // Only the records after the sequence are replayed
+    records = Replay(directory.Path(), 600, last);
+    CHECK(last == 1000);
+    CHECK(records.size() == 400);
+    CHECK(!records.empty() && records.front().sequence == 601);
+}
+
+static void TestLogTornRecord() {
+    TempDirectory directory;
+    AppendRecords(directory.Path(), 1, 100, false);
+
+    // A crash in the middle of a write leaves part of a record at the end
+    std::vector<std::string> names = fs::ListFiles(directory.Path(), "wal-");
+    CHECK(names.size() == 1);
+    if (names.size() != 1) return;
+    std::string path = fs::JoinPath(directory.Path(), names.back());
+    MappedFile before;
+    CHECK(before.Open(path));
+    size_t good_size = before.Size();
+    before.Close();
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    const char torn[] = "\x40\x00\x00\x00\x12\x34\x56\x78\x65";
+    CHECK(fs::WriteAll(fd, torn, sizeof(torn) - 1));
+    ::close(fd);
+
+    uint64_t last = 0;
+    std::vector<ReplayedRecord> records = Replay(directory.Path(), 0, last);
+    CHECK(last == 100);
+    CHECK(records.size() == 100);
+
+    MappedFile after;
+    CHECK(after.Open(path));
+    CHECK(after.Size() == good_size);
+    after.Close();
+
+    // The records appended after the recovery are replayed with the others
+    AppendRecords(directory.Path(), last + 1, 50, false);
+    records = Replay(directory.Path(), 0, last);
+    CHECK(last == 150);
+    CHECK(records.size() == 150);
+    CHECK(!records.empty() && records.back().payload == Payload(150));
+}
+
+static void FillDataBase(DataBase& database) {
+    UserId alice = database.AddUser("alice", "secret");
+    UserId bob = database.AddUser("bob", "hunter2");
+    UserId remote = database.InternUser("remote");  // Of other shard
+    database.GetUser(alice).AddContact(bob);
+    database.GetUser(bob).AddContact(remote);
+    GroupId group = database.AddGroup("friends", alice);
+    database.AddMember(group, alice);
+    database.AddMember(group, bob);
+    database.AddMember(group, remote);
+    database.GetUser(alice).AddGroup(database.InternGroup("elsewhere"));
+}
+
+static void TestSnapshotRoundTrip() {
+    DataBase original;
+    FillDataBase(original);
+    Serializer output;
+    PackSnapshot(output, original, 42);
+
+    DataBase loaded;
+    uint64_t sequence = 0;
+    Deserializer input(output.data(), output.size());
+    CHECK(UnpackSnapshot(input, loaded, sequence));
+    CHECK(sequence == 42);
+    CHECK(loaded.NumUsers() == original.NumUsers());
+    CHECK(loaded.NumGroups() == original.NumGroups());
+
+    UserId alice = loaded.FindUser("alice");
+    UserId bob = loaded.FindUser("bob");
+    CHECK(alice != kInvalidId && bob != kInvalidId);
+    if (alice == kInvalidId || bob == kInvalidId) return;
+    CHECK(loaded.GetUser(alice).IsPassword("secret"));
+    CHECK(loaded.GetUser(bob).GetContacts() ==
+          original.GetUser(original.FindUser("bob")).GetContacts());
+    CHECK(loaded.FindUser("remote") == kInvalidId);
+    GroupId group = loaded.FindGroup("friends");
+    CHECK(group != kInvalidId);
+    if (group == kInvalidId) return;
+    CHECK(loaded.GetGroup(group).GetOwner() == alice);
+    CHECK(loaded.GetGroup(group).IsMember(bob));
+    CHECK(loaded.IsInGroup(alice, "elsewhere"));
+}
+
+static void TestSnapshotTorn() {
+    DataBase original;
+    FillDataBase(original);
+    Serializer output;
+    PackSnapshot(output, original, 7);
+
+    // A cut snapshot is never loaded as a valid one
+    for (size_t size = 0; size < output.size(); size += 3) {
+        DataBase loaded;
+        uint64_t sequence = 0;
+        bool valid = false;
+        try {
+            Deserializer input(output.data(), size);
+            valid = UnpackSnapshot(input, loaded, sequence);
+        } catch (std::exception&) {
+        }
+        CHECK(!valid);
+    }
+}
+
+static void TestStoreRecovery() {
+    TempDirectory directory;
+    zmq::context_t context(1);
+    {
+        DataBase database;
+        DurableStore store(context, directory.Path(), 4);
+        CHECK(store.Open(database));
+        for (int i = 0; i < 10; i++) {
+            std::string name = "user" + std::to_string(i);
+            database.AddUser(name, "pass");
+            store.Log(RegisterRecord(name, "pass"));
+            if (store.SnapshotDue()) store.Snapshot(database);
+        }
+    }
+
+    // The snapshot and the log after it give back every user
+    DataBase database;
+    DurableStore store(context, directory.Path(), 4);
+    CHECK(store.Open(database));
+    for (int i = 0; i < 10; i++) {
+        CHECK(database.FindUser("user" + std::to_string(i)) != kInvalidId);
+    }
+}
+
+static void TestHistoryTornBlock() {
+    TempDirectory directory;
+    std::string path = fs::JoinPath(directory.Path(), "conversation");
+    {
+        ConversationLog log;
+        CHECK(log.Open(path));
+        for (uint64_t i = 1; i <= ConversationLog::kIndexInterval + 1; i++) {
+            CHECK(log.Append(i, "alice", Payload(i)));
+        }
+    }
+
+    // A crash in the middle of the first record of the second block, the
+    // index already has its entry
+    MappedFile file;
+    CHECK(file.Open(path + ".log"));
+    off_t size = static_cast<off_t>(file.Size());
+    file.Close();
+    CHECK(::truncate((path + ".log").c_str(), size - 1) == 0);
+    {
+        ConversationLog log;
+        CHECK(log.Open(path));
+        CHECK(log.Count() == ConversationLog::kIndexInterval);
+        CHECK(log.Append(1000, "bob", "after"));
+        CHECK(log.Append(1001, "bob", "later"));
+    }
+
+    // The messages appended after the recovery keep their sequences
+    ConversationLog log;
+    CHECK(log.Open(path));
+    uint64_t first = ConversationLog::kIndexInterval + 1;
+    CHECK(log.Count() == first + 1);
+    std::vector<HistoryMessage> messages;
+    log.Read(first - 1, first + 2, messages);
+    CHECK(messages.size() == 3);
+    if (messages.size() != 3) return;
+    CHECK(messages[0].content == Payload(first - 1));
+    CHECK(messages[1].sequence == first && messages[1].content == "after");
+    CHECK(messages[2].sequence == first + 1 && messages[2].content == "later");
+    CHECK(log.FindTime(1000) == first);
+}
+
+int main() {
+    TestLogRoundTrip();
+    TestLogTornRecord();
+    TestSnapshotRoundTrip();
+    TestSnapshotTorn();
+    TestStoreRecovery();
+    TestHistoryTornBlock();
+
+    if (gFailures > 0) {
+        std::cerr << gFailures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All durability tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Merges the span files written by the processes (see Util/Trace.hpp) in a
+// Chrome trace event file, that can be opened in chrome://tracing or
+// Perfetto. Each file is a process, and the spans of the same trace are
+// linked with flow arrows.
+///////////////////////////////////////////////////////////////////////////////
+
+struct SpanRecord {
+    std::string trace_id;
+    std::string name;
+    uint64_t start;
+    uint64_t duration;
+    uint64_t thread;
+    size_t process;
+};
+
+static const char* HELP = R"(Usage: Trace_Merge SPAN_FILE... > trace.json
+)";
+
+bool ReadSpanFile(const std::string& path, size_t process,
+                  std::vector<std::string>& process_names,
+                  std::vector<SpanRecord>& spans) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::string name = path;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) continue;
+        if (line[0] == '#') {
+            std::istringstream stream(line.substr(1));
+            std::string key;
+            if (stream >> key && key == "process") stream >> name;
+            continue;
+        }
+
+        SpanRecord span;
+        std::istringstream stream(line);
+        if (stream >> span.trace_id >> span.name >> span.start >>
+            span.duration >> span.thread) {
+            span.process = process;
+            spans.push_back(span);
+        }
+    }
+
+    process_names.push_back(name);
+    return true;
+}
+
+void WriteEvent(std::ostream& os, bool& first, const std::string& event) {
+    os << (first ? "\n" : ",\n") << event;
+    first = false;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << HELP;
+        return 1;
+    }
+
+    std::vector<std::string> process_names;
+    std::vector<SpanRecord> spans;
+    for (int i = 1; i < argc; i++) {
+        if (!ReadSpanFile(argv[i], process_names.size() + 1, process_names,
+                          spans)) {
+            std::cerr << "Can't read " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    // Times relative to the first span so they are easier to read
+    uint64_t origin = UINT64_MAX;
+    for (auto& span : spans) origin = std::min(origin, span.start);
+
+    std::ostream& os = std::cout;
+    bool first = true;
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    for (size_t i = 0; i < process_names.size(); i++) {
+        std::ostringstream event;
+        event << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << i + 1
+              << ",\"args\":{\"name\":\"" << process_names[i] << "\"}}";
+        WriteEvent(os, first, event.str());
+    }
+
+    std::map<std::string, std::vector<const SpanRecord*>> traces;
+    for (auto& span : spans) {
+        std::ostringstream event;
+        event << "{\"name\":\"" << span.name
+              << "\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":"
+              << span.start - origin << ",\"dur\":" << span.duration
+              << ",\"pid\":" << span.process << ",\"tid\":" << span.thread
+              << ",\"args\":{\"trace\":\"" << span.trace_id << "\"}}";
+        WriteEvent(os, first, event.str());
+        traces[span.trace_id].push_back(&span);
+    }
+
+    // Link the spans of each trace in order with a flow
+    for (auto& trace : traces) {
+        std::vector<const SpanRecord*>& trace_spans = trace.second;
+        if (trace_spans.size() < 2) continue;
+        std::stable_sort(trace_spans.begin(), trace_spans.end(),
+                         [](const SpanRecord* a, const SpanRecord* b) {
+                             return a->start < b->start;
+                         });
+
+        for (size_t i = 0; i < trace_spans.size(); i++) {
+            const SpanRecord& span = *trace_spans[i];
+            const char* phase = i == 0 ? "s"
+                                : i + 1 == trace_spans.size() ? "f" : "t";
+            std::ostringstream event;
+            event << "{\"name\":\"trace\",\"cat\":\"chat\",\"ph\":\"" << phase
+                  << "\",\"id\":\"" << trace.first << "\",\"ts\":"
+                  << span.start - origin << ",\"pid\":" << span.process
+                  << ",\"tid\":" << span.thread << ",\"bp\":\"e\"}";
+            WriteEvent(os, first, event.str());
+        }
+    }
+
+    os << "\n]}\n";
+    return 0;
+}
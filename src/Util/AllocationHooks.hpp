@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "AllocationTracker.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Replacement of the global operator new that counts the allocations of the
+// current AllocationScope, only with the ALLOCATION_TRACKING CMake option.
+// Include it only in the file with the main function.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef ALLOCATION_TRACKING
+
+void* operator new(size_t size) {
+    AllocationTracker::Record(size);
+    void* ptr = std::malloc(size > 0 ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    AllocationTracker::Record(size);
+    return std::malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    std::free(ptr);
+}
+
+#endif
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation tracking
+// Counts the allocations done while an AllocationScope is alive and adds
+// them to the name of the scope, usually the request being handled. It is
+// enabled with the ALLOCATION_TRACKING CMake option, otherwise the scopes do
+// nothing. The program must include AllocationHooks.hpp in the file with
+// its main function, it replaces the global operator new.
+//
+//     AllocationScope allocations;
+//     request >> operation;
+//     allocations.SetName(IsOperation(operation) ? operation : "invalid");
+//
+// The names should be the ones of the known requests, they are escaped in
+// the JSON output anyway.
+///////////////////////////////////////////////////////////////////////////////
+
+class AllocationTracker {
+public:
+    // Allocations of a single scope, only touched by its thread
+    struct Counts {
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+    };
+
+public:
+    static AllocationTracker& Instance() {
+        static AllocationTracker tracker;
+        return tracker;
+    }
+
+    static bool Enabled() {
+#ifdef ALLOCATION_TRACKING
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Counts of the innermost scope of the thread, nullptr if there is none
+    static Counts*& Current() {
+        static thread_local Counts* current = nullptr;
+        return current;
+    }
+
+    static void Record(size_t size) {
+        Counts* counts = Current();
+        if (counts) {
+            counts->allocations++;
+            counts->bytes += size;
+        }
+    }
+
+    void Add(const std::string& name, const Counts& counts) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = totals_.find(name);
+        if (it == totals_.end()) {
+            // The names may come from the clients, so they are limited
+            if (totals_.size() >= kMaxNames) {
+                it = totals_.insert({"other", Totals()}).first;
+            } else {
+                it = totals_.insert({name, Totals()}).first;
+            }
+        }
+        Totals& totals = it->second;
+        totals.scopes++;
+        totals.allocations += counts.allocations;
+        totals.bytes += counts.bytes;
+        if (counts.allocations > totals.max_allocations) {
+            totals.max_allocations = counts.allocations;
+        }
+    }
+
+    void WriteJSON(std::ostream& os) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        os << "{\"enabled\":" << (Enabled() ? "true" : "false")
+           << ",\"actions\":{";
+        bool first = true;
+        for (auto& entry : totals_) {
+            const Totals& totals = entry.second;
+            if (!first) os << ",";
+            first = false;
+            WriteString(os, entry.first);
+            os << ":{\"requests\":" << totals.scopes
+               << ",\"allocations\":" << totals.allocations
+               << ",\"bytes\":" << totals.bytes
+               << ",\"allocations_per_request\":"
+               << static_cast<double>(totals.allocations) / totals.scopes
+               << ",\"bytes_per_request\":"
+               << static_cast<double>(totals.bytes) / totals.scopes
+               << ",\"max_allocations\":" << totals.max_allocations << "}";
+        }
+        os << "}}";
+    }
+
+private:
+    static const size_t kMaxNames = 64;
+
+    // Writes the name as a JSON string
+    static void WriteString(std::ostream& os, const std::string& name) {
+        static const char kDigits[] = "0123456789abcdef";
+        os << "\"";
+        for (char c : name) {
+            uint8_t byte = static_cast<uint8_t>(c);
+            if (c == '"' || c == '\\') {
+                os << '\\' << c;
+            } else if (byte < 0x20) {
+                os << "\\u00" << kDigits[byte >> 4] << kDigits[byte & 15];
+            } else {
+                os << c;
+            }
+        }
+        os << "\"";
+    }
+
+    struct Totals {
+        uint64_t scopes = 0;
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        uint64_t max_allocations = 0;  // In a single scope
+    };
+
+    AllocationTracker() = default;
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, Totals> totals_;
+};
+
+// The allocations of the scope are only added when it has a name, the
+// nested scopes don't add its allocations to the outer ones
+class AllocationScope {
+public:
+    AllocationScope() : previous_(nullptr) {
+        if (AllocationTracker::Enabled()) {
+            previous_ = AllocationTracker::Current();
+            AllocationTracker::Current() = &counts_;
+        }
+    }
+
+    ~AllocationScope() {
+        if (AllocationTracker::Enabled()) {
+            AllocationTracker::Current() = previous_;
+            if (!name_.empty()) {
+                AllocationTracker::Instance().Add(name_, counts_);
+            }
+        }
+    }
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    void SetName(const std::string& name) {
+        if (AllocationTracker::Enabled()) name_ = name;
+    }
+
+private:
+    AllocationTracker::Counts counts_;
+    AllocationTracker::Counts* previous_;
+    std::string name_;
+};
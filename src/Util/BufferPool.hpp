@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffer pool
+// Buffers are grouped in power of two size classes from 256B to 16MB, the
+// released buffers are kept in a free list per class, bounded to
+// kRetainedBytes, and reused by the next request of the same class. Bigger
+// buffers are not pooled. The buffers can be released from any thread, so
+// they can be handed to ZMQ and returned from its I/O threads.
+///////////////////////////////////////////////////////////////////////////////
+
+class BufferPool {
+public:
+    static const size_t kMinSize = 256;
+    static const size_t kNumClasses = 17;  // Up to 16MB
+
+    // Memory kept in the free list of each class, but the classes of a
+    // buffer bigger than it still keep one buffer
+    static const size_t kRetainedBytes = 8 * 1024 * 1024;
+
+public:
+    static BufferPool& Instance() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    ~BufferPool() {
+        for (size_t i = 0; i < kNumClasses; i++) {
+            for (char* data : classes_[i].buffers) delete[] data;
+        }
+    }
+
+    // Returns a buffer of at least the given size, its real size is
+    // returned in capacity
+    char* Acquire(size_t size, size_t& capacity) {
+        size_t index = ClassIndex(size);
+        if (index >= kNumClasses) {
+            capacity = size;
+            allocations_.fetch_add(1, std::memory_order_relaxed);
+            return new char[size];
+        }
+
+        capacity = kMinSize << index;
+        SizeClass& size_class = classes_[index];
+        {
+            std::lock_guard<std::mutex> lock(size_class.mutex);
+            if (!size_class.buffers.empty()) {
+                char* data = size_class.buffers.back();
+                size_class.buffers.pop_back();
+                return data;
+            }
+        }
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+        return new char[capacity];
+    }
+
+    // The capacity must be the one returned by Acquire
+    void Release(char* data, size_t capacity) {
+        size_t index = ClassIndex(capacity);
+        if (index < kNumClasses) {
+            SizeClass& size_class = classes_[index];
+            std::lock_guard<std::mutex> lock(size_class.mutex);
+            if (size_class.buffers.size() < size_class.buffers.capacity()) {
+                size_class.buffers.push_back(data);
+                return;
+            }
+        }
+        delete[] data;
+    }
+
+    // Free function for zmq_msg_init_data, the hint is the capacity
+    static void FreeMessage(void* data, void* hint) {
+        Instance().Release(static_cast<char*>(data),
+                           reinterpret_cast<uintptr_t>(hint));
+    }
+
+    // Number of buffers allocated because none could be reused
+    uint64_t Allocations() const {
+        return allocations_.load(std::memory_order_relaxed);
+    }
+
+private:
+    BufferPool() : allocations_(0) {
+        for (size_t i = 0; i < kNumClasses; i++) {
+            size_t count = kRetainedBytes / (kMinSize << i);
+            count = std::min<size_t>(std::max<size_t>(count, 1), 1024);
+            classes_[i].buffers.reserve(count);
+        }
+    }
+
+    static size_t ClassIndex(size_t size) {
+        size_t index = 0;
+        while ((kMinSize << index) < size && index < kNumClasses) index++;
+        return index;
+    }
+
+private:
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<char*> buffers;  // Never grows over its reserved size
+    };
+
+    SizeClass classes_[kNumClasses];
+    std::atomic<uint64_t> allocations_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Expected size of a message type
+// Keeps the largest recent size of the messages built with it, decaying
+// slowly so a single big message doesn't make all the next ones big.
+//
+//     static CapacityHint hint;
+//     Serializer update(hint);
+///////////////////////////////////////////////////////////////////////////////
+
+class CapacityHint {
+public:
+    explicit CapacityHint(size_t initial = 0) : size_(initial) {}
+
+    size_t Get() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    void Record(size_t size) {
+        size_t current = size_.load(std::memory_order_relaxed);
+        size_t next = std::max(size, current - current / 16);
+        if (next != current) size_.store(next, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> size_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Growable buffer backed by the BufferPool, works as a msgpack stream
+///////////////////////////////////////////////////////////////////////////////
+
+class PooledBuffer {
+public:
+    explicit PooledBuffer(size_t capacity = 0)
+          : data_(nullptr), size_(0), capacity_(0) {
+        if (capacity > 0) {
+            data_ = BufferPool::Instance().Acquire(capacity, capacity_);
+        }
+    }
+
+    PooledBuffer(PooledBuffer&& other)
+          : data_(other.data_), size_(other.size_), capacity_(other.capacity_) {
+        other.data_ = nullptr;
+        other.size_ = other.capacity_ = 0;
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    ~PooledBuffer() {
+        if (data_) BufferPool::Instance().Release(data_, capacity_);
+    }
+
+    // The new bytes are not initialized
+    void resize(size_t size) {
+        if (size > capacity_) Grow(size);
+        size_ = size;
+    }
+
+    void write(const char* data, size_t size) {
+        if (size_ + size > capacity_) Grow(size_ + size);
+        std::memcpy(data_ + size_, data, size);
+        size_ += size;
+    }
+
+    char* data() {
+        return data_;
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Gives up the ownership of the buffer, it must be returned to the
+    // BufferPool with its capacity
+    char* Release() {
+        char* data = data_;
+        data_ = nullptr;
+        size_ = capacity_ = 0;
+        return data;
+    }
+
+private:
+    void Grow(size_t size) {
+        size_t capacity;
+        char* data = BufferPool::Instance().Acquire(
+            std::max(size, capacity_ * 2), capacity);
+        if (data_) {
+            std::memcpy(data, data_, size_);
+            BufferPool::Instance().Release(data_, capacity_);
+        }
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+private:
+    char* data_;
+    size_t size_;
+    size_t capacity_;
+};
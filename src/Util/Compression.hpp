@@ -0,0 +1,359 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "BufferPool.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// LZ compression
+// Fast LZ77 codec that writes the LZ4 block format: sequences of literals
+// followed by a match of at least 4 bytes at an offset of up to 64KB. The
+// matches are found with a single hash table of 4 byte sequences, so the
+// compression is fast but not the best possible.
+//
+// A compressed frame starts with 0xC1, a byte that is never used by
+// MessagePack, so the frames can be told apart from the raw ones. It is
+// followed by the size of the original data as a LEB128 varint and the
+// compressed block.
+///////////////////////////////////////////////////////////////////////////////
+
+namespace lz {
+
+static const uint8_t kFrameMarker = 0xC1;
+
+// Frames that claim a bigger original size are rejected
+static const size_t kMaxFrameSize = 256 * 1024 * 1024;
+
+namespace detail {
+
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;  // The block ends with literals
+static const size_t kMatchLimit = 12;   // No match starts after this
+static const size_t kMaxOffset = 65535;
+
+inline uint32_t Read32(const uint8_t* ptr) {
+    uint32_t value;
+    std::memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+// Writes a length that doesn't fit in the 4 bits of the token
+inline uint8_t* WriteLength(uint8_t* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = static_cast<uint8_t>(length);
+    return out;
+}
+
+}  // namespace detail
+
+inline bool IsCompressed(const char* data, size_t size) {
+    return size > 0 && static_cast<uint8_t>(data[0]) == kFrameMarker;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compression context
+// Keeps the hash table between messages, the positions are stored relative
+// to a base that moves after each message so the table doesn't have to be
+// cleared. It also counts the bytes before and after the compression.
+///////////////////////////////////////////////////////////////////////////////
+
+class Context {
+public:
+    static const size_t kDefaultThreshold = 512;
+    static const size_t kMinThreshold = 32;
+
+public:
+    // Data smaller than the threshold is not compressed, it is at least
+    // kMinThreshold so there is always room for the frame header
+    explicit Context(size_t threshold = kDefaultThreshold)
+          : threshold_(threshold > kMinThreshold ? threshold : kMinThreshold),
+            table_(1 << kHashBits, 0),
+            base_(0),
+            bytes_in_(0),
+            bytes_out_(0),
+            compressed_(0),
+            skipped_(0) {}
+
+    // Writes the compressed frame in output, returns false when the data is
+    // below the threshold or compressing it doesn't make it smaller
+    bool Compress(const char* data, size_t size, PooledBuffer& output) {
+        if (size < threshold_ || size > kMaxFrameSize) {
+            skipped_++;
+            return false;
+        }
+
+        // Fail as soon as the output is not smaller than the input
+        output = PooledBuffer(size);
+        output.resize(size);
+        uint8_t* out_begin = reinterpret_cast<uint8_t*>(output.data());
+        uint8_t* out = out_begin;
+        uint8_t* out_end = out + size;
+
+        *out++ = kFrameMarker;
+        size_t value = size;
+        while (value > 0x7F) {
+            *out++ = static_cast<uint8_t>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(value);
+
+        size_t written = CompressBlock(reinterpret_cast<const uint8_t*>(data),
+                                       size, out, out_end);
+        if (written == 0) {
+            skipped_++;
+            return false;
+        }
+
+        output.resize(static_cast<size_t>(out - out_begin) + written);
+        bytes_in_ += size;
+        bytes_out_ += output.size();
+        compressed_++;
+        return true;
+    }
+
+    size_t Threshold() const {
+        return threshold_;
+    }
+
+    // Bytes of the compressed messages before and after the compression
+    uint64_t BytesIn() const {
+        return bytes_in_;
+    }
+
+    uint64_t BytesOut() const {
+        return bytes_out_;
+    }
+
+    uint64_t Compressed() const {
+        return compressed_;
+    }
+
+    // Messages sent raw because they were small or didn't compress
+    uint64_t Skipped() const {
+        return skipped_;
+    }
+
+private:
+    static const unsigned kHashBits = 12;
+
+    static uint32_t Hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - kHashBits);
+    }
+
+    // Returns the size of the block or 0 if it doesn't fit in the output
+    size_t CompressBlock(const uint8_t* in, size_t size, uint8_t* out_begin,
+                         uint8_t* out_end) {
+        using namespace detail;
+
+        // The positions in the table must not overflow
+        if (base_ > UINT32_MAX - size - 1) {
+            std::fill(table_.begin(), table_.end(), 0);
+            base_ = 0;
+        }
+        uint32_t base = base_ + 1;  // 0 is an empty entry
+        base_ = base + static_cast<uint32_t>(size);
+
+        uint8_t* out = out_begin;
+        const uint8_t* anchor = in;  // Start of the pending literals
+        const uint8_t* ip = in;
+        const uint8_t* end = in + size;
+        const uint8_t* match_limit = end - kMatchLimit;
+
+        while (ip < match_limit) {
+            uint32_t sequence = Read32(ip);
+            uint32_t& entry = table_[Hash(sequence)];
+            uint32_t position = base + static_cast<uint32_t>(ip - in);
+            uint32_t candidate = entry;
+            entry = position;
+
+            if (candidate < base || position - candidate > kMaxOffset ||
+                Read32(in + (candidate - base)) != sequence) {
+                ip++;
+                continue;
+            }
+
+            // Extend the match, it can't enter the last literals
+            const uint8_t* match = in + (candidate - base);
+            size_t length = kMinMatch;
+            while (ip + length < end - kLastLiterals &&
+                   ip[length] == match[length]) {
+                length++;
+            }
+
+            size_t literals = static_cast<size_t>(ip - anchor);
+            size_t needed = 1 + literals + literals / 255 + 1 + 2 +
+                            length / 255 + 1;
+            if (needed >= static_cast<size_t>(out_end - out)) return 0;
+
+            uint8_t* token = out++;
+            *token = static_cast<uint8_t>(
+                (literals >= 15 ? 15 : literals) << 4);
+            if (literals >= 15) out = WriteLength(out, literals - 15);
+            std::memcpy(out, anchor, literals);
+            out += literals;
+
+            size_t offset = position - candidate;
+            *out++ = static_cast<uint8_t>(offset & 0xFF);
+            *out++ = static_cast<uint8_t>(offset >> 8);
+
+            size_t match_length = length - kMinMatch;
+            *token |= static_cast<uint8_t>(match_length >= 15 ? 15
+                                                              : match_length);
+            if (match_length >= 15) out = WriteLength(out, match_length - 15);
+
+            ip += length;
+            anchor = ip;
+        }
+
+        // Last literals
+        size_t literals = static_cast<size_t>(end - anchor);
+        size_t needed = 1 + literals + literals / 255 + 1;
+        if (needed >= static_cast<size_t>(out_end - out)) return 0;
+        uint8_t* token = out++;
+        *token = static_cast<uint8_t>((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15) out = WriteLength(out, literals - 15);
+        std::memcpy(out, anchor, literals);
+        out += literals;
+
+        return static_cast<size_t>(out - out_begin);
+    }
+
+private:
+    size_t threshold_;
+    std::vector<uint32_t> table_;
+    uint32_t base_;
+
+    uint64_t bytes_in_;
+    uint64_t bytes_out_;
+    uint64_t compressed_;
+    uint64_t skipped_;
+};
+
+namespace detail {
+
+// A byte of the block expands to at most 255 bytes, the bigger sizes are
+// rejected before the output is allocated
+static const size_t kMaxRatio = 255;
+
+// Reads the header of the frame, returns the original size
+inline size_t ReadHeader(const uint8_t*& ip, const uint8_t* end) {
+    if (ip >= end || *ip != kFrameMarker) {
+        throw std::runtime_error("Not a compressed frame");
+    }
+    ip++;
+
+    size_t original = 0;
+    for (unsigned shift = 0; true; shift += 7) {
+        if (ip >= end || shift > 28) {
+            throw std::runtime_error("Invalid compressed frame size");
+        }
+        original |= static_cast<size_t>(*ip & 0x7F) << shift;
+        if (!(*ip++ & 0x80)) break;
+    }
+    if (original > kMaxFrameSize ||
+        original > kMaxRatio * static_cast<size_t>(end - ip)) {
+        throw std::runtime_error("Compressed frame too big");
+    }
+    return original;
+}
+
+// Decodes the block into the output until it ends or the output is full,
+// the sequences that don't fit are cut if partial is set, otherwise they
+// are invalid. Returns the bytes written.
+inline size_t DecodeBlock(const uint8_t* ip, const uint8_t* end,
+                          uint8_t* out_begin, size_t capacity, bool partial) {
+    uint8_t* out = out_begin;
+    uint8_t* out_end = out + capacity;
+
+    auto read_length = [&](size_t length) -> size_t {
+        if (length != 15) return length;
+        uint8_t byte;
+        do {
+            if (ip >= end) throw std::runtime_error("Truncated length");
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return length;
+    };
+
+    while (ip < end && !(partial && out == out_end)) {
+        uint8_t token = *ip++;
+
+        size_t literals = read_length(token >> 4);
+        if (literals > static_cast<size_t>(end - ip)) {
+            throw std::runtime_error("Invalid literals");
+        }
+        size_t room = static_cast<size_t>(out_end - out);
+        if (literals > room) {
+            if (!partial) throw std::runtime_error("Invalid literals");
+            std::memcpy(out, ip, room);
+            return capacity;
+        }
+        std::memcpy(out, ip, literals);
+        ip += literals;
+        out += literals;
+
+        if (ip == end) break;  // The last sequence has no match
+
+        if (end - ip < 2) throw std::runtime_error("Truncated offset");
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        size_t length = read_length(token & 0x0F) + kMinMatch;
+
+        if (offset == 0 || offset > static_cast<size_t>(out - out_begin)) {
+            throw std::runtime_error("Invalid match");
+        }
+        room = static_cast<size_t>(out_end - out);
+        if (length > room) {
+            if (!partial) throw std::runtime_error("Invalid match");
+            length = room;
+        }
+        // The match can overlap the output, so copy byte by byte
+        const uint8_t* match = out - offset;
+        for (size_t i = 0; i < length; i++) out[i] = match[i];
+        out += length;
+    }
+    return static_cast<size_t>(out - out_begin);
+}
+
+}  // namespace detail
+
+// Decompresses a frame written by Context::Compress, throws
+// std::runtime_error if the frame is not valid
+inline void Decompress(const char* data, size_t size,
+                       std::vector<char>& output) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* end = ip + size;
+    size_t original = detail::ReadHeader(ip, end);
+
+    output.resize(original);
+    size_t written = detail::DecodeBlock(
+        ip, end, reinterpret_cast<uint8_t*>(output.data()), original, false);
+    if (written != original) throw std::runtime_error("Invalid frame size");
+}
+
+// Decompresses only the first limit bytes of the frame, or less if it is
+// smaller, to read its first fields without decompressing all of it.
+// Throws std::runtime_error if that part is not valid.
+inline void DecompressPrefix(const char* data, size_t size, size_t limit,
+                             std::vector<char>& output) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* end = ip + size;
+    size_t original = detail::ReadHeader(ip, end);
+
+    output.resize(std::min(original, limit));
+    size_t written = detail::DecodeBlock(
+        ip, end, reinterpret_cast<uint8_t*>(output.data()), output.size(),
+        true);
+    output.resize(written);
+}
+
+}  // namespace lz
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// File system helpers
+// Thin wrappers over the POSIX calls needed by the files that must survive a
+// crash: the data is only durable after SyncFile, and a new or renamed file
+// only after SyncDirectory of its directory.
+///////////////////////////////////////////////////////////////////////////////
+
+namespace fs {
+
+inline std::string JoinPath(const std::string& directory,
+                            const std::string& name) {
+    if (directory.empty() || directory.back() == '/') return directory + name;
+    return directory + "/" + name;
+}
+
+// Creates the directory and its parents, returns false if it can't
+inline bool MakeDirectories(const std::string& path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i < path.size() && path[i] != '/') continue;
+        std::string prefix = path.substr(0, i);
+        if (::mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Names of the files of the directory that start with the prefix, sorted
+inline std::vector<std::string> ListFiles(const std::string& directory,
+                                          const std::string& prefix) {
+    std::vector<std::string> names;
+    DIR* dir = ::opendir(directory.c_str());
+    if (!dir) return names;
+    while (dirent* entry = ::readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, prefix.size(), prefix) == 0) names.push_back(name);
+    }
+    ::closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+inline bool FileExists(const std::string& path) {
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0;
+}
+
+inline bool RemoveFile(const std::string& path) {
+    return ::unlink(path.c_str()) == 0;
+}
+
+// Writes the whole buffer, retrying the partial writes
+inline bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+inline bool SyncFile(int fd) {
+#ifdef __APPLE__
+    return ::fsync(fd) == 0;
+#else
+    return ::fdatasync(fd) == 0;
+#endif
+}
+
+inline bool SyncDirectory(const std::string& directory) {
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+// Replaces the file with the data, so it has either the old or the new
+// content after a crash
+inline bool WriteFileAtomically(const std::string& directory,
+                                const std::string& name, const char* data,
+                                size_t size) {
+    std::string path = JoinPath(directory, name);
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool written = WriteAll(fd, data, size) && SyncFile(fd);
+    ::close(fd);
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        RemoveFile(temporary);
+        return false;
+    }
+    return SyncDirectory(directory);
+}
+
+}  // namespace fs
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Log-linear histogram (HdrHistogram style)
+// Values are grouped by its power of two and each group is divided in 64
+// linear buckets, so any value is stored with a relative error below 1/64
+// (~1.6%) using a fixed amount of memory. Values below 128 are exact.
+///////////////////////////////////////////////////////////////////////////////
+
+class Histogram {
+public:
+    Histogram()
+          : counts_(kNumBuckets, 0),
+            count_(0),
+            sum_(0),
+            min_(std::numeric_limits<uint64_t>::max()),
+            max_(0) {}
+
+    void Record(uint64_t value, uint64_t count = 1) {
+        counts_[BucketIndex(value)] += count;
+        count_ += count;
+        sum_ += value * count;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void Merge(const Histogram& other) {
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    void Reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = 0;
+        sum_ = 0;
+        min_ = std::numeric_limits<uint64_t>::max();
+        max_ = 0;
+    }
+
+    // Value at the given percentile in the range [0, 100], it returns the
+    // highest value that is equivalent to the value in its bucket
+    uint64_t Percentile(double percentile) const {
+        if (count_ == 0) return 0;
+
+        uint64_t target = static_cast<uint64_t>(
+            std::max(1.0, percentile / 100.0 * count_ + 0.5));
+        uint64_t accumulated = 0;
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            accumulated += counts_[i];
+            if (accumulated >= target) {
+                return std::min(BucketUpperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t Count() const {
+        return count_;
+    }
+
+    uint64_t Min() const {
+        return count_ ? min_ : 0;
+    }
+
+    uint64_t Max() const {
+        return max_;
+    }
+
+    double Mean() const {
+        return count_ ? static_cast<double>(sum_) / count_ : 0.0;
+    }
+
+private:
+    static const size_t kSubBucketBits = 7;
+    static const size_t kSubBucketCount = 1 << kSubBucketBits;
+    static const size_t kSubBucketHalf = kSubBucketCount / 2;
+    static const size_t kNumBuckets =
+        kSubBucketCount + (64 - kSubBucketBits) * kSubBucketHalf;
+
+    static unsigned HighestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        unsigned bit = 0;
+        while (value >>= 1) bit++;
+        return bit;
+#endif
+    }
+
+    static size_t BucketIndex(uint64_t value) {
+        if (value < kSubBucketCount) return static_cast<size_t>(value);
+        unsigned shift = HighestBit(value) - (kSubBucketBits - 1);
+        return kSubBucketCount + (shift - 1) * kSubBucketHalf +
+               static_cast<size_t>((value >> shift) - kSubBucketHalf);
+    }
+
+    static uint64_t BucketUpperBound(size_t index) {
+        if (index < kSubBucketCount) return index;
+        size_t shift = (index - kSubBucketCount) / kSubBucketHalf + 1;
+        uint64_t sub_bucket = (index - kSubBucketCount) % kSubBucketHalf +
+                              kSubBucketHalf;
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
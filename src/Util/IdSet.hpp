@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Set of dense ids (see Interner.hpp)
+// A small set is a sorted vector, so a group of a few users doesn't take a
+// bit per id up to the biggest one. Once the bitset up to the biggest id
+// takes no more memory than the vector the set becomes a bitset, the
+// membership test is then a bit test and the iteration skips 64 absent ids
+// at a time. It stays a bitset when ids are erased.
+///////////////////////////////////////////////////////////////////////////////
+
+class IdSet {
+public:
+    IdSet() : size_(0) {}
+
+    // Returns false if the id was already in the set
+    bool Insert(uint32_t id) {
+        if (words_.empty()) {
+            auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+            if (it != ids_.end() && *it == id) return false;
+            ids_.insert(it, id);
+            size_++;
+            if (IsDense()) ToBitset();
+            return true;
+        }
+
+        size_t word = id / 64;
+        if (word >= words_.size()) words_.resize(word + 1, 0);
+        uint64_t bit = uint64_t(1) << (id % 64);
+        if (words_[word] & bit) return false;
+        words_[word] |= bit;
+        size_++;
+        return true;
+    }
+
+    // Returns false if the id was not in the set
+    bool Erase(uint32_t id) {
+        if (words_.empty()) {
+            auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+            if (it == ids_.end() || *it != id) return false;
+            ids_.erase(it);
+            size_--;
+            return true;
+        }
+
+        if (!Contains(id)) return false;
+        words_[id / 64] &= ~(uint64_t(1) << (id % 64));
+        size_--;
+        return true;
+    }
+
+    bool Contains(uint32_t id) const {
+        if (words_.empty()) {
+            return std::binary_search(ids_.begin(), ids_.end(), id);
+        }
+        size_t word = id / 64;
+        return word < words_.size() &&
+               (words_[word] & (uint64_t(1) << (id % 64))) != 0;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Calls function(id) for each id in increasing order
+    template <typename Function>
+    void ForEach(Function function) const {
+        if (words_.empty()) {
+            for (uint32_t id : ids_) function(id);
+            return;
+        }
+        for (size_t word = 0; word < words_.size(); word++) {
+            uint64_t bits = words_[word];
+            while (bits != 0) {
+                function(static_cast<uint32_t>(word * 64 +
+                                               __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+private:
+    // Whether the bitset up to the biggest id is not bigger than the ids
+    bool IsDense() const {
+        size_t words = ids_.back() / 64 + 1;
+        return words * sizeof(uint64_t) <= ids_.size() * sizeof(uint32_t);
+    }
+
+    void ToBitset() {
+        words_.assign(ids_.back() / 64 + 1, 0);
+        for (uint32_t id : ids_) words_[id / 64] |= uint64_t(1) << (id % 64);
+        std::vector<uint32_t>().swap(ids_);
+    }
+
+private:
+    std::vector<uint32_t> ids_;    // Sorted, while words_ is empty
+    std::vector<uint64_t> words_;  // The bitset, once the set is dense
+    size_t size_;
+};
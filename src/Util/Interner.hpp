@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// String interner
+// Gives each distinct string a dense 32-bit id, in the order they are
+// interned starting at 0, so the objects named by the strings can be stored
+// in vectors indexed by id. The strings are never removed.
+///////////////////////////////////////////////////////////////////////////////
+
+using InternedId = uint32_t;
+
+static const InternedId kInvalidId = UINT32_MAX;
+
+class Interner {
+public:
+    // Id of the string, a new one if it was not interned
+    InternedId Intern(const std::string& str) {
+        auto result =
+            ids_.insert({str, static_cast<InternedId>(strings_.size())});
+        if (result.second) strings_.push_back(&result.first->first);
+        return result.first->second;
+    }
+
+    // Id of the string, kInvalidId if it was not interned
+    InternedId Find(const std::string& str) const {
+        auto it = ids_.find(str);
+        return it != ids_.end() ? it->second : kInvalidId;
+    }
+
+    const std::string& GetString(InternedId id) const {
+        return *strings_[id];
+    }
+
+    size_t Size() const {
+        return strings_.size();
+    }
+
+private:
+    // The nodes of the map don't move, so each string is stored once
+    std::unordered_map<std::string, InternedId> ids_;
+    std::vector<const std::string*> strings_;
+};
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
 #include "Matrix.hpp"
 
 template <typename T>
@@ -148,3 +155,352 @@ Matrix<T> Inverse(const Matrix<T>& m) {
 
     return result;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// LU Factorization with partial pivoting (P * A = L * U)
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+struct LUFactorization {
+    // L (unit diagonal, stored below the diagonal) and U packed together
+    Matrix<T> lu;
+    // Row i of P * A is the row permutation[i] of A
+    std::vector<size_t> permutation;
+    bool singular;
+};
+
+template <typename U, typename T>
+Matrix<U> MatrixCast(const Matrix<T>& m) {
+    Matrix<U> result(m.NumRows(), m.NumCols());
+    const std::vector<T>& data = m.GetData();
+    result.SetData(std::vector<U>(data.begin(), data.end()));
+    return result;
+}
+
+template <typename T>
+LUFactorization<T> LUDecomposition(const Matrix<T>& m) {
+    if (m.NumRows() != m.NumCols()) {
+        std::stringstream stream;
+        stream << "can't factorize a non square matrix of size ["
+               << m.NumRows() << ", " << m.NumCols() << "]\n";
+        throw std::runtime_error(stream.str());
+    }
+
+    size_t n = m.NumRows();
+    LUFactorization<T> result{m, std::vector<size_t>(n), false};
+    Matrix<T>& lu = result.lu;
+
+    for (size_t i = 0; i < n; i++) {
+        result.permutation[i] = i;
+    }
+
+    for (size_t diagonal = 0; diagonal < n; diagonal++) {
+        // Use the biggest value in the column as pivot to bound the growth
+        size_t pivot_row = diagonal;
+        T pivot = std::abs(lu(diagonal, diagonal));
+        for (size_t row = diagonal + 1; row < n; row++) {
+            if (std::abs(lu(diagonal, row)) > pivot) {
+                pivot = std::abs(lu(diagonal, row));
+                pivot_row = row;
+            }
+        }
+
+        if (pivot == T(0)) {
+            result.singular = true;
+            continue;
+        }
+
+        if (pivot_row != diagonal) {
+            for (size_t column = 0; column < n; column++) {
+                std::swap(lu(column, pivot_row), lu(column, diagonal));
+            }
+            std::swap(result.permutation[pivot_row],
+                      result.permutation[diagonal]);
+        }
+
+        for (size_t row = diagonal + 1; row < n; row++) {
+            T factor = lu(diagonal, row) / lu(diagonal, diagonal);
+            lu(diagonal, row) = factor;
+            for (size_t column = diagonal + 1; column < n; column++) {
+                lu(column, row) -= lu(column, diagonal) * factor;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Solve A * x = b using the factorization of A
+template <typename T>
+std::vector<T> LUSolve(const LUFactorization<T>& f, const std::vector<T>& b) {
+    const Matrix<T>& lu = f.lu;
+    size_t n = lu.NumRows();
+    std::vector<T> x(n);
+
+    // Forward substitution L * y = P * b
+    for (size_t row = 0; row < n; row++) {
+        T sum = b[f.permutation[row]];
+        for (size_t column = 0; column < row; column++) {
+            sum -= lu(column, row) * x[column];
+        }
+        x[row] = sum;
+    }
+
+    // Backward substitution U * x = y
+    for (size_t row = n; row-- > 0;) {
+        T sum = x[row];
+        for (size_t column = row + 1; column < n; column++) {
+            sum -= lu(column, row) * x[column];
+        }
+        x[row] = sum / lu(row, row);
+    }
+
+    return x;
+}
+
+// Solve transpose(A) * x = b using the factorization of A
+template <typename T>
+std::vector<T> LUSolveTransposed(const LUFactorization<T>& f,
+                                 const std::vector<T>& b) {
+    const Matrix<T>& lu = f.lu;
+    size_t n = lu.NumRows();
+    std::vector<T> y(b);
+
+    // Forward substitution transpose(U) * w = b
+    for (size_t row = 0; row < n; row++) {
+        T sum = y[row];
+        for (size_t column = 0; column < row; column++) {
+            sum -= lu(row, column) * y[column];
+        }
+        y[row] = sum / lu(row, row);
+    }
+
+    // Backward substitution transpose(L) * v = w
+    for (size_t row = n; row-- > 0;) {
+        T sum = y[row];
+        for (size_t column = row + 1; column < n; column++) {
+            sum -= lu(row, column) * y[column];
+        }
+        y[row] = sum;
+    }
+
+    // Undo the row permutation x = transpose(P) * v
+    std::vector<T> x(n);
+    for (size_t i = 0; i < n; i++) {
+        x[f.permutation[i]] = y[i];
+    }
+
+    return x;
+}
+
+template <typename T>
+T NormOne(const Matrix<T>& m) {
+    // Maximum absolute column sum
+    T result = T(0);
+    for (size_t column = 0; column < m.NumCols(); column++) {
+        T sum = T(0);
+        for (size_t row = 0; row < m.NumRows(); row++) {
+            sum += std::abs(m(column, row));
+        }
+        result = std::max(result, sum);
+    }
+    return result;
+}
+
+template <typename T>
+T NormInf(const Matrix<T>& m) {
+    // Maximum absolute row sum
+    T result = T(0);
+    for (size_t row = 0; row < m.NumRows(); row++) {
+        T sum = T(0);
+        for (size_t column = 0; column < m.NumCols(); column++) {
+            sum += std::abs(m(column, row));
+        }
+        result = std::max(result, sum);
+    }
+    return result;
+}
+
+template <typename T>
+T NormInf(const std::vector<T>& v) {
+    T result = T(0);
+    for (const T& value : v) {
+        result = std::max(result, std::abs(value));
+    }
+    return result;
+}
+
+// Estimate the 1-norm of the inverse of A without forming it, using the
+// Hager-Higham method which only needs a few solves with A and transpose(A)
+template <typename T>
+T InverseNormOneEstimate(const LUFactorization<T>& f) {
+    size_t n = f.lu.NumRows();
+    if (n == 0) return T(0);
+
+    std::vector<T> x(n, T(1) / T(n));
+    T estimate = T(0);
+
+    for (int iteration = 0; iteration < 5; iteration++) {
+        std::vector<T> y = LUSolve(f, x);
+
+        estimate = T(0);
+        for (size_t i = 0; i < n; i++) {
+            estimate += std::abs(y[i]);
+            y[i] = (y[i] >= T(0)) ? T(1) : T(-1);
+        }
+
+        std::vector<T> z = LUSolveTransposed(f, y);
+
+        size_t max_index = 0;
+        T dot = T(0);
+        for (size_t i = 0; i < n; i++) {
+            if (std::abs(z[i]) > std::abs(z[max_index])) max_index = i;
+            dot += z[i] * x[i];
+        }
+
+        if (iteration > 0 && std::abs(z[max_index]) <= dot) break;
+
+        std::fill(x.begin(), x.end(), T(0));
+        x[max_index] = T(1);
+    }
+
+    return estimate;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mixed precision solvers
+// Factorize in float and refine the solution using double residuals, this
+// gives double accuracy results as long as cond(A) is well below 1 / eps
+// of float (~1e7).
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename S>
+struct RefinedSolution {
+    S value;
+    // 1-norm condition number estimate of the input, infinity if singular
+    double condition;
+    // Maximum number of refinement steps done for any right hand side
+    size_t iterations;
+    // Whether the refinement reached double accuracy
+    bool converged;
+};
+
+namespace detail {
+
+inline bool RefineSolution(const Matrix<double>& a, double a_norm,
+                           const LUFactorization<float>& f,
+                           const std::vector<double>& b, std::vector<double>& x,
+                           size_t max_iterations, size_t& iterations) {
+    size_t n = a.NumRows();
+    const double eps = std::numeric_limits<double>::epsilon();
+    std::vector<float> b_single(b.begin(), b.end());
+    std::vector<float> x_single = LUSolve(f, b_single);
+    x.assign(x_single.begin(), x_single.end());
+
+    double last_correction = std::numeric_limits<double>::infinity();
+    std::vector<float> residual(n);
+
+    for (iterations = 0; iterations < max_iterations; iterations++) {
+        // Compute the residual r = b - A * x in double precision
+        double residual_norm = 0.0;
+        for (size_t row = 0; row < n; row++) {
+            double sum = b[row];
+            for (size_t column = 0; column < n; column++) {
+                sum -= a(column, row) * x[column];
+            }
+            residual[row] = static_cast<float>(sum);
+            residual_norm = std::max(residual_norm, std::abs(sum));
+        }
+
+        // Backward stable in double precision
+        if (residual_norm <=
+            eps * n * (a_norm * NormInf(x) + NormInf(b))) {
+            return true;
+        }
+
+        std::vector<float> correction = LUSolve(f, residual);
+        double correction_norm = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            x[i] += correction[i];
+            correction_norm = std::max(
+                correction_norm, std::abs(static_cast<double>(correction[i])));
+        }
+
+        if (correction_norm <= eps * NormInf(x)) {
+            iterations++;
+            return true;
+        }
+
+        // The refinement diverges or stagnates when cond(A) is too big
+        if (correction_norm > 0.5 * last_correction) {
+            iterations++;
+            return false;
+        }
+        last_correction = correction_norm;
+    }
+
+    return false;
+}
+
+}  // namespace detail
+
+template <typename T>
+RefinedSolution<std::vector<double>> MixedPrecisionSolve(
+    const Matrix<T>& m, const std::vector<T>& b, size_t max_iterations = 10) {
+    Matrix<double> a = MatrixCast<double>(m);
+    LUFactorization<float> f = LUDecomposition(MatrixCast<float>(m));
+
+    RefinedSolution<std::vector<double>> result{
+        std::vector<double>(m.NumRows()), 0.0, 0, false};
+
+    if (f.singular || b.size() != m.NumRows()) {
+        result.condition = std::numeric_limits<double>::infinity();
+        return result;
+    }
+
+    result.condition =
+        NormOne(a) * static_cast<double>(InverseNormOneEstimate(f));
+    result.converged = detail::RefineSolution(
+        a, NormInf(a), f, std::vector<double>(b.begin(), b.end()),
+        result.value, max_iterations, result.iterations);
+
+    return result;
+}
+
+template <typename T>
+RefinedSolution<Matrix<double>> MixedPrecisionInverse(
+    const Matrix<T>& m, size_t max_iterations = 10) {
+    Matrix<double> a = MatrixCast<double>(m);
+    LUFactorization<float> f = LUDecomposition(MatrixCast<float>(m));
+
+    size_t n = m.NumRows();
+    RefinedSolution<Matrix<double>> result{Matrix<double>(n, n), 0.0, 0,
+                                           true};
+
+    if (f.singular) {
+        result.condition = std::numeric_limits<double>::infinity();
+        result.converged = false;
+        return result;
+    }
+
+    // Solve A * X = I column by column
+    double a_norm = NormInf(a);
+    std::vector<double> e(n, 0.0);
+    std::vector<double> x;
+    for (size_t column = 0; column < n; column++) {
+        size_t iterations = 0;
+        e[column] = 1.0;
+        result.converged &= detail::RefineSolution(a, a_norm, f, e, x,
+                                                   max_iterations, iterations);
+        e[column] = 0.0;
+
+        for (size_t row = 0; row < n; row++) {
+            result.value(column, row) = x[row];
+        }
+        result.iterations = std::max(result.iterations, iterations);
+    }
+
+    result.condition = NormOne(a) * NormOne(result.value);
+
+    return result;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#include "RingBuffer.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous logging
+// The log macros format the message in the calling thread into a fixed size
+// record and push it to a lock-free ring buffer, a background thread drains
+// the buffer and does the actual writes. When the buffer is full the records
+// are dropped and counted instead of blocking the caller.
+//
+// The levels below LOG_LEVEL are removed at compile time, the arguments of
+// those messages are never evaluated.
+//
+//     LOG_INFO("User '" << username << "' joins the chat server");
+///////////////////////////////////////////////////////////////////////////////
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MESSAGE(level_value, level, message)                 \
+    do {                                                         \
+        if (level_value >= LOG_LEVEL) {                          \
+            LogFormatter& log_formatter_ = LogFormatter::Get();  \
+            log_formatter_.Stream() << message;                  \
+            log_formatter_.Commit(level);                        \
+        }                                                        \
+    } while (0)
+
+#define LOG_DEBUG(message) \
+    LOG_MESSAGE(LOG_LEVEL_DEBUG, LogLevel::DEBUG, message)
+#define LOG_INFO(message) LOG_MESSAGE(LOG_LEVEL_INFO, LogLevel::INFO, message)
+#define LOG_WARNING(message) \
+    LOG_MESSAGE(LOG_LEVEL_WARNING, LogLevel::WARNING, message)
+#define LOG_ERROR(message) \
+    LOG_MESSAGE(LOG_LEVEL_ERROR, LogLevel::ERROR, message)
+
+enum class LogLevel : uint8_t {
+    DEBUG = LOG_LEVEL_DEBUG,
+    INFO = LOG_LEVEL_INFO,
+    WARNING = LOG_LEVEL_WARNING,
+    ERROR = LOG_LEVEL_ERROR
+};
+
+class Logger {
+public:
+    // Size of the message text, longer messages are truncated
+    static const size_t kMaxMessageSize = 232;
+
+    // Number of records of the buffer, bounds the memory used to ~1MB
+    static const size_t kCapacity = 4096;
+
+public:
+    static Logger& Instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger() {
+        running_ = false;
+        thread_.join();
+    }
+
+    void Push(LogLevel level, const char* text, size_t size, bool truncated) {
+        std::chrono::system_clock::time_point time =
+            std::chrono::system_clock::now();
+
+        bool pushed = records_.TryPush([&](Record& record) {
+            record.level = level;
+            record.time = time;
+            record.size = static_cast<uint16_t>(size);
+            std::memcpy(record.text, text, size);
+        });
+
+        if (!pushed) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+        if (truncated) {
+            truncated_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Wait until all the pushed records are written
+    void Flush() {
+        uint64_t target = pushed_.load();
+        while (written_.load() < target) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    uint64_t Dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Truncated() const {
+        return truncated_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Record {
+        std::chrono::system_clock::time_point time;
+        LogLevel level;
+        uint16_t size;
+        char text[kMaxMessageSize];
+    };
+
+    Logger()
+          : records_(kCapacity),
+            running_(true),
+            dropped_(0),
+            truncated_(0),
+            pushed_(0),
+            written_(0) {
+        thread_ = std::thread(&Logger::Run, this);
+    }
+
+    void Run() {
+        std::string out;
+        std::string err;
+        uint64_t reported_dropped = 0;
+
+        while (true) {
+            // Keep running until the buffer is empty after the stop request
+            bool running = running_.load();
+
+            size_t count = 0;
+            while (count < kCapacity &&
+                   records_.TryPop([&](Record& record) {
+                       Format(record, (record.level >= LogLevel::WARNING)
+                                          ? err
+                                          : out);
+                   })) {
+                count++;
+            }
+
+            uint64_t dropped = Dropped();
+            if (dropped != reported_dropped) {
+                err += "[WARNING] Log buffer full, ";
+                err += std::to_string(dropped - reported_dropped);
+                err += " records dropped\n";
+                reported_dropped = dropped;
+            }
+
+            if (!out.empty()) {
+                std::fwrite(out.data(), 1, out.size(), stdout);
+                std::fflush(stdout);
+                out.clear();
+            }
+            if (!err.empty()) {
+                std::fwrite(err.data(), 1, err.size(), stderr);
+                std::fflush(stderr);
+                err.clear();
+            }
+            written_ += count;
+
+            if (count == 0) {
+                if (!running) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    static void Format(const Record& record, std::string& output) {
+        static const char* names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+        std::time_t time = std::chrono::system_clock::to_time_t(record.time);
+        long milliseconds = static_cast<long>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                record.time.time_since_epoch())
+                .count() %
+            1000);
+
+        char header[64];
+        size_t size = std::strftime(header, sizeof(header), "%H:%M:%S",
+                                    std::localtime(&time));
+        size += std::snprintf(header + size, sizeof(header) - size,
+                              ".%03ld [%s] ", milliseconds,
+                              names[static_cast<int>(record.level)]);
+
+        output.append(header, size);
+        output.append(record.text, record.size);
+        output.push_back('\n');
+    }
+
+private:
+    RingBuffer<Record> records_;
+    std::atomic<bool> running_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> truncated_;
+    std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> written_;
+    std::thread thread_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Per thread formatter used by the log macros
+// Formats the message in a fixed size buffer, so there is no allocation when
+// logging.
+///////////////////////////////////////////////////////////////////////////////
+
+class LogFormatter : private std::streambuf {
+public:
+    static LogFormatter& Get() {
+        static thread_local LogFormatter formatter;
+        return formatter;
+    }
+
+    std::ostream& Stream() {
+        return stream_;
+    }
+
+    void Commit(LogLevel level) {
+        size_t size = static_cast<size_t>(pptr() - pbase());
+        Logger::Instance().Push(level, buffer_, size, truncated_);
+
+        // Reset the buffer for the next message
+        setp(buffer_, buffer_ + sizeof(buffer_));
+        stream_.clear();
+        truncated_ = false;
+    }
+
+private:
+    LogFormatter() : stream_(this), truncated_(false) {
+        setp(buffer_, buffer_ + sizeof(buffer_));
+    }
+
+    int_type overflow(int_type /*ch*/) override {
+        truncated_ = true;
+        return traits_type::eof();
+    }
+
+private:
+    char buffer_[Logger::kMaxMessageSize];
+    std::ostream stream_;
+    bool truncated_;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <string>
+#include <utility>
+
+///////////////////////////////////////////////////////////////////////////////
+// Read-only memory mapped file
+// The pages are loaded by the kernel when they are touched, so opening a big
+// file costs nothing until it is read, and the page cache is shared with the
+// other readers of the file. An empty file is valid and has no data.
+///////////////////////////////////////////////////////////////////////////////
+
+class MappedFile {
+public:
+    MappedFile() : data_(nullptr), size_(0) {}
+
+    ~MappedFile() {
+        Close();
+    }
+
+    MappedFile(MappedFile&& other) : data_(other.data_), size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) {
+        if (this != &other) {
+            Close();
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+        }
+        return *this;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& path) {
+        Close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        bool opened = ::fstat(fd, &info) == 0;
+        if (opened && info.st_size > 0) {
+            void* data = ::mmap(nullptr, static_cast<size_t>(info.st_size),
+                                PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                opened = false;
+            } else {
+                data_ = static_cast<const char*>(data);
+                size_ = static_cast<size_t>(info.st_size);
+            }
+        }
+        ::close(fd);  // The mapping keeps the file alive
+        return opened;
+    }
+
+    void Close() {
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
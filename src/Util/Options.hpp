@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// Command line options shared by the servers and the clients
+///////////////////////////////////////////////////////////////////////////////
+
+// Removes "name value" from the arguments and stores the value, the other
+// arguments keep its order so they can be parsed as before. Returns false
+// if the option is not present.
+inline bool TakeOption(int& argc, char** argv, const std::string& name,
+                       std::string& value) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (name != argv[i]) continue;
+        value = argv[i + 1];
+        for (int j = i; j + 2 < argc; j++) argv[j] = argv[j + 2];
+        argc -= 2;
+        return true;
+    }
+    return false;
+}
+
+// The transports of ZeroMQ that the programs support, an inproc endpoint
+// can only be reached from the same process (see Embedded/)
+inline bool IsValidEndpoint(const std::string& endpoint) {
+    static const char* const kTransports[] = {"tcp://", "ipc://",
+                                              "inproc://"};
+    for (const char* transport : kTransports) {
+        std::string prefix(transport);
+        if (endpoint.size() > prefix.size() &&
+            endpoint.compare(0, prefix.size(), prefix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+
+#include "Serializer.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Typed message schemas
+// Each message is a struct that derives from Schema<Tag> and lists its fields
+// with SCHEMA_FIELDS. A frame is the integer tag of the message followed by
+// its fields in order. The packing, unpacking and dispatch code is generated
+// from the declaration.
+//
+//     struct Ping : Schema<1> {
+//         std::string from;
+//         uint64_t time;
+//         SCHEMA_FIELDS(from, time)
+//     };
+//
+//     Pack(output, ping);
+//     Dispatcher<Handler, Ping, Pong>::Dispatch(handler, input);
+///////////////////////////////////////////////////////////////////////////////
+
+#define SCHEMA_FIELDS(...)                                     \
+    auto Fields() -> decltype(std::tie(__VA_ARGS__)) {         \
+        return std::tie(__VA_ARGS__);                          \
+    }                                                          \
+    auto Fields() const -> decltype(std::tie(__VA_ARGS__)) {   \
+        return std::tie(__VA_ARGS__);                          \
+    }
+
+template <uint8_t Tag>
+struct Schema {
+    static constexpr uint8_t kTag = Tag;
+};
+
+template <uint8_t Tag>
+constexpr uint8_t Schema<Tag>::kTag;
+
+namespace detail {
+
+template <size_t I, size_t N>
+struct FieldLoop {
+    template <typename Tuple>
+    static void Pack(Serializer& output, const Tuple& fields) {
+        output << std::get<I>(fields);
+        FieldLoop<I + 1, N>::Pack(output, fields);
+    }
+
+    template <typename Tuple>
+    static void Unpack(Deserializer& input, Tuple& fields) {
+        input >> std::get<I>(fields);
+        FieldLoop<I + 1, N>::Unpack(input, fields);
+    }
+};
+
+template <size_t N>
+struct FieldLoop<N, N> {
+    template <typename Tuple>
+    static void Pack(Serializer& /*output*/, const Tuple& /*fields*/) {}
+
+    template <typename Tuple>
+    static void Unpack(Deserializer& /*input*/, Tuple& /*fields*/) {}
+};
+
+}  // namespace detail
+
+template <typename Message>
+void Pack(Serializer& output, const Message& message) {
+    using Fields = decltype(message.Fields());
+    output << Message::kTag;
+    detail::FieldLoop<0, std::tuple_size<Fields>::value>::Pack(
+        output, message.Fields());
+}
+
+// Unpacks the fields of a message whose tag was already read
+template <typename Message>
+void Unpack(Deserializer& input, Message& message) {
+    auto fields = message.Fields();
+    detail::FieldLoop<0, std::tuple_size<decltype(fields)>::value>::Unpack(
+        input, fields);
+}
+
+// Unpacks the message only if the next object of the frame is its tag, used
+// for optional prefixes. The tag must be below 128 so it is a single byte.
+template <typename Message>
+bool UnpackIf(Deserializer& input, Message& message) {
+    static_assert(Message::kTag < 128, "The tag must be a positive fixint");
+    if (input.AtEnd() || input.Peek() != Message::kTag) return false;
+    uint8_t tag;
+    input >> tag;
+    Unpack(input, message);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dispatcher
+// Reads the tag of a frame, unpacks the message with that tag and calls
+// handler(message). The messages are found with a table indexed by tag, built
+// once from the list of messages.
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename Handler, typename... Messages>
+class Dispatcher {
+public:
+    // Returns false if the frame has no tag or the tag is not one of the
+    // messages, throws if the message can't be unpacked
+    static bool Dispatch(Handler& handler, Deserializer& input) {
+        static const Table table;
+
+        if (input.AtEnd()) return false;
+        uint8_t tag;
+        input >> tag;
+
+        Function function = table.functions[tag];
+        if (!function) return false;
+        function(handler, input);
+        return true;
+    }
+
+private:
+    using Function = void (*)(Handler&, Deserializer&);
+
+    template <typename Message>
+    static void Invoke(Handler& handler, Deserializer& input) {
+        Message message;
+        Unpack(input, message);
+        handler(message);
+    }
+
+    struct Table {
+        Table() : functions() {
+            int expand[] = {0, (functions[Messages::kTag] =
+                                    &Dispatcher::Invoke<Messages>,
+                                0)...};
+            (void)expand;
+        }
+
+        Function functions[256];
+    };
+};
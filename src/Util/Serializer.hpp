@@ -2,16 +2,52 @@
 
 #include <cstdint>
 #include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <zmq.hpp>
 
+#include "BufferPool.hpp"
+#include "Compression.hpp"
 #include "MsgPackAdaptors.hpp"
+#include "Views.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Serializer
+// The data is packed in a buffer from the BufferPool, a CapacityHint can be
+// given to start with a buffer of the expected size of the message. Release()
+// hands the buffer to a zmq::message_t without copying it, it returns to the
+// pool when ZMQ is done with it. Compress() replaces the data with a
+// compressed frame when the lz::Context decides it is worth it.
+///////////////////////////////////////////////////////////////////////////////
 
 class Serializer {
 public:
-    Serializer() : buffer_(), packer_(buffer_) {}
+    // Smaller messages are copied, ZMQ stores them inside the message
+    static const size_t kMinZeroCopySize = 64;
+
+public:
+    Serializer() : buffer_(), hint_(nullptr) {}
+
+    explicit Serializer(CapacityHint& hint)
+          : buffer_(hint.Get()), hint_(&hint) {}
+
+    Serializer(Serializer&& other) = default;
+    Serializer& operator=(Serializer&& other) = default;
+
+    ~Serializer() {
+        RecordSize();
+    }
 
     template <typename D>
     Serializer& operator<<(const D& data) {
-        packer_.pack(data);
+        msgpack::packer<PooledBuffer>(buffer_).pack(data);
+        return *this;
+    }
+
+    // Append an already encoded object
+    Serializer& operator<<(const RawObject& data) {
+        buffer_.write(data.data(), data.size());
         return *this;
     }
 
@@ -27,33 +63,158 @@ public:
         return buffer_.size();
     };
 
+    // Writes the compressed frame of the data in output, returns false if the
+    // data is below the threshold of the context or doesn't compress
+    bool Compress(lz::Context& context, Serializer& output) const {
+        return Compress(context, buffer_.data(), buffer_.size(), output);
+    }
+
+    // Same for bytes that are not in a Serializer, e.g. a released message
+    static bool Compress(lz::Context& context, const char* data, size_t size,
+                         Serializer& output) {
+        return context.Compress(data, size, output.buffer_);
+    }
+
+    bool Compress(lz::Context& context) {
+        Serializer output;
+        if (!Compress(context, output)) return false;
+        RecordSize();
+        buffer_ = std::move(output.buffer_);
+        return true;
+    }
+
+    // Moves the data to a message, the Serializer is left empty
+    zmq::message_t Release() {
+        RecordSize();
+        size_t size = buffer_.size();
+        if (size < kMinZeroCopySize) {
+            zmq::message_t message(buffer_.data(), size);
+            buffer_ = PooledBuffer();
+            return message;
+        }
+        size_t capacity = buffer_.capacity();
+        return zmq::message_t(buffer_.Release(), size,
+                              &BufferPool::FreeMessage,
+                              reinterpret_cast<void*>(capacity));
+    }
+
+private:
+    void RecordSize() {
+        if (hint_ && buffer_.size() > 0) hint_->Record(buffer_.size());
+        hint_ = nullptr;
+    }
+
 private:
-    msgpack::sbuffer buffer_;
-    msgpack::packer<msgpack::sbuffer> packer_;
+    PooledBuffer buffer_;
+    CapacityHint* hint_;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Deserializer
+// The objects are unpacked one by one over the bytes of the message, strings
+// and bin data are not copied but referenced, so they can be extracted as
+// views (StringView, BinView, ArrayView, RawObject). The views are valid
+// while the Deserializer is alive and has not been moved.
+//
+// Constructed from a zmq::message_t the message is kept alive and nothing is
+// copied, from a pointer the data is copied once into an owned buffer.
+// Compressed frames are detected and decompressed into the owned buffer.
+///////////////////////////////////////////////////////////////////////////////
+
 class Deserializer {
 public:
-    Deserializer() : unpacker_() {}
+    Deserializer() : offset_(0), compressed_(false) {}
 
-    Deserializer(const char* data, size_t size) {
-        unpacker_.reserve_buffer(size);
-        std::memcpy(unpacker_.buffer(), data, size);
-        unpacker_.buffer_consumed(size);
+    Deserializer(const char* data, size_t size)
+          : offset_(0), compressed_(lz::IsCompressed(data, size)) {
+        if (compressed_) {
+            lz::Decompress(data, size, buffer_);
+        } else {
+            buffer_.assign(data, data + size);
+        }
     }
 
     Deserializer(const msgpack::sbuffer& buffer)
           : Deserializer(buffer.data(), buffer.size()) {}
 
+    explicit Deserializer(zmq::message_t&& message)
+          : message_(std::move(message)), offset_(0), compressed_(false) {
+        const char* data = static_cast<const char*>(message_.data());
+        if (lz::IsCompressed(data, message_.size())) {
+            lz::Decompress(data, message_.size(), buffer_);
+            message_ = zmq::message_t();
+            compressed_ = true;
+        }
+    }
+
+    Deserializer(Deserializer&& other) = default;
+    Deserializer& operator=(Deserializer&& other) = default;
+
     template <typename D>
     Deserializer& operator>>(D& data) {
-        msgpack::object_handle message;
-        if (unpacker_.next(message)) {
-            data = message.get().as<D>();
+        msgpack::object object;
+        if (Next(object)) {
+            data = object.as<D>();
+        }
+        return *this;
+    }
+
+    Deserializer& operator>>(RawObject& data) {
+        size_t begin = offset_;
+        msgpack::object object;
+        if (Next(object)) {
+            data = RawObject(Data() + begin, offset_ - begin);
         }
         return *this;
     }
 
+    // Whether all the objects were extracted
+    bool AtEnd() const {
+        return offset_ >= Size();
+    }
+
+    // First byte of the next object, it must not be at the end
+    uint8_t Peek() const {
+        return static_cast<uint8_t>(Data()[offset_]);
+    }
+
+    // Whether the data was received as a compressed frame
+    bool WasCompressed() const {
+        return compressed_;
+    }
+
+private:
+    const char* Data() const {
+        // Small messages are stored inside the zmq::message_t, so the pointer
+        // can't be cached
+        return buffer_.empty() ? static_cast<const char*>(message_.data())
+                               : buffer_.data();
+    }
+
+    size_t Size() const {
+        return buffer_.empty() ? message_.size() : buffer_.size();
+    }
+
+    bool Next(msgpack::object& object) {
+        if (AtEnd()) return false;
+        // All the objects share the same zone, it is only used for arrays and
+        // maps because everything else references the data
+        if (!zone_) zone_.reset(new msgpack::zone);
+        bool referenced;
+        object = msgpack::unpack(*zone_, Data(), Size(), offset_, referenced,
+                                 &Deserializer::ReferenceData);
+        return true;
+    }
+
+    static bool ReferenceData(msgpack::type::object_type /*type*/,
+                              size_t /*size*/, void* /*user_data*/) {
+        return true;
+    }
+
 private:
-    msgpack::unpacker unpacker_;
+    std::vector<char> buffer_;
+    zmq::message_t message_;
+    std::unique_ptr<msgpack::zone> zone_;
+    size_t offset_;
+    bool compressed_;
 };
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+///////////////////////////////////////////////////////////////////////////////
+// Sampled tracing
+// A trace follows a message through all the processes it touches. The
+// process that sends it decides if it is sampled and gives it a random id,
+// the id travels with the message and each process records its spans in its
+// own span file. Trace_Merge joins the span files in a Chrome trace.
+//
+// The tracing is enabled with environment variables:
+//     TRACE_FILE         File where the spans of the process are written
+//     TRACE_SAMPLE_RATE  Fraction of the messages that start a trace
+//                        (default 0.01)
+//
+// A span file has a header line and then a line per span, the times are
+// microseconds since the epoch:
+//     # process Chat_Server
+//     <trace id in hex> <name> <start> <duration> <thread>
+///////////////////////////////////////////////////////////////////////////////
+
+namespace trace {
+
+// The spans of different processes can only be compared if they run in the
+// same machine or the clocks are synchronized
+inline uint64_t Now() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+}
+
+class Tracer {
+public:
+    static Tracer& Instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    ~Tracer() {
+        if (file_) std::fclose(file_);
+    }
+
+    // Opens the span file if the tracing is enabled in the environment
+    void Initialize(const std::string& process) {
+        const char* path = std::getenv("TRACE_FILE");
+        if (!path || file_) return;
+
+        const char* rate = std::getenv("TRACE_SAMPLE_RATE");
+        if (rate) sample_rate_ = std::atof(rate);
+
+        file_ = std::fopen(path, "w");
+        if (file_) std::fprintf(file_, "# process %s\n", process.c_str());
+    }
+
+    bool Enabled() const {
+        return file_ != nullptr;
+    }
+
+    // Id of a new trace, or 0 if the message is not sampled
+    uint64_t StartTrace() {
+        if (!file_) return 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sample_(rng_) >= sample_rate_) return 0;
+        uint64_t trace_id;
+        do {
+            trace_id = rng_();
+        } while (trace_id == 0);
+        return trace_id;
+    }
+
+    void Record(uint64_t trace_id, const char* name, uint64_t start,
+                uint64_t end) {
+        if (!file_ || trace_id == 0) return;
+        uint64_t duration = end > start ? end - start : 0;  // Clock skew
+        unsigned long thread = static_cast<unsigned long>(
+            std::hash<std::thread::id>()(std::this_thread::get_id()) &
+            0xFFFFFFFF);
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::fprintf(file_, "%016llx %s %llu %llu %lu\n",
+                     static_cast<unsigned long long>(trace_id), name,
+                     static_cast<unsigned long long>(start),
+                     static_cast<unsigned long long>(duration), thread);
+    }
+
+private:
+    Tracer()
+          : file_(nullptr),
+            sample_rate_(0.01),
+            rng_(std::random_device{}()),
+            sample_(0.0, 1.0) {}
+
+private:
+    std::FILE* file_;
+    double sample_rate_;
+    std::mutex mutex_;
+    std::mt19937_64 rng_;
+    std::uniform_real_distribution<double> sample_;
+};
+
+// Records a span from its construction to its destruction, it does nothing
+// if the trace id is 0
+class Span {
+public:
+    Span(uint64_t trace_id, const char* name)
+          : trace_id_(trace_id), name_(name), start_(trace_id ? Now() : 0) {}
+
+    ~Span() {
+        if (trace_id_) {
+            Tracer::Instance().Record(trace_id_, name_, start_, Now());
+        }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    uint64_t trace_id_;
+    const char* name_;
+    uint64_t start_;
+};
+
+}  // namespace trace
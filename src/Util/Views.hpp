@@ -0,0 +1,284 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "MsgPackAdaptors.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Non owning views over unpacked data
+// They reference the bytes of the message (or the zone) of the Deserializer
+// they were extracted from, so they are only valid while that Deserializer
+// is alive and has not been moved.
+///////////////////////////////////////////////////////////////////////////////
+
+class StringView {
+public:
+    StringView() : data_(nullptr), size_(0) {}
+
+    StringView(const char* data, size_t size) : data_(data), size_(size) {}
+
+    StringView(const char* str) : data_(str), size_(std::strlen(str)) {}
+
+    StringView(const std::string& str) : data_(str.data()), size_(str.size()) {}
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const char* begin() const {
+        return data_;
+    }
+
+    const char* end() const {
+        return data_ + size_;
+    }
+
+    char operator[](size_t pos) const {
+        return data_[pos];
+    }
+
+    std::string ToString() const {
+        return std::string(data_, size_);
+    }
+
+    friend bool operator==(const StringView& a, const StringView& b) {
+        return a.size_ == b.size_ &&
+               (a.size_ == 0 || std::memcmp(a.data_, b.data_, a.size_) == 0);
+    }
+
+    friend bool operator!=(const StringView& a, const StringView& b) {
+        return !(a == b);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const StringView& str) {
+        return os.write(str.data_, str.size_);
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// Contiguous memory, used to reference bin data
+template <typename T>
+class Span {
+public:
+    Span() : data_(nullptr), size_(0) {}
+
+    Span(const T* data, size_t size) : data_(data), size_(size) {}
+
+    const T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    const T& operator[](size_t pos) const {
+        return data_[pos];
+    }
+
+private:
+    const T* data_;
+    size_t size_;
+};
+
+using BinView = Span<char>;
+
+// Array of objects that are converted to T when accessed
+template <typename T>
+class ArrayView {
+public:
+    class Iterator {
+    public:
+        Iterator(const msgpack::object* ptr) : ptr_(ptr) {}
+
+        T operator*() const {
+            return ptr_->as<T>();
+        }
+
+        Iterator& operator++() {
+            ++ptr_;
+            return *this;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return ptr_ != other.ptr_;
+        }
+
+    private:
+        const msgpack::object* ptr_;
+    };
+
+public:
+    ArrayView() : ptr_(nullptr), size_(0) {}
+
+    ArrayView(const msgpack::object* ptr, size_t size)
+          : ptr_(ptr), size_(size) {}
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    Iterator begin() const {
+        return Iterator(ptr_);
+    }
+
+    Iterator end() const {
+        return Iterator(ptr_ + size_);
+    }
+
+    T operator[](size_t pos) const {
+        return ptr_[pos].as<T>();
+    }
+
+    const msgpack::object* objects() const {
+        return ptr_;
+    }
+
+    std::vector<T> ToVector() const {
+        std::vector<T> result;
+        result.reserve(size_);
+        for (size_t i = 0; i < size_; i++) {
+            result.push_back(ptr_[i].as<T>());
+        }
+        return result;
+    }
+
+private:
+    const msgpack::object* ptr_;
+    size_t size_;
+};
+
+// The encoded bytes of a top level object, they can be written as they are
+// to a Serializer to forward an object without unpacking it
+class RawObject {
+public:
+    RawObject() : data_(nullptr), size_(0) {}
+
+    RawObject(const char* data, size_t size) : data_(data), size_(size) {}
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// User defined class template specialization
+namespace msgpack {
+inline namespace v2 {
+namespace adaptor {
+
+template <>
+struct convert<StringView> {
+    const msgpack::object& operator()(const msgpack::object& o,
+                                      StringView& v) const {
+        if (o.type == msgpack::type::STR) {
+            v = StringView(o.via.str.ptr, o.via.str.size);
+        } else if (o.type == msgpack::type::BIN) {
+            v = StringView(o.via.bin.ptr, o.via.bin.size);
+        } else {
+            throw msgpack::type_error();
+        }
+        return o;
+    }
+};
+
+template <>
+struct pack<StringView> {
+    template <typename Stream>
+    packer<Stream>& operator()(msgpack::packer<Stream>& o,
+                               const StringView& v) const {
+        o.pack_str(static_cast<uint32_t>(v.size()));
+        o.pack_str_body(v.data(), static_cast<uint32_t>(v.size()));
+        return o;
+    }
+};
+
+template <>
+struct convert<BinView> {
+    const msgpack::object& operator()(const msgpack::object& o,
+                                      BinView& v) const {
+        if (o.type != msgpack::type::BIN) throw msgpack::type_error();
+        v = BinView(o.via.bin.ptr, o.via.bin.size);
+        return o;
+    }
+};
+
+template <>
+struct pack<BinView> {
+    template <typename Stream>
+    packer<Stream>& operator()(msgpack::packer<Stream>& o,
+                               const BinView& v) const {
+        o.pack_bin(static_cast<uint32_t>(v.size()));
+        o.pack_bin_body(v.data(), static_cast<uint32_t>(v.size()));
+        return o;
+    }
+};
+
+template <typename T>
+struct convert<ArrayView<T>> {
+    const msgpack::object& operator()(const msgpack::object& o,
+                                      ArrayView<T>& v) const {
+        if (o.type != msgpack::type::ARRAY) throw msgpack::type_error();
+        v = ArrayView<T>(o.via.array.ptr, o.via.array.size);
+        return o;
+    }
+};
+
+template <typename T>
+struct pack<ArrayView<T>> {
+    template <typename Stream>
+    packer<Stream>& operator()(msgpack::packer<Stream>& o,
+                               const ArrayView<T>& v) const {
+        o.pack_array(static_cast<uint32_t>(v.size()));
+        for (size_t i = 0; i < v.size(); i++) {
+            o.pack(v.objects()[i]);
+        }
+        return o;
+    }
+};
+
+}  // namespace adaptor
+}  // namespace v2
+}  // namespace msgpack
@@ -0,0 +1,420 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FileSystem.hpp"
+#include "Log.hpp"
+#include "MappedFile.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// Write-ahead log
+// The records are appended to an in-memory batch and the caller never waits
+// for the disk. A writer thread takes the whole batch, writes it and syncs
+// it once, so the records appended while the previous sync was running are
+// committed together (group commit). After each commit the callback is
+// called from the writer thread with the last durable sequence.
+//
+// The log is split in segment files named by the sequence of their first
+// record, Rotate starts a new one and the segments covered by a snapshot are
+// removed. Each record is framed as:
+//     | size (u32) | checksum (u32) | sequence (u64) | payload |
+// The position of a payload in its segment is known when it is appended, so
+// the records can be read back from the segment files.
+// A crash can leave a torn record at the end of a segment, the replay stops
+// there and truncates the segment.
+//
+// A failed write or sync is logged and counted. The segment is truncated
+// back to its last synced record, so a partial write never stays in the
+// middle of it, and the records are written again every second.
+// They are not reported durable until then, so the responses held for them
+// keep waiting.
+///////////////////////////////////////////////////////////////////////////////
+
+class WriteAheadLog {
+public:
+    // Where the payload of a record is stored
+    struct Position {
+        uint64_t segment;  // First sequence of the segment
+        uint64_t offset;
+    };
+
+    using CommitCallback = std::function<void(uint64_t)>;
+    using RecordFunction =
+        std::function<void(uint64_t sequence, const char* data, size_t size,
+                           const Position& position)>;
+
+    static const size_t kHeaderSize = 16;
+
+public:
+    explicit WriteAheadLog(const std::string& directory)
+          : directory_(directory),
+            fd_(-1),
+            segment_(0),
+            synced_size_(0),
+            written_size_(0),
+            last_sequence_(0),
+            append_segment_(0),
+            append_offset_(0),
+            durable_sequence_(0),
+            commits_(0),
+            failures_(0),
+            stopping_(false) {}
+
+    ~WriteAheadLog() {
+        Close();
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Calls the function with the records after the sequence, in order.
+    // Returns the sequence of the last record in the log, or after if there
+    // are none.
+    uint64_t Replay(uint64_t after, const RecordFunction& function) const {
+        uint64_t last = after;
+        for (auto& name : fs::ListFiles(directory_, Prefix())) {
+            std::string path = fs::JoinPath(directory_, name);
+            MappedFile file;
+            if (!file.Open(path)) {
+                LOG_ERROR("Can't read the log segment " << path);
+                continue;
+            }
+
+            size_t offset = 0;
+            while (offset < file.Size()) {
+                uint32_t size, checksum;
+                uint64_t sequence;
+                const char* header = file.Data() + offset;
+                if (file.Size() - offset < kHeaderSize) break;
+                std::memcpy(&size, header, 4);
+                std::memcpy(&checksum, header + 4, 4);
+                std::memcpy(&sequence, header + 8, 8);
+                if (file.Size() - offset - kHeaderSize < size) break;
+
+                const char* payload = header + kHeaderSize;
+                if (Checksum(sequence, payload, size) != checksum) break;
+                if (sequence > after) {
+                    Position position{FirstSequence(name),
+                                      offset + kHeaderSize};
+                    function(sequence, payload, size, position);
+                }
+                if (sequence > last) last = sequence;
+                offset += kHeaderSize + size;
+            }
+
+            if (offset < file.Size()) {
+                LOG_WARNING("Torn record at the end of " << path
+                                                         << ", truncated");
+                file.Close();
+                off_t length = static_cast<off_t>(offset);
+                if (::truncate(path.c_str(), length) != 0) {
+                    LOG_ERROR("Can't truncate " << path);
+                }
+            }
+        }
+        return last;
+    }
+
+    // Starts the writer thread, the next record has the sequence. The
+    // callback is optional.
+    bool Open(uint64_t next_sequence, CommitCallback callback) {
+        if (!fs::MakeDirectories(directory_)) return false;
+        last_sequence_ = next_sequence - 1;
+        append_segment_ = next_sequence;
+        append_offset_ = 0;
+        durable_sequence_ = last_sequence_;
+        callback_ = std::move(callback);
+        if (!OpenSegment(next_sequence)) return false;
+        stopping_ = false;
+        thread_ = std::thread(&WriteAheadLog::Run, this);
+        return true;
+    }
+
+    // Commits the pending records and stops the writer thread
+    void Close() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            condition_.notify_one();
+            thread_.join();
+        }
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Returns the sequence of the record, and where it is written if
+    // position is given
+    uint64_t Append(const char* data, size_t size,
+                    Position* position = nullptr) {
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sequence = ++last_sequence_;
+            if (position) {
+                position->segment = append_segment_;
+                position->offset = append_offset_ + kHeaderSize;
+            }
+            append_offset_ += kHeaderSize + size;
+            Batch& batch = CurrentBatch();
+            char header[kHeaderSize];
+            uint32_t size32 = static_cast<uint32_t>(size);
+            uint32_t checksum = Checksum(sequence, data, size);
+            std::memcpy(header, &size32, 4);
+            std::memcpy(header + 4, &checksum, 4);
+            std::memcpy(header + 8, &sequence, 8);
+            batch.data.append(header, kHeaderSize);
+            batch.data.append(data, size);
+            batch.last_sequence = sequence;
+        }
+        condition_.notify_one();
+        return sequence;
+    }
+
+    // The next records go to a new segment, returns the last sequence of the
+    // previous ones
+    uint64_t Rotate() {
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sequence = last_sequence_;
+            Batch& batch = CurrentBatch();
+            batch.last_sequence = sequence;
+            batch.rotate = true;
+            append_segment_ = sequence + 1;
+            append_offset_ = 0;
+        }
+        condition_.notify_one();
+        return sequence;
+    }
+
+    // Removes the segments whose records are all at or before the sequence,
+    // the last segment is always kept
+    void RemoveSegmentsUntil(uint64_t sequence) {
+        std::vector<std::string> names = fs::ListFiles(directory_, Prefix());
+        for (size_t i = 0; i + 1 < names.size(); i++) {
+            if (FirstSequence(names[i + 1]) > sequence + 1) break;
+            fs::RemoveFile(fs::JoinPath(directory_, names[i]));
+        }
+    }
+
+    // Bytes appended to the current segment
+    uint64_t SegmentSize() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return append_offset_;
+    }
+
+    // File of the segment, its records can be read once they are durable
+    std::string SegmentPath(uint64_t segment) const {
+        return fs::JoinPath(directory_, SegmentName(segment));
+    }
+
+    uint64_t LastSequence() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_sequence_;
+    }
+
+    uint64_t DurableSequence() const {
+        return durable_sequence_.load();
+    }
+
+    // Syncs done, each one commits a batch of records
+    uint64_t Commits() const {
+        return commits_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Failures() const {
+        return failures_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const char* Prefix() {
+        return "wal-";
+    }
+
+    struct Batch {
+        std::string data;
+        uint64_t last_sequence = 0;
+        bool rotate = false;  // Start a new segment after this batch
+    };
+
+    // FNV-1a, only detects torn and corrupted records
+    static uint32_t Checksum(uint64_t sequence, const char* data,
+                             size_t size) {
+        uint32_t hash = 2166136261u;
+        const char* sequence_bytes = reinterpret_cast<const char*>(&sequence);
+        for (size_t i = 0; i < 8; i++) {
+            hash = (hash ^ static_cast<uint8_t>(sequence_bytes[i])) * 16777619u;
+        }
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    static std::string SegmentName(uint64_t first_sequence) {
+        char name[48];
+        std::snprintf(name, sizeof(name), "%s%020llu.log", Prefix(),
+                      static_cast<unsigned long long>(first_sequence));
+        return name;
+    }
+
+    static uint64_t FirstSequence(const std::string& name) {
+        const char* digits = name.c_str() + std::strlen(Prefix());
+        return std::strtoull(digits, nullptr, 10);
+    }
+
+    // Batch where the records are appended, the mutex must be locked
+    Batch& CurrentBatch() {
+        if (pending_.empty() || pending_.back().rotate) {
+            pending_.emplace_back();
+        }
+        return pending_.back();
+    }
+
+    bool OpenSegment(uint64_t first_sequence) {
+        if (fd_ >= 0) ::close(fd_);
+        segment_ = first_sequence;
+        std::string path = SegmentPath(first_sequence);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd_ < 0) {
+            LOG_ERROR("Can't open the log segment " << path);
+            return false;
+        }
+        off_t size = ::lseek(fd_, 0, SEEK_END);
+        synced_size_ = written_size_ = size > 0 ? size : 0;
+        return fs::SyncDirectory(directory_);
+    }
+
+    // Writes and syncs the batches in order, returns how many of them are
+    // durable. The ones after a failure are left in the segment, which is
+    // truncated back to the last synced record.
+    size_t WriteBatches(const std::vector<Batch>& batches) {
+        // A previous failure left the segment unopened or with unsynced data
+        if (fd_ < 0 && !OpenSegment(segment_)) return 0;
+        if (written_size_ != synced_size_ && !Truncate()) return 0;
+
+        size_t durable = 0;
+        for (size_t i = 0; i < batches.size(); i++) {
+            const Batch& batch = batches[i];
+            if (!fs::WriteAll(fd_, batch.data.data(), batch.data.size())) {
+                written_size_ = -1;  // Unknown, it is truncated anyway
+                Truncate();
+                return durable;
+            }
+            written_size_ += static_cast<off_t>(batch.data.size());
+            if (!batch.rotate) continue;
+
+            // The records before the rotation are durable once synced
+            if (!Sync()) return durable;
+            durable = i + 1;
+            if (!OpenSegment(batch.last_sequence + 1)) {
+                ::close(fd_);
+                fd_ = -1;
+                return durable;
+            }
+        }
+        if (!Sync()) return durable;
+        return batches.size();
+    }
+
+    bool Sync() {
+        if (!fs::SyncFile(fd_)) {
+            Truncate();
+            return false;
+        }
+        synced_size_ = written_size_;
+        return true;
+    }
+
+    // Removes what was written after the last sync
+    bool Truncate() {
+        if (::ftruncate(fd_, synced_size_) != 0) {
+            LOG_ERROR("Can't truncate the log segment "
+                      << SegmentPath(segment_));
+            return false;
+        }
+        written_size_ = synced_size_;
+        return true;
+    }
+
+    void Run() {
+        const std::chrono::milliseconds kRetryInterval(1000);
+        std::vector<Batch> batches;  // Taken and not durable yet
+        while (true) {
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (batches.empty()) {
+                    condition_.wait(lock, [this] {
+                        return !pending_.empty() || stopping_;
+                    });
+                } else {
+                    condition_.wait_for(lock, kRetryInterval,
+                                        [this] { return stopping_; });
+                }
+                if (pending_.empty() && batches.empty()) return;
+                for (auto& batch : pending_) {
+                    batches.push_back(std::move(batch));
+                }
+                pending_.clear();
+                stopping = stopping_;
+            }
+
+            size_t durable = WriteBatches(batches);
+            if (durable > 0) {
+                commits_++;
+                durable_sequence_ = batches[durable - 1].last_sequence;
+                if (callback_) callback_(durable_sequence_);
+                batches.erase(batches.begin(), batches.begin() + durable);
+            }
+            if (!batches.empty()) {
+                failures_++;
+                LOG_ERROR("Error writing the log in " << directory_);
+                if (stopping) {
+                    LOG_ERROR("Records after " << durable_sequence_.load()
+                                               << " not written");
+                    return;
+                }
+            }
+        }
+    }
+
+private:
+    std::string directory_;
+
+    // Current segment, only used by the writer thread after Open
+    int fd_;
+    uint64_t segment_;
+    off_t synced_size_;   // Bytes of the durable records
+    off_t written_size_;  // Bytes written, the unsynced ones may be lost
+
+    mutable std::mutex mutex_;
+    std::condition_variable condition_;
+    std::vector<Batch> pending_;
+    uint64_t last_sequence_;
+    uint64_t append_segment_;  // Segment of the next record
+    uint64_t append_offset_;
+
+    std::atomic<uint64_t> durable_sequence_;
+    std::atomic<uint64_t> commits_;
+    std::atomic<uint64_t> failures_;
+    CommitCallback callback_;
+    bool stopping_;
+    std::thread thread_;
+};
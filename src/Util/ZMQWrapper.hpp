@@ -1,30 +1,121 @@
 #pragma once
 
+#include <cstdint>
+#include <utility>
 #include <zmq.hpp>
 
+#include "Compression.hpp"
+#include "Serializer.hpp"
+
 namespace zmqw {
 
 // Wrapper classes around C++ ZMQ
 
 class socket : public zmq::socket_t {
 public:
-    // Inherite contructors
-    using zmq::socket_t::socket_t;
+    socket(zmq::context_t& context, int type)
+          : zmq::socket_t(context, type),
+            messages_in_(0),
+            messages_out_(0),
+            bytes_in_(0),
+            bytes_out_(0) {}
 
     template <typename T>
     bool recv(T& obj, int flags = 0) {
         zmq::message_t msg;
         bool result = zmq::socket_t::recv(&msg, flags);
         if (result) {
+            CountReceived(msg.size());
             obj = T(static_cast<char*>(msg.data()), msg.size());
         }
         return result;
     }
 
+    // Hand the message to the Deserializer without copying it
+    bool recv(Deserializer& obj, int flags = 0) {
+        zmq::message_t msg;
+        bool result = zmq::socket_t::recv(&msg, flags);
+        if (result) {
+            CountReceived(msg.size());
+            obj = Deserializer(std::move(msg));
+        }
+        return result;
+    }
+
+    // Receive the message as it is, to forward it without copying
+    bool recv(zmq::message_t& msg, int flags = 0) {
+        bool result = zmq::socket_t::recv(&msg, flags);
+        if (result) CountReceived(msg.size());
+        return result;
+    }
+
     template <typename T>
     bool send(const T& obj, int flags = 0) {
-        return zmq::socket_t::send(obj.data(), obj.size(), flags);
+        size_t sent = zmq::socket_t::send(obj.data(), obj.size(), flags);
+        if (sent > 0) CountSent(sent);
+        return sent > 0;
+    }
+
+    // Hand the buffer of the Serializer to ZMQ without copying it
+    bool send(Serializer&& obj, int flags = 0) {
+        zmq::message_t msg = obj.Release();
+        return send(msg, flags);
+    }
+
+    // The message is left empty, if it was made with message_t::copy the
+    // payload is shared with the other copies instead of copied
+    bool send(zmq::message_t& msg, int flags = 0) {
+        size_t size = msg.size();
+        bool result = zmq::socket_t::send(msg, flags);
+        if (result) CountSent(size);
+        return result;
     }
+
+    // Frames and bytes that went through the socket, including the
+    // identity frames
+    uint64_t MessagesReceived() const {
+        return messages_in_;
+    }
+
+    uint64_t MessagesSent() const {
+        return messages_out_;
+    }
+
+    uint64_t BytesReceived() const {
+        return bytes_in_;
+    }
+
+    uint64_t BytesSent() const {
+        return bytes_out_;
+    }
+
+    // Compression context of the messages sent by this socket, the
+    // Serializers are compressed with it before being sent
+    lz::Context& GetCompression() {
+        return compression_;
+    }
+
+    void SetCompressionThreshold(size_t threshold) {
+        compression_ = lz::Context(threshold);
+    }
+
+private:
+    void CountReceived(size_t size) {
+        messages_in_++;
+        bytes_in_ += size;
+    }
+
+    void CountSent(size_t size) {
+        messages_out_++;
+        bytes_out_ += size;
+    }
+
+private:
+    lz::Context compression_;
+    uint64_t messages_in_;
+    uint64_t messages_out_;
+    uint64_t bytes_in_;
+    uint64_t bytes_out_;
 };
 
 }